@@ -0,0 +1,258 @@
+/* admin.c
+ * Session registry and admin socket. The registry is a list of the
+ * sessions being handled, protected by a lock that is only held to
+ * link, unlink or inspect entries. A single thread serves the admin
+ * socket, one connection at a time.
+ */
+
+#include "admin.h"
+#include "server.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ADMIN_LINE_LENGTH 256
+// An admin client that sends nothing for this long is disconnected,
+// so it cannot block the admin socket
+#define ADMIN_TIMEOUT 30
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct admin_session *registry;
+static int registry_count;
+
+/** Adds a session to the registry. The entry must stay valid until
+ *  admin_unregister is called, which must happen before the session's
+ *  socket is closed.
+ *
+ *  Parameters: session: Entry of the session, owned by the caller.
+ *              fd: Socket of the session, which identifies it.
+ *              state: Initial state, as a string constant.
+ */
+void admin_register(struct admin_session *session, int fd, const char *state) {
+    session->fd = fd;
+    session->started = time(NULL);
+    session->state = state;
+    session->command = NULL;
+    session->user[0] = 0;
+    session->bytes_sent = 0;
+    session->prev = NULL;
+    pthread_mutex_lock(&registry_lock);
+    session->next = registry;
+    if (registry) registry->prev = session;
+    registry = session;
+    registry_count++;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/** Removes a session from the registry.
+ */
+void admin_unregister(struct admin_session *session) {
+    pthread_mutex_lock(&registry_lock);
+    if (session->prev)
+        session->prev->next = session->next;
+    else
+        registry = session->next;
+    if (session->next) session->next->prev = session->prev;
+    registry_count--;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/** Records the user name given by a session. The name is copied, under
+ *  the lock, since the admin thread may be reading it.
+ */
+void admin_set_user(struct admin_session *session, const char *user) {
+    pthread_mutex_lock(&registry_lock);
+    snprintf(session->user, sizeof(session->user), "%s", user);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/** Internal function that returns the number of sessions.
+ */
+static int session_count(void) {
+    pthread_mutex_lock(&registry_lock);
+    int count = registry_count;
+    pthread_mutex_unlock(&registry_lock);
+    return count;
+}
+
+/** Internal function that sends the list of sessions. The list is
+ *  formatted into memory first, so the lock is not held while sending.
+ */
+static int list_sessions(int fd) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&registry_lock);
+    // Longest line: id, state, age, bytes, command and user
+    size_t cap = 64 + (size_t) registry_count * (96 + MAX_USERNAME_SIZE);
+    char *buf = malloc(cap);
+    if (!buf) {
+        pthread_mutex_unlock(&registry_lock);
+        return send_formatted(fd, "-ERR Out of memory\r\n");
+    }
+    size_t len = snprintf(buf, cap, "+OK %d sessions\r\n", registry_count);
+    for (struct admin_session *s = registry; s; s = s->next) {
+        const char *command = __atomic_load_n(&s->command, __ATOMIC_RELAXED);
+        len += snprintf(buf + len, cap - len, "%x %s %lds %lu %s %s\r\n", s->fd,
+                        __atomic_load_n(&s->state, __ATOMIC_RELAXED),
+                        (long) (now - s->started),
+                        __atomic_load_n(&s->bytes_sent, __ATOMIC_RELAXED),
+                        command ? command : "-", s->user[0] ? s->user : "-");
+    }
+    pthread_mutex_unlock(&registry_lock);
+    len += snprintf(buf + len, cap - len, ".\r\n");
+    int rv = send_all(fd, buf, len);
+    free(buf);
+    return rv;
+}
+
+/** Internal function that closes a session. Its socket is shut down
+ *  (as the reaper does for idle sessions), which makes the session
+ *  thread see the connection end and clean up on its own. The lock
+ *  keeps the session from closing its socket in the meantime.
+ */
+static int kill_session(int fd, const char *id) {
+    char *end;
+    long target = id ? strtol(id, &end, 16) : -1;
+    if (!id || *end || target < 0)
+        return send_formatted(fd, "-ERR Expected a session id\r\n");
+    int found = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (struct admin_session *s = registry; s && !found; s = s->next) {
+        if (s->fd == target) {
+            shutdown(s->fd, SHUT_RDWR);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (!found)
+        return send_formatted(fd, "-ERR No such session\r\n");
+    dlog("%lx: Session closed by admin\n", target);
+    return send_formatted(fd, "+OK Session %lx closed\r\n", target);
+}
+
+/** Internal function that runs an admin command.
+ *
+ *  Returns: -1 if the connection must be closed, 0 otherwise.
+ */
+static int admin_command(int fd, char *line) {
+    char *words[3];
+    int nwords = split_max(line, words, 3);
+    if (nwords == 0)
+        return send_formatted(fd, "-ERR Empty command\r\n") <= 0 ? -1 : 0;
+
+    int rv;
+    if (!strcasecmp(words[0], "SESSIONS")) {
+        rv = list_sessions(fd);
+    } else if (!strcasecmp(words[0], "STATS")) {
+        struct send_guard_stats stats;
+        send_guard_get_stats(&stats);
+        rv = send_formatted(fd, "+OK sessions %d, sends waited %lu, clients stalled %lu, too slow %lu\r\n",
+                            session_count(), stats.waits, stats.stalled, stats.slow);
+    } else if (!strcasecmp(words[0], "KILL")) {
+        rv = kill_session(fd, words[1]);
+    } else if (!strcasecmp(words[0], "VERBOSE")) {
+        if (!words[1] || (strcmp(words[1], "0") && strcmp(words[1], "1")))
+            return send_formatted(fd, "-ERR Expected 0 or 1\r\n") <= 0 ? -1 : 0;
+        __atomic_store_n(&be_verbose, atoi(words[1]), __ATOMIC_RELAXED);
+        rv = send_formatted(fd, "+OK Verbose logging %s\r\n", atoi(words[1]) ? "on" : "off");
+    } else if (!strcasecmp(words[0], "RELOAD")) {
+        int users = mail_users_reload();
+        if (users < 0)
+            rv = send_formatted(fd, "-ERR Could not read the user list\r\n");
+        else
+            rv = send_formatted(fd, "+OK %d users loaded\r\n", users);
+    } else if (!strcasecmp(words[0], "DRAIN")) {
+        int active = session_count();
+        printf("Drain requested through admin socket\n");
+        server_drain();
+        rv = send_formatted(fd, "+OK Draining, %d sessions active\r\n", active);
+    } else if (!strcasecmp(words[0], "QUIT")) {
+        send_formatted(fd, "+OK Bye\r\n");
+        return -1;
+    } else {
+        rv = send_formatted(fd, "-ERR Unknown command\r\n");
+    }
+    return rv <= 0 ? -1 : 0;
+}
+
+/** Internal thread that serves the admin socket.
+ */
+static void *admin_thread(void *arg) {
+    int listener = *(int *) arg;
+    free(arg);
+    char buf[ADMIN_LINE_LENGTH];
+
+    while (1) {
+        int sock = accept(listener, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Error accepting admin connection");
+            return NULL;
+        }
+        struct timeval timeout = { .tv_sec = ADMIN_TIMEOUT };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        // Commands may arrive several per packet, or split over many
+        size_t len = 0;
+        ssize_t rv;
+        int done = 0;
+        while (!done && (rv = recv(sock, buf + len, sizeof(buf) - 1 - len, 0)) > 0) {
+            len += rv;
+            char *line = buf, *eol;
+            while (!done && (eol = memchr(line, '\n', buf + len - line)) != NULL) {
+                *eol = 0;
+                done = admin_command(sock, line) < 0;
+                line = eol + 1;
+            }
+            len -= line - buf;
+            memmove(buf, line, len);
+            if (len == sizeof(buf) - 1) {
+                send_formatted(sock, "-ERR Command too long\r\n");
+                done = 1;
+            }
+        }
+        close(sock);
+    }
+    return NULL;
+}
+
+/** Creates the admin socket and starts the thread serving it. Only the
+ *  user running the server may connect to the socket.
+ *
+ *  Parameters: path: Path of the socket, replaced if it exists.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int admin_start(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int *listener = malloc(sizeof(int));
+    if (!listener) return -1;
+    *listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    pthread_t thread;
+    if (*listener < 0 ||
+        bind(*listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 ||
+        listen(*listener, 4) < 0 ||
+        pthread_create(&thread, NULL, admin_thread, listener) != 0) {
+        if (*listener >= 0) close(*listener);
+        free(listener);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/* admin.h
+ * Local administration of a running server through a UNIX-domain
+ * socket. Sessions register themselves on start, so the socket can
+ * list them and close them. Each line received on the socket is a
+ * command, answered with +OK or -ERR like a POP3 command:
+ *
+ *   SESSIONS        lists the sessions (multi-line, ends with ".")
+ *   STATS           shows counters of sessions and slow readers
+ *   KILL <id>       closes a session
+ *   VERBOSE <0|1>   turns debug logging off or on
+ *   RELOAD          reloads users.txt
+ *   DRAIN           stops accepting connections; the server exits
+ *                   once the current sessions end
+ *   QUIT            closes the admin connection
+ *
+ * For example: socat - UNIX-CONNECT:/run/mypopd.admin
+ */
+
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+#include "mailuser.h"
+
+#include <time.h>
+
+// Registry entry of a session. The session thread updates the fields
+// as the session progresses; state and command are string constants.
+struct admin_session {
+    int fd;
+    time_t started;
+    const char *state;
+    const char *command;        // command being handled, or NULL
+    char user[MAX_USERNAME_SIZE + 1];
+    unsigned long bytes_sent;   // updated through send_counter
+    struct admin_session *prev, *next;
+};
+
+int  admin_start(const char *path);
+void admin_register(struct admin_session *session, int fd, const char *state);
+void admin_unregister(struct admin_session *session);
+void admin_set_user(struct admin_session *session, const char *user);
+
+/** Records the state of a session, or the command it is handling
+ *  (NULL when it waits for the next one). These are plain stores, so
+ *  they can be made on every command.
+ */
+static inline void admin_set_state(struct admin_session *session, const char *state) {
+    __atomic_store_n(&session->state, state, __ATOMIC_RELAXED);
+}
+
+static inline void admin_set_command(struct admin_session *session, const char *command) {
+    __atomic_store_n(&session->command, command, __ATOMIC_RELAXED);
+}
+
+#endif
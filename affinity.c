@@ -0,0 +1,115 @@
+/* affinity.c
+ * CPU sets and NUMA topology, used to place server threads.
+ *
+ * CPU lists use the kernel's format (e.g., "0-3,8,10-11"), both on the
+ * command line and in sysfs, where the CPUs of each node are listed
+ * in /sys/devices/system/node/node<N>/cpulist.
+ */
+
+#define _GNU_SOURCE
+#include "affinity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define NODE_SYSFS_FORMAT "/sys/devices/system/node/node%d/cpulist"
+
+static int node_count = 1;
+static short cpu_node[CPU_SETSIZE];
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+
+/** Parses a list of CPUs, in the format used by the kernel (ranges
+ *  and single CPUs separated by commas, e.g., "0-3,8").
+ *
+ *  Parameters: list: List to be parsed.
+ *              set: Set to the CPUs in the list.
+ *
+ *  Returns: 0 on success, -1 if the list is invalid or empty.
+ */
+int cpuset_parse(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list && !isspace((unsigned char) *list)) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list) return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        list = end;
+        if (*list == ',')
+            list++;
+        else if (*list && !isspace((unsigned char) *list))
+            return -1;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+/** Reads the NUMA topology of the machine. Nodes are expected to be
+ *  numbered from 0 without gaps; reading stops at the first missing
+ *  node.
+ *
+ *  Returns: Number of nodes found (at least 1).
+ */
+int affinity_init(void) {
+    char path[64], line[1024];
+    int nodes = 0;
+
+    memset(cpu_node, 0, sizeof(cpu_node));
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), NODE_SYSFS_FORMAT, node);
+        FILE *file = fopen(path, "r");
+        if (!file) break;
+        int ok = fgets(line, sizeof(line), file) && cpuset_parse(line, &node_cpus[node]) == 0;
+        fclose(file);
+        // Nodes without CPUs (e.g., memory-only nodes) still count
+        if (!ok)
+            CPU_ZERO(&node_cpus[node]);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &node_cpus[node]))
+                cpu_node[cpu] = node;
+        nodes++;
+    }
+
+    if (!nodes) {
+        // No topology available: a single node with every CPU
+        CPU_ZERO(&node_cpus[0]);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &node_cpus[0]);
+        nodes = 1;
+    }
+    node_count = nodes;
+    return nodes;
+}
+
+/** Returns the number of NUMA nodes found by affinity_init.
+ */
+int affinity_nodes(void) {
+    return node_count;
+}
+
+/** Returns the NUMA node a CPU belongs to, or -1 if the CPU number is
+ *  invalid.
+ */
+int affinity_cpu_node(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+    return cpu_node[cpu];
+}
+
+/** Retrieves the CPUs of a NUMA node.
+ *
+ *  Parameters: node: Node number, as returned by affinity_cpu_node.
+ *              set: Set to the CPUs of the node.
+ */
+void affinity_node_cpus(int node, cpu_set_t *set) {
+    if (node < 0 || node >= node_count)
+        CPU_ZERO(set);
+    else
+        *set = node_cpus[node];
+}
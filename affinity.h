@@ -0,0 +1,21 @@
+/* affinity.h
+ * CPU sets and NUMA topology, used to place server threads. The
+ * topology is read from sysfs; without it (or on a single node), all
+ * CPUs belong to node 0.
+ */
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+// cpu_set_t requires _GNU_SOURCE to be defined by the including file
+#include <sched.h>
+
+#define AFFINITY_MAX_NODES 64
+
+int  cpuset_parse(const char *list, cpu_set_t *set);
+int  affinity_init(void);
+int  affinity_nodes(void);
+int  affinity_cpu_node(int cpu);
+void affinity_node_cpus(int node, cpu_set_t *set);
+
+#endif
@@ -0,0 +1,285 @@
+/* arena.c
+ * Region allocator for data that lives as long as a session.
+ *
+ * Allocations are carved sequentially from slabs of ARENA_SLAB_SIZE
+ * bytes. Requests larger than a quarter of a slab get a block of
+ * their own, so they don't waste the rest of the current slab. When
+ * an arena is destroyed its slabs go to a free list owned by the
+ * calling thread, from which the next arena created by that thread
+ * takes them without going through malloc. Since a thread normally
+ * handles a single session, the slabs a thread still holds when it
+ * exits are moved to a small shared pool for the next threads.
+ */
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_LARGE (ARENA_SLAB_SIZE / 4)
+// Limits on the number of idle slabs kept by a thread and by the
+// shared pool; anything beyond that is returned to malloc
+#define ARENA_THREAD_CACHE 8
+#define ARENA_POOL_MAX 256
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    max_align_t data[];
+};
+
+struct arena {
+    struct arena_block *slabs;
+    struct arena_block *large;
+    char *next;
+    char *end;
+};
+
+// Idle slabs owned by the current thread
+static __thread struct arena_block *thread_slabs;
+static __thread int thread_nslabs;
+
+// Idle slabs left behind by threads that have exited
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_block *pool_slabs;
+// Updated under pool_lock, but also read without it as a hint
+static int pool_nslabs;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static struct arena_stats counters;
+
+/** Internal function called on thread exit, that moves the slabs of
+ *  the thread to the shared pool.
+ */
+static void thread_release(void *unused) {
+    pthread_mutex_lock(&pool_lock);
+    while (thread_slabs) {
+        struct arena_block *slab = thread_slabs;
+        thread_slabs = slab->next;
+        if (pool_nslabs < ARENA_POOL_MAX) {
+            slab->next = pool_slabs;
+            pool_slabs = slab;
+            __atomic_add_fetch(&pool_nslabs, 1, __ATOMIC_RELAXED);
+        } else {
+            free(slab);
+        }
+    }
+    thread_nslabs = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void make_key(void) {
+    pthread_key_create(&thread_key, thread_release);
+}
+
+/** Internal function that returns an empty slab, from the thread's
+ *  free list, the shared pool, or malloc, in this order.
+ */
+static struct arena_block *slab_get(void) {
+    struct arena_block *slab = thread_slabs;
+    if (slab) {
+        thread_slabs = slab->next;
+        thread_nslabs--;
+        __atomic_add_fetch(&counters.slabs_reused, 1, __ATOMIC_RELAXED);
+        return slab;
+    }
+    if (__atomic_load_n(&pool_nslabs, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&pool_lock);
+        slab = pool_slabs;
+        if (slab) {
+            pool_slabs = slab->next;
+            __atomic_sub_fetch(&pool_nslabs, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (slab) {
+            __atomic_add_fetch(&counters.slabs_reused, 1, __ATOMIC_RELAXED);
+            return slab;
+        }
+    }
+    slab = malloc(ARENA_SLAB_SIZE);
+    if (slab) {
+        slab->size = ARENA_SLAB_SIZE - sizeof(struct arena_block);
+        __atomic_add_fetch(&counters.slabs_allocated, 1, __ATOMIC_RELAXED);
+    }
+    return slab;
+}
+
+/** Internal function that returns a slab to the thread's free list.
+ */
+static void slab_put(struct arena_block *slab) {
+    if (thread_nslabs >= ARENA_THREAD_CACHE) {
+        free(slab);
+        return;
+    }
+    // Make sure the slabs are handed to the shared pool on thread exit
+    pthread_once(&key_once, make_key);
+    if (!thread_slabs)
+        pthread_setspecific(thread_key, &thread_slabs);
+    slab->next = thread_slabs;
+    thread_slabs = slab;
+    thread_nslabs++;
+}
+
+/** Creates a new, empty arena. The arena structure itself is stored
+ *  in the first slab.
+ *
+ *  Returns: The new arena, or NULL if no memory is available.
+ */
+arena_t arena_create(void) {
+    struct arena_block *slab = slab_get();
+    if (!slab) return NULL;
+    slab->next = NULL;
+
+    arena_t arena = (arena_t) slab->data;
+    arena->slabs = slab;
+    arena->large = NULL;
+    arena->next = (char *) slab->data +
+        (sizeof(struct arena) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    arena->end = (char *) slab->data + slab->size;
+    return arena;
+}
+
+/** Allocates memory from an arena. The memory is aligned for any
+ *  type, and remains valid until the arena is destroyed.
+ *
+ *  Parameters: arena: Arena the memory is taken from.
+ *              size: Number of bytes to allocate.
+ *
+ *  Returns: Pointer to the memory, or NULL if no memory is available.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+    if (size > ARENA_LARGE) {
+        struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+        if (!block) return NULL;
+        block->size = size;
+        block->next = arena->large;
+        arena->large = block;
+        __atomic_add_fetch(&counters.large_allocations, 1, __ATOMIC_RELAXED);
+        return block->data;
+    }
+
+    if ((size_t) (arena->end - arena->next) < size) {
+        struct arena_block *slab = slab_get();
+        if (!slab) return NULL;
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        arena->next = (char *) slab->data;
+        arena->end = (char *) slab->data + slab->size;
+    }
+    void *rv = arena->next;
+    arena->next += size;
+    return rv;
+}
+
+/** Changes the size of memory allocated from an arena. The memory is
+ *  resized in place if it is the most recent allocation in the arena
+ *  (or a large allocation); otherwise new memory is allocated and the
+ *  contents are copied, and the old memory is only released with the
+ *  arena.
+ *
+ *  Parameters: arena: Arena the memory was taken from.
+ *              ptr: Memory to be resized, or NULL.
+ *              old_size: Size requested when ptr was allocated.
+ *              size: New size, in bytes.
+ *
+ *  Returns: Pointer to the resized memory, or NULL if no memory is
+ *           available (in which case ptr is left untouched).
+ */
+void *arena_realloc(arena_t arena, void *ptr, size_t old_size, size_t size) {
+    if (!ptr)
+        return arena_alloc(arena, size);
+
+    size_t aligned_old = (old_size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    size_t aligned = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+    if (aligned_old > ARENA_LARGE && aligned > ARENA_LARGE) {
+        struct arena_block **prev = &arena->large;
+        while (*prev && (void *) (*prev)->data != ptr)
+            prev = &(*prev)->next;
+        if (*prev) {
+            struct arena_block *block = realloc(*prev, sizeof(struct arena_block) + aligned);
+            if (!block) return NULL;
+            block->size = aligned;
+            *prev = block;
+            return block->data;
+        }
+    } else if ((char *) ptr + aligned_old == arena->next &&
+               (size_t) (arena->end - (char *) ptr) >= aligned &&
+               aligned <= ARENA_LARGE) {
+        arena->next = (char *) ptr + aligned;
+        return ptr;
+    }
+
+    void *rv = arena_alloc(arena, size);
+    if (rv) memcpy(rv, ptr, old_size < size ? old_size : size);
+    return rv;
+}
+
+/** Allocates zero-filled memory for an array from an arena.
+ *
+ *  Parameters: arena: Arena the memory is taken from.
+ *              nmemb: Number of elements in the array.
+ *              size: Size of each element.
+ *
+ *  Returns: Pointer to the memory, or NULL if no memory is available.
+ */
+void *arena_calloc(arena_t arena, size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) return NULL;
+    void *rv = arena_alloc(arena, nmemb * size);
+    if (rv) memset(rv, 0, nmemb * size);
+    return rv;
+}
+
+/** Copies a string into memory allocated from an arena.
+ *
+ *  Parameters: arena: Arena the memory is taken from.
+ *              str: String to be copied.
+ *
+ *  Returns: Pointer to the copy, or NULL if no memory is available.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *rv = arena_alloc(arena, len);
+    if (rv) memcpy(rv, str, len);
+    return rv;
+}
+
+/** Releases all memory allocated from an arena, including the arena
+ *  itself. Slabs are kept by the calling thread for reuse.
+ *
+ *  Parameters: arena: Arena to be destroyed.
+ */
+void arena_destroy(arena_t arena) {
+    if (!arena) return;
+    struct arena_block *block = arena->large;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    // The arena lives in the last slab of the list, so the list must
+    // not be read from the arena once that slab is released
+    block = arena->slabs;
+    while (block) {
+        struct arena_block *next = block->next;
+        slab_put(block);
+        block = next;
+    }
+}
+
+/** Retrieves counters on slab usage, across all arenas.
+ *
+ *  Parameters: stats: Structure that receives the counters.
+ */
+void arena_get_stats(struct arena_stats *stats) {
+    stats->slabs_allocated = __atomic_load_n(&counters.slabs_allocated, __ATOMIC_RELAXED);
+    stats->slabs_reused = __atomic_load_n(&counters.slabs_reused, __ATOMIC_RELAXED);
+    stats->large_allocations = __atomic_load_n(&counters.large_allocations, __ATOMIC_RELAXED);
+}
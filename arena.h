@@ -0,0 +1,32 @@
+/* arena.h
+ * Region allocator for data that lives as long as a session. Memory
+ * is taken from fixed-size slabs and released all at once when the
+ * arena is destroyed; there is no way to free a single allocation.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// Size of a slab, including its header. A page is enough for the
+// small objects of a session; larger ones get a block of their own.
+#define ARENA_SLAB_SIZE 4096
+
+typedef struct arena *arena_t;
+
+struct arena_stats {
+    unsigned long slabs_allocated;  // slabs obtained with malloc
+    unsigned long slabs_reused;     // slabs taken from a free list
+    unsigned long large_allocations;
+};
+
+arena_t arena_create(void);
+void   *arena_alloc(arena_t arena, size_t size);
+void   *arena_realloc(arena_t arena, void *ptr, size_t old_size, size_t size);
+void   *arena_calloc(arena_t arena, size_t nmemb, size_t size);
+char   *arena_strdup(arena_t arena, const char *str);
+void    arena_destroy(arena_t arena);
+void    arena_get_stats(struct arena_stats *stats);
+
+#endif
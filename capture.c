@@ -0,0 +1,130 @@
+/* capture.c
+ * Records client sessions to files, for replay with popreplay (see
+ * capture.h for the file format).
+ *
+ * The commands of a session are kept in memory, and the file is only
+ * written when the session ends, so an idle session does not hold an
+ * open file. Files are written under a temporary name and renamed, so
+ * a replay never sees a partial session.
+ */
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+
+struct capture {
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct timespec last;
+};
+
+static const char *capture_dir;
+static unsigned long capture_next;
+
+/** Starts recording sessions into a directory.
+ *
+ *  Parameters: dir: Existing directory where capture files are
+ *                   written.
+ *
+ *  Returns: 0 on success, -1 if the directory cannot be written to.
+ */
+int capture_init(const char *dir) {
+    if (access(dir, W_OK) < 0)
+        return -1;
+    capture_dir = dir;
+    return 0;
+}
+
+/** Internal function that appends printf-style formatted text to a
+ *  capture.
+ */
+static void capture_append(capture_t capture, const char *fmt, ...)
+    __attribute__ ((format(printf, 2, 3)));
+static void capture_append(capture_t capture, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0) return;
+    if (capture->len + len + 1 > capture->cap) {
+        size_t cap = 2 * capture->cap + len + 1;
+        char *buf = realloc(capture->buf, cap);
+        if (!buf) return;
+        capture->buf = buf;
+        capture->cap = cap;
+    }
+    va_start(args, fmt);
+    vsnprintf(capture->buf + capture->len, len + 1, fmt, args);
+    va_end(args);
+    capture->len += len;
+}
+
+static long elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+    *since = now;
+    return ms;
+}
+
+/** Starts recording a session, if captures are enabled.
+ *
+ *  Returns: A capture object, or NULL if sessions are not recorded.
+ */
+capture_t capture_begin(void) {
+    if (!capture_dir) return NULL;
+    capture_t capture = calloc(1, sizeof(struct capture));
+    if (!capture) return NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &capture->last);
+    capture_append(capture, "#session %ld\r\n", (long) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    return capture;
+}
+
+/** Records a command received from the client, with the time elapsed
+ *  since the previous one. Passwords are not recorded.
+ *
+ *  Parameters: capture: Capture of the session, or NULL.
+ *              line: Command line, without the line ending.
+ */
+void capture_command(capture_t capture, const char *line) {
+    if (!capture) return;
+    capture_append(capture, "#delay %ld\r\n", elapsed_ms(&capture->last));
+    if (!strncasecmp(line, "PASS", 4) && (line[4] == ' ' || line[4] == '\t'))
+        capture_append(capture, "%.4s *\r\n", line);
+    else
+        capture_append(capture, "%s\r\n", line);
+}
+
+/** Stops recording a session, and writes its capture file.
+ *
+ *  Parameters: capture: Capture of the session, or NULL.
+ */
+void capture_end(capture_t capture) {
+    if (!capture) return;
+    char path[PATH_MAX], tmppath[PATH_MAX];
+    unsigned long n = __atomic_add_fetch(&capture_next, 1, __ATOMIC_RELAXED);
+    snprintf(path, sizeof(path), "%s/in.p.%d-%lu", capture_dir, (int) getpid(), n);
+    snprintf(tmppath, sizeof(tmppath), "%s/.in.p.%d-%lu.tmp", capture_dir, (int) getpid(), n);
+
+    FILE *file = fopen(tmppath, "w");
+    if (file) {
+        int ok = fwrite(capture->buf, 1, capture->len, file) == capture->len;
+        if (fclose(file) == 0 && ok)
+            rename(tmppath, path);
+        else
+            unlink(tmppath);
+    }
+    free(capture->buf);
+    free(capture);
+}
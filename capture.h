@@ -0,0 +1,25 @@
+/* capture.h
+ * Records client sessions to files, for replay with popreplay.
+ *
+ * A capture file uses the in.p format of test.sh (one client command
+ * per line, with CRLF line endings), extended with directive lines
+ * starting with '#':
+ *   #session <unix time in ms>   when the session started (first line)
+ *   #delay <ms>                  time elapsed since the previous
+ *                                command (or since the session
+ *                                started), before the next command
+ * The argument of PASS is replaced with "*"; popreplay fills in the
+ * password of the user from users.txt.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+typedef struct capture *capture_t;
+
+int       capture_init(const char *dir);
+capture_t capture_begin(void);
+void      capture_command(capture_t capture, const char *line);
+void      capture_end(capture_t capture);
+
+#endif
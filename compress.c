@@ -0,0 +1,145 @@
+/* compress.c
+ * Optional compression of stored mail messages. Messages are written
+ * compressed once at delivery time, and decoded on the fly when they
+ * are read, so only the compressed data is read from disk.
+ */
+
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+#define COMPRESS_BUFFER_SIZE (64 * 1024)
+
+/** Returns non-zero if this build can read and write compressed
+ *  messages.
+ */
+int compress_supported(void) {
+    return 1;
+}
+
+/** Writes a compressed copy of a file.
+ *
+ *  Parameters: infile: Name of the file to be compressed.
+ *              outfile: Name of the compressed file to be created.
+ *              level: Compression level (1 to 9).
+ *
+ *  Returns: Size of the uncompressed data, or -1 in case of error.
+ */
+long compress_file(const char *infile, const char *outfile, int level) {
+    char mode[8];
+    char buf[COMPRESS_BUFFER_SIZE];
+    long total = 0;
+
+    int infd = open(infile, O_RDONLY | O_CLOEXEC);
+    if (infd < 0) return -1;
+    snprintf(mode, sizeof(mode), "wb%d", level);
+    gzFile out = gzopen(outfile, mode);
+    if (!out) {
+        close(infd);
+        return -1;
+    }
+
+    ssize_t rv;
+    while ((rv = read(infd, buf, sizeof(buf))) != 0) {
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (gzwrite(out, buf, rv) != rv) {
+            rv = -1;
+            break;
+        }
+        total += rv;
+    }
+    close(infd);
+    if (gzclose(out) != Z_OK || rv < 0) {
+        unlink(outfile);
+        return -1;
+    }
+    return total;
+}
+
+static ssize_t decompress_read(void *cookie, char *buf, size_t size) {
+    int rv = gzread(cookie, buf, size);
+    return rv < 0 ? -1 : rv;
+}
+
+static int decompress_close(void *cookie) {
+    return gzclose(cookie) == Z_OK ? 0 : EOF;
+}
+
+/** Opens a compressed file for reading. Data is decompressed as it is
+ *  read, so the whole message is never held in memory.
+ *
+ *  Parameters: path: Name of the compressed file.
+ *
+ *  Returns: FILE * object returning the uncompressed data, or NULL in
+ *           case of error. Must be closed with fclose().
+ */
+FILE *decompress_open(const char *path) {
+    gzFile in = gzopen(path, "rb");
+    if (!in) return NULL;
+    gzbuffer(in, COMPRESS_BUFFER_SIZE);
+
+    cookie_io_functions_t funcs = {
+        .read = decompress_read,
+        .close = decompress_close,
+    };
+    FILE *file = fopencookie(in, "r", funcs);
+    if (!file) gzclose(in);
+    return file;
+}
+
+/** Same as decompress_open, for a compressed file that is already open.
+ *
+ *  Parameters: fd: Descriptor of the compressed file, which is closed
+ *                  when the returned file is closed (or on error).
+ *
+ *  Returns: FILE * object returning the uncompressed data, or NULL in
+ *           case of error. Must be closed with fclose().
+ */
+FILE *decompress_fdopen(int fd) {
+    gzFile in = gzdopen(fd, "rb");
+    if (!in) {
+        close(fd);
+        return NULL;
+    }
+    gzbuffer(in, COMPRESS_BUFFER_SIZE);
+
+    cookie_io_functions_t funcs = {
+        .read = decompress_read,
+        .close = decompress_close,
+    };
+    FILE *file = fopencookie(in, "r", funcs);
+    if (!file) gzclose(in);
+    return file;
+}
+
+#else
+
+int compress_supported(void) {
+    return 0;
+}
+
+long compress_file(const char *infile, const char *outfile, int level) {
+    return -1;
+}
+
+FILE *decompress_open(const char *path) {
+    return NULL;
+}
+
+FILE *decompress_fdopen(int fd) {
+    close(fd);
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,22 @@
+/* compress.h
+ * Optional compression of stored mail messages. The codec is chosen
+ * at build time (see COMPRESS in the Makefile); when no codec is
+ * available, compress_supported returns zero and all other functions
+ * fail.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdio.h>
+
+// Marker used in message file names to carry the uncompressed size,
+// e.g., "12,S=4096.mail".
+#define COMPRESS_SIZE_MARKER ",S="
+
+int   compress_supported(void);
+long  compress_file(const char *infile, const char *outfile, int level);
+FILE *decompress_open(const char *path);
+FILE *decompress_fdopen(int fd);
+
+#endif
@@ -0,0 +1,79 @@
+/* mailbackend.h
+ * Interface between the maildrop functions of mailuser.h and the
+ * stores that keep the messages. mailuser.c handles what is common to
+ * all stores (lists of messages, deletion marks, sizes) and calls the
+ * selected backend for everything else. Two backends exist:
+ *
+ *   dir     the mail store directory (mailuser.c): one file per
+ *           message, or a pack per user (mailpack.h)
+ *   memory  messages preloaded from the mail store into memory
+ *           (mailmem.c), so benchmarks can measure the protocol and
+ *           the network without the storage
+ *
+ * Only servers select a backend (mail_backend_select); the tools that
+ * work on the files of the store (mailtool, mydeliver) always use dir.
+ */
+
+#ifndef _MAILBACKEND_H_
+#define _MAILBACKEND_H_
+
+#include "mailuser.h"
+#include "mailpack.h"
+
+#include <limits.h>
+
+struct mail_item {
+    size_t file_size;
+    int deleted;
+    int have_id;
+    struct mail_item_id id;
+    // Only used by the dir backend
+    char file_name[2 * NAME_MAX];
+    int compressed;
+    // Only used for messages stored in a pack (see mailpack.h)
+    mail_pack_t pack;
+    uint64_t pack_id;
+    uint64_t pack_offset;
+    // Only used by the memory backend
+    void *message;
+};
+
+struct mail_list {
+    // Arena the list and its items are allocated from, or NULL if
+    // they are allocated with malloc
+    arena_t arena;
+    size_t count;
+    size_t capacity;
+    struct mail_item *items;
+};
+
+struct mail_backend {
+    const char *name;
+    // Prepares the backend; NULL if there is nothing to prepare.
+    // Returns 0 on success, -1 in case of error.
+    int         (*init)(void);
+    // Adds the messages of a user to an empty list, with
+    // mail_list_append. Returns 0, or -1 if no memory is available.
+    int         (*load)(mail_list_t list, const char *username);
+    // Deletes the messages of a list marked for deletion and releases
+    // the backend's references to the others. Returns the number of
+    // errors.
+    int         (*commit)(mail_list_t list);
+    // Same as mail_item_contents_fd, mail_item_prefetch, mail_item_id
+    // and mail_item_uid
+    FILE       *(*contents)(mail_item_t item, int fd);
+    int         (*prefetch)(mail_item_t item);
+    int         (*id)(mail_item_t item, struct mail_item_id *id);
+    size_t      (*uid)(mail_item_t item, char *buf);
+    // Same as save_user_mail, mail_store_users and mail_store_check
+    int         (*deliver)(const char *basefile, user_list_t users);
+    user_list_t (*users)(void);
+    int         (*check)(void);
+};
+
+extern const struct mail_backend mail_backend_dir;
+extern const struct mail_backend mail_backend_memory;
+
+struct mail_item *mail_list_append(mail_list_t list);
+
+#endif
@@ -0,0 +1,227 @@
+/* mailcache.c
+ * Process-wide cache of message contents, shared by all sessions.
+ *
+ * The cache is split into shards, each with its own lock, hash table
+ * and LRU list, so concurrent sessions rarely contend on the same
+ * lock. Entries are reference counted: an entry evicted while a
+ * session is still sending it is freed when that session releases it.
+ */
+
+#include "mailcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CACHE_SHARDS  16
+#define CACHE_BUCKETS 1024
+
+struct mail_cache_entry {
+    struct mail_item_id id;
+    char *data;
+    size_t size;
+    int refs;
+    struct mail_cache_entry *hash_next;
+    struct mail_cache_entry *lru_prev;
+    struct mail_cache_entry *lru_next;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    size_t bytes;
+    size_t entries;
+    // Most recently used entry first
+    struct mail_cache_entry *lru_head;
+    struct mail_cache_entry *lru_tail;
+    struct mail_cache_entry *buckets[CACHE_BUCKETS];
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t shard_max_bytes = 0;
+static struct mail_cache_stats stats;
+
+/** Initializes the cache. Must be called before any other function,
+ *  and before any sessions are started.
+ *
+ *  Parameters: max_bytes: Maximum amount of message data kept in the
+ *                         cache. If zero, the cache is disabled.
+ */
+void mail_cache_init(size_t max_bytes) {
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+    shard_max_bytes = max_bytes / CACHE_SHARDS;
+}
+
+/** Returns the size of the largest message the cache accepts, or 0 if
+ *  caching is disabled.
+ */
+size_t mail_cache_max_entry(void) {
+    return shard_max_bytes;
+}
+
+static unsigned long cache_hash(const struct mail_item_id *id) {
+    unsigned long h = id->ino * 0x9E3779B97F4A7C15ul;
+    h ^= id->dev + (h << 6) + (h >> 2);
+    h ^= id->offset + (h << 6) + (h >> 2);
+    h ^= id->mtime.tv_nsec + (h << 6) + (h >> 2);
+    h ^= id->generation + (h << 6) + (h >> 2);
+    return h ^ (h >> 29);
+}
+
+static int cache_same_id(const struct mail_item_id *a, const struct mail_item_id *b) {
+    return a->ino == b->ino && a->dev == b->dev && a->offset == b->offset &&
+        a->generation == b->generation && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static void lru_unlink(struct cache_shard *shard, struct mail_cache_entry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+}
+
+static void lru_push(struct cache_shard *shard, struct mail_cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    else shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+static void entry_free(struct mail_cache_entry *entry) {
+    free(entry->data);
+    free(entry);
+}
+
+/** Internal function that removes the least recently used entries of
+ *  a shard until it is within its size limit. Must be called with the
+ *  shard lock held.
+ */
+static void cache_evict(struct cache_shard *shard) {
+    while (shard->bytes > shard_max_bytes && shard->lru_tail) {
+        struct mail_cache_entry *victim = shard->lru_tail;
+        struct mail_cache_entry **pp = &shard->buckets[cache_hash(&victim->id) % CACHE_BUCKETS];
+        while (*pp != victim) pp = &(*pp)->hash_next;
+        *pp = victim->hash_next;
+        lru_unlink(shard, victim);
+        shard->bytes -= victim->size;
+        shard->entries--;
+        __atomic_add_fetch(&stats.evictions, 1, __ATOMIC_RELAXED);
+        if (--victim->refs == 0)
+            entry_free(victim);
+    }
+}
+
+/** Looks up the contents of a message in the cache.
+ *
+ *  Parameters: id: identifier of the message contents.
+ *
+ *  Returns: a cache entry, which must be released with
+ *           mail_cache_release once it's no longer used, or NULL if
+ *           the message is not cached.
+ */
+mail_cache_entry_t mail_cache_lookup(const struct mail_item_id *id) {
+    if (!shard_max_bytes) return NULL;
+
+    unsigned long h = cache_hash(id);
+    struct cache_shard *shard = &shards[h % CACHE_SHARDS];
+    struct mail_cache_entry *entry;
+
+    pthread_mutex_lock(&shard->lock);
+    for (entry = shard->buckets[h % CACHE_BUCKETS]; entry; entry = entry->hash_next) {
+        if (cache_same_id(&entry->id, id)) {
+            entry->refs++;
+            lru_unlink(shard, entry);
+            lru_push(shard, entry);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    __atomic_add_fetch(entry ? &stats.hits : &stats.misses, 1, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/** Adds the contents of a message to the cache. If the contents are
+ *  too big to be cached, the cache is left unchanged.
+ *
+ *  Parameters: id: identifier of the message contents.
+ *              data: malloc'ed buffer with the message contents. If
+ *                    an entry is returned, the buffer is owned by the
+ *                    cache and freed when the entry is evicted.
+ *              size: number of bytes in data.
+ *
+ *  Returns: a cache entry, which must be released with
+ *           mail_cache_release, or NULL if the data was not cached.
+ */
+mail_cache_entry_t mail_cache_insert(const struct mail_item_id *id, char *data, size_t size) {
+    if (size > shard_max_bytes) return NULL;
+
+    unsigned long h = cache_hash(id);
+    struct cache_shard *shard = &shards[h % CACHE_SHARDS];
+    struct mail_cache_entry *entry = malloc(sizeof(struct mail_cache_entry));
+    if (!entry) return NULL;
+    entry->id = *id;
+    entry->data = data;
+    entry->size = size;
+    entry->refs = 2; // one for the cache, one for the caller
+
+    pthread_mutex_lock(&shard->lock);
+    struct mail_cache_entry **pp = &shard->buckets[h % CACHE_BUCKETS];
+    for (struct mail_cache_entry *old = *pp; old; old = old->hash_next) {
+        if (cache_same_id(&old->id, id)) {
+            // Another session cached the same message in the meantime
+            old->refs++;
+            pthread_mutex_unlock(&shard->lock);
+            free(data);
+            free(entry);
+            return old;
+        }
+    }
+    entry->hash_next = *pp;
+    *pp = entry;
+    lru_push(shard, entry);
+    shard->bytes += size;
+    shard->entries++;
+    cache_evict(shard);
+    pthread_mutex_unlock(&shard->lock);
+
+    __atomic_add_fetch(&stats.insertions, 1, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/** Returns the message contents held by a cache entry.
+ */
+const char *mail_cache_data(mail_cache_entry_t entry, size_t *size) {
+    *size = entry->size;
+    return entry->data;
+}
+
+/** Releases a cache entry returned by mail_cache_lookup or
+ *  mail_cache_insert.
+ */
+void mail_cache_release(mail_cache_entry_t entry) {
+    struct cache_shard *shard = &shards[cache_hash(&entry->id) % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    int refs = --entry->refs;
+    pthread_mutex_unlock(&shard->lock);
+    if (refs == 0)
+        entry_free(entry);
+}
+
+/** Returns the hit, miss and eviction counters of the cache, and the
+ *  amount of data currently cached.
+ */
+void mail_cache_get_stats(struct mail_cache_stats *out) {
+    out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+    out->insertions = __atomic_load_n(&stats.insertions, __ATOMIC_RELAXED);
+    out->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+    out->bytes = out->entries = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        out->bytes += shards[i].bytes;
+        out->entries += shards[i].entries;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
@@ -0,0 +1,34 @@
+/* mailcache.h
+ * Process-wide cache of message contents, shared by all sessions.
+ * Messages are keyed by the identity of their stored contents (see
+ * mail_item_id), so a message delivered to many users through hard
+ * links is read and converted once and then served from memory.
+ */
+
+#ifndef _MAIL_CACHE_H_
+#define _MAIL_CACHE_H_
+
+#include "mailuser.h"
+
+#include <stddef.h>
+
+typedef struct mail_cache_entry *mail_cache_entry_t;
+
+struct mail_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+    size_t        bytes;
+    size_t        entries;
+};
+
+void               mail_cache_init(size_t max_bytes);
+size_t             mail_cache_max_entry(void);
+mail_cache_entry_t mail_cache_lookup(const struct mail_item_id *id);
+mail_cache_entry_t mail_cache_insert(const struct mail_item_id *id, char *data, size_t size);
+const char        *mail_cache_data(mail_cache_entry_t entry, size_t *size);
+void               mail_cache_release(mail_cache_entry_t entry);
+void               mail_cache_get_stats(struct mail_cache_stats *stats);
+
+#endif
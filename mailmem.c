@@ -0,0 +1,317 @@
+/* mailmem.c
+ * In-memory mail store (see mailbackend.h). When the backend is
+ * selected, the maildrops of all users in the mail store directory are
+ * read into memory once; sessions then list, read and delete messages
+ * without touching the disk. Deletions and deliveries only change the
+ * copy in memory, which is lost when the server exits.
+ *
+ * Maildrops are kept in a hash table by user name. A message is
+ * referenced by its maildrop and by every list it was loaded into, so
+ * a session can still read a message that another session of the
+ * same user deleted. The table and the reference counts are protected
+ * by a single lock; message contents never change, so they are read
+ * without it.
+ */
+
+#include "mailbackend.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MEM_HASH_SIZE 1024
+
+struct mem_message {
+    struct mem_maildrop *maildrop;  // NULL once deleted from it
+    unsigned long refs;
+    uint64_t seq;                   // identifies the contents
+    size_t size;
+    size_t uid_len;
+    char uid[MAIL_UID_MAX];
+    char data[];
+};
+
+struct mem_maildrop {
+    struct mem_maildrop *next;
+    size_t count;
+    size_t capacity;
+    struct mem_message **messages;
+    char user[];
+};
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_maildrop *buckets[MEM_HASH_SIZE];
+static uint64_t next_seq = 1;
+
+/** Internal function that returns the hash bucket of a user name. Names
+ *  are compared exactly, as they are in the names of maildrop
+ *  directories.
+ */
+static struct mem_maildrop **mem_bucket(const char *user) {
+    uint32_t h = 2166136261u;
+    for (; *user; user++)
+        h = (h ^ (unsigned char) *user) * 16777619u;
+    return &buckets[h % MEM_HASH_SIZE];
+}
+
+/** Internal function that finds the maildrop of a user, creating it if
+ *  create is set. Must be called with the lock held.
+ *
+ *  Returns: The maildrop, or NULL if it does not exist or no memory is
+ *           available.
+ */
+static struct mem_maildrop *mem_maildrop(const char *user, int create) {
+    struct mem_maildrop **bucket = mem_bucket(user), *drop;
+    for (drop = *bucket; drop; drop = drop->next)
+        if (!strcmp(drop->user, user))
+            return drop;
+    if (!create)
+        return NULL;
+    drop = calloc(1, sizeof(struct mem_maildrop) + strlen(user) + 1);
+    if (!drop)
+        return NULL;
+    strcpy(drop->user, user);
+    drop->next = *bucket;
+    *bucket = drop;
+    return drop;
+}
+
+/** Internal function that adds a message at the end of a maildrop,
+ *  which takes a reference to it. Must be called with the lock held.
+ *
+ *  Returns: 0 on success, -1 if no memory is available.
+ */
+static int mem_append(struct mem_maildrop *drop, struct mem_message *msg) {
+    if (drop->count == drop->capacity) {
+        size_t capacity = drop->capacity ? 2 * drop->capacity : 16;
+        struct mem_message **messages = realloc(drop->messages, capacity * sizeof(*messages));
+        if (!messages)
+            return -1;
+        drop->messages = messages;
+        drop->capacity = capacity;
+    }
+    drop->messages[drop->count++] = msg;
+    msg->maildrop = drop;
+    msg->refs++;
+    return 0;
+}
+
+/** Internal function that drops a reference to a message, freeing it
+ *  with the last one. Must be called with the lock held.
+ */
+static void mem_release(struct mem_message *msg) {
+    if (--msg->refs == 0)
+        free(msg);
+}
+
+/** Internal function that reads a whole message into a new, unreferenced
+ *  message object.
+ *
+ *  Parameters: file: Contents of the message, closed by this function.
+ *              size: Expected size (the file may turn out shorter or
+ *                    longer).
+ *
+ *  Returns: The message, or NULL in case of error.
+ */
+static struct mem_message *mem_read(FILE *file, size_t size) {
+    if (!file)
+        return NULL;
+    size_t cap = size + 1, len = 0, rv;
+    struct mem_message *msg = malloc(sizeof(struct mem_message) + cap);
+    while (msg && (rv = fread(msg->data + len, 1, cap - len, file)) > 0) {
+        len += rv;
+        if (len == cap) {
+            cap *= 2;
+            struct mem_message *bigger = realloc(msg, sizeof(struct mem_message) + cap);
+            if (!bigger)
+                free(msg);
+            msg = bigger;
+        }
+    }
+    if (msg && ferror(file)) {
+        free(msg);
+        msg = NULL;
+    }
+    fclose(file);
+    if (!msg)
+        return NULL;
+    msg->maildrop = NULL;
+    msg->refs = 0;
+    msg->size = len;
+    msg->uid_len = 0;
+    return msg;
+}
+
+/** Internal function that reads the maildrops of all users in the mail
+ *  store directory into memory.
+ */
+static int mem_init(void) {
+    size_t messages = 0, bytes = 0;
+    int users = 0;
+    user_list_t names = mail_backend_dir.users();
+
+    for (user_list_t u = names; u; u = user_list_next(u)) {
+        const char *user = user_list_name(u);
+        if (!user)
+            continue;
+        struct mail_list list = { 0 };
+        mail_backend_dir.load(&list, user);
+        pthread_mutex_lock(&mem_lock);
+        struct mem_maildrop *drop = mem_maildrop(user, 1);
+        pthread_mutex_unlock(&mem_lock);
+        if (!drop) {
+            mail_backend_dir.commit(&list);
+            free(list.items);
+            user_list_destroy(names);
+            return -1;
+        }
+        users++;
+        for (size_t i = 0; i < list.count; i++) {
+            struct mail_item *item = &list.items[i];
+            struct mem_message *msg = mem_read(mail_backend_dir.contents(item, -1), item->file_size);
+            if (!msg) {
+                dlog("Could not read message %zu of %s\n", i + 1, user);
+                continue;
+            }
+            msg->uid_len = mail_backend_dir.uid(item, msg->uid);
+            pthread_mutex_lock(&mem_lock);
+            msg->seq = next_seq++;
+            int rv = mem_append(drop, msg);
+            pthread_mutex_unlock(&mem_lock);
+            if (rv < 0) {
+                free(msg);
+                continue;
+            }
+            messages++;
+            bytes += msg->size;
+        }
+        // Nothing is marked as deleted, so the store is not changed
+        mail_backend_dir.commit(&list);
+        free(list.items);
+    }
+    user_list_destroy(names);
+    printf("Loaded %zu messages (%zu bytes) of %d users into memory\n", messages, bytes, users);
+    return 0;
+}
+
+static int mem_load(mail_list_t list, const char *username) {
+    int rv = 0;
+    pthread_mutex_lock(&mem_lock);
+    struct mem_maildrop *drop = mem_maildrop(username, 0);
+    for (size_t i = 0; drop && i < drop->count; i++) {
+        struct mail_item *item = mail_list_append(list);
+        if (!item) {
+            rv = -1;
+            break;
+        }
+        struct mem_message *msg = drop->messages[i];
+        item->file_size = msg->size;
+        item->deleted = 0;
+        item->have_id = 0;
+        item->pack = NULL;
+        item->message = msg;
+        msg->refs++;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return rv;
+}
+
+static int mem_commit(mail_list_t list) {
+    pthread_mutex_lock(&mem_lock);
+    for (size_t i = 0; i < list->count; i++) {
+        struct mem_message *msg = list->items[i].message;
+        struct mem_maildrop *drop = msg->maildrop;
+        // Another session may have deleted the message already
+        if (list->items[i].deleted && drop) {
+            size_t pos = 0;
+            while (drop->messages[pos] != msg)
+                pos++;
+            memmove(drop->messages + pos, drop->messages + pos + 1,
+                    (drop->count - pos - 1) * sizeof(*drop->messages));
+            drop->count--;
+            msg->maildrop = NULL;
+            mem_release(msg);
+        }
+        mem_release(msg);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return 0;
+}
+
+static FILE *mem_contents(mail_item_t item, int fd) {
+    struct mem_message *msg = item->message;
+    if (fd >= 0)
+        close(fd);
+    // fmemopen does not take an empty buffer
+    if (!msg->size)
+        return fopen("/dev/null", "r");
+    return fmemopen(msg->data, msg->size, "r");
+}
+
+static int mem_prefetch(mail_item_t item) {
+    return -1;
+}
+
+static int mem_id(mail_item_t item, struct mail_item_id *id) {
+    struct mem_message *msg = item->message;
+    memset(id, 0, sizeof(*id));
+    id->ino = msg->seq;
+    return 0;
+}
+
+static size_t mem_uid(mail_item_t item, char *buf) {
+    struct mem_message *msg = item->message;
+    memcpy(buf, msg->uid, msg->uid_len);
+    return msg->uid_len;
+}
+
+static int mem_deliver(const char *basefile, user_list_t users) {
+    struct mem_message *msg = mem_read(fopen(basefile, "r"), 0);
+    if (!msg)
+        return -1;
+    int errors = 0;
+    pthread_mutex_lock(&mem_lock);
+    msg->refs++;
+    msg->seq = next_seq++;
+    msg->uid_len = sprintf(msg->uid, "M%llu", (unsigned long long) msg->seq);
+    for (user_list_t u = users; u; u = user_list_next(u)) {
+        const char *user = user_list_name(u);
+        struct mem_maildrop *drop = user ? mem_maildrop(user, 1) : NULL;
+        if (!drop || mem_append(drop, msg) < 0)
+            errors++;
+    }
+    mem_release(msg);
+    pthread_mutex_unlock(&mem_lock);
+    return errors;
+}
+
+static user_list_t mem_users(void) {
+    user_list_t list = user_list_create();
+    pthread_mutex_lock(&mem_lock);
+    for (int i = 0; i < MEM_HASH_SIZE; i++)
+        for (struct mem_maildrop *drop = buckets[i]; drop; drop = drop->next)
+            user_list_add(&list, drop->user);
+    pthread_mutex_unlock(&mem_lock);
+    return list;
+}
+
+static int mem_check(void) {
+    return 0;
+}
+
+const struct mail_backend mail_backend_memory = {
+    .name = "memory",
+    .init = mem_init,
+    .load = mem_load,
+    .commit = mem_commit,
+    .contents = mem_contents,
+    .prefetch = mem_prefetch,
+    .id = mem_id,
+    .uid = mem_uid,
+    .deliver = mem_deliver,
+    .users = mem_users,
+    .check = mem_check,
+};
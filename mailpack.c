@@ -0,0 +1,676 @@
+/* mailpack.c
+ * Packed append-only mailbox segment format. Instead of one file per
+ * message, all messages for a user are appended to a single data
+ * file, with an index of offsets and lengths kept alongside it.
+ * Deleted messages are recorded as tombstones in the index, and the
+ * space they use is reclaimed later by a compaction pass.
+ */
+
+#define _GNU_SOURCE
+#include "mailpack.h"
+#include "compress.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define PACK_MAGIC   "MPK1"
+#define PACK_VERSION 1
+#define PACK_TMP_SUFFIX ".tmp"
+#define PACK_CONVERT_FILE "mail.convert"
+#define MAIL_FILE_SUFFIX ".mail"
+
+// Compaction is started in the background once the space used by
+// deleted messages is at least this big and at least half the pack.
+#define PACK_COMPACT_MIN (64 * 1024)
+
+#define PACK_COPY_SIZE (64 * 1024)
+
+struct pack_header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t next_id;
+    uint64_t dead_bytes;
+    uint64_t generation;        // changes whenever the data file does
+};
+
+struct mail_pack {
+    int fd;
+    int refs;
+    uint64_t generation;
+    char dir[];
+};
+
+struct pack_cookie {
+    mail_pack_t pack;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t pos;
+};
+
+/** Internal function that builds the path of a file inside a user
+ *  directory.
+ */
+static void pack_path(char *out, const char *userdir, const char *name) {
+    snprintf(out, PATH_MAX, "%s/%s", userdir, name);
+}
+
+/** Internal function that locks the pack of a user directory. The lock
+ *  is held on a separate file, since the index and data files are
+ *  replaced during compaction.
+ *
+ *  Parameters: userdir: directory of the user.
+ *              op: LOCK_SH or LOCK_EX.
+ *
+ *  Returns: file descriptor holding the lock (released by closing
+ *           it), or -1 in case of error.
+ */
+static int pack_lock(const char *userdir, int op) {
+    char path[PATH_MAX];
+    pack_path(path, userdir, PACK_LOCK_FILE);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    while (flock(fd, op) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/** Internal function that returns a new pack generation. Data files
+ *  are identified by their inode, which is reused once a compaction
+ *  frees it, so the generation tells a new data file from an older
+ *  one (of any user) that had the same inode.
+ */
+static uint64_t pack_new_generation(void) {
+    uint64_t generation = 0;
+    if (getrandom(&generation, sizeof(generation), 0) != sizeof(generation)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        generation = ((uint64_t) now.tv_sec << 30) ^ now.tv_nsec ^ ((uint64_t) getpid() << 48);
+    }
+    // 0 is the generation of packs written before generations existed
+    return generation ? generation : 1;
+}
+
+/** Internal function that reads the whole index file with a single
+ *  sequential read.
+ *
+ *  Returns: 0 on success, -1 in case of error or if the index is
+ *           not valid. On success *records must be freed by the
+ *           caller.
+ */
+static int pack_read_index(int fd, struct pack_header *hdr,
+                           struct pack_record **records, size_t *nrecords) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+        return -1;
+
+    char *buf = malloc(st.st_size);
+    if (!buf) return -1;
+    size_t got = 0;
+    while (got < st.st_size) {
+        ssize_t rv = pread(fd, buf + got, st.st_size - got, got);
+        if (rv <= 0) {
+            if (rv < 0 && errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        got += rv;
+    }
+
+    memcpy(hdr, buf, sizeof(*hdr));
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) || hdr->version != PACK_VERSION) {
+        free(buf);
+        return -1;
+    }
+
+    // A partially written trailing record (e.g., after a crash) is ignored.
+    *nrecords = (st.st_size - sizeof(*hdr)) / sizeof(struct pack_record);
+    memmove(buf, buf + sizeof(*hdr), *nrecords * sizeof(struct pack_record));
+    *records = (struct pack_record *) buf;
+    return 0;
+}
+
+/** Internal function that removes tombstones, and the records they
+ *  refer to, from a list of index records. Live records are appended
+ *  in increasing id order, so the record a tombstone refers to is
+ *  found with a binary search.
+ *
+ *  Returns: number of live records, moved to the start of the array.
+ */
+static size_t pack_live_records(struct pack_record *records, size_t n) {
+    size_t nlive = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].flags == PACK_LIVE) {
+            records[nlive++] = records[i];
+            continue;
+        }
+        size_t lo = 0, hi = nlive;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (records[mid].id < records[i].id) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < nlive && records[lo].id == records[i].id)
+            records[lo].flags = PACK_TOMBSTONE;
+    }
+
+    size_t out = 0;
+    for (size_t i = 0; i < nlive; i++)
+        if (records[i].flags == PACK_LIVE)
+            records[out++] = records[i];
+    return out;
+}
+
+/** Internal function that writes a buffer in full at a given offset.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+static int pack_pwrite_all(int fd, const void *buf, size_t size, off_t offset) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t rv = pwrite(fd, p, size, offset);
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += rv;
+        offset += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/** Internal function that copies length bytes from in (starting at
+ *  offset) to the end of out.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+static int pack_copy_range(int in, off_t offset, int out, off_t out_offset, uint64_t length) {
+    char buf[PACK_COPY_SIZE];
+    while (length > 0) {
+        ssize_t rv = pread(in, buf, length < sizeof(buf) ? length : sizeof(buf), offset);
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv <= 0) return -1;
+        if (pack_pwrite_all(out, buf, rv, out_offset) < 0) return -1;
+        offset += rv;
+        out_offset += rv;
+        length -= rv;
+    }
+    return 0;
+}
+
+/** Checks if a user directory contains a packed mailbox.
+ *
+ *  Parameters: userdir: directory of the user.
+ *
+ *  Returns: non-zero if the directory has a pack index, zero otherwise.
+ */
+int pack_exists(const char *userdir) {
+    char path[PATH_MAX];
+    pack_path(path, userdir, PACK_INDEX_FILE);
+    return access(path, F_OK) == 0;
+}
+
+/** Opens the packed mailbox of a user directory and reads its index.
+ *  The data file is kept open, so messages can later be read from it
+ *  with pack_contents, even if the pack is compacted in the meantime.
+ *
+ *  Parameters: userdir: directory of the user.
+ *              records: set to a newly allocated array with the live
+ *                       messages, in delivery order. Must be freed by
+ *                       the caller.
+ *              nrecords: set to the number of entries in records.
+ *
+ *  Returns: a mail_pack_t object with a single reference, or NULL if
+ *           the directory has no valid pack or no memory is available
+ *           (records is then not set).
+ */
+mail_pack_t pack_open(const char *userdir, struct pack_record **records, size_t *nrecords) {
+    char path[PATH_MAX];
+    struct pack_header hdr;
+    mail_pack_t pack = NULL;
+
+    if (!pack_exists(userdir)) return NULL;
+    int lockfd = pack_lock(userdir, LOCK_SH);
+    if (lockfd < 0) return NULL;
+
+    pack_path(path, userdir, PACK_INDEX_FILE);
+    int idxfd = open(path, O_RDONLY | O_CLOEXEC);
+    pack_path(path, userdir, PACK_DATA_FILE);
+    int datafd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (idxfd >= 0 && datafd >= 0 && pack_read_index(idxfd, &hdr, records, nrecords) == 0) {
+        *nrecords = pack_live_records(*records, *nrecords);
+        pack = malloc(sizeof(struct mail_pack) + strlen(userdir) + 1);
+        if (pack) {
+            pack->fd = datafd;
+            pack->refs = 1;
+            pack->generation = hdr.generation;
+            strcpy(pack->dir, userdir);
+            datafd = -1;
+        } else {
+            free(*records);
+        }
+    }
+
+    if (idxfd >= 0) close(idxfd);
+    if (datafd >= 0) close(datafd);
+    close(lockfd);
+    return pack;
+}
+
+/** Adds a reference to a pack.
+ */
+void pack_retain(mail_pack_t pack) {
+    __atomic_add_fetch(&pack->refs, 1, __ATOMIC_RELAXED);
+}
+
+/** Removes a reference to a pack, closing it once no references remain.
+ */
+void pack_release(mail_pack_t pack) {
+    if (__atomic_sub_fetch(&pack->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(pack->fd);
+        free(pack);
+    }
+}
+
+/** Returns information about the data file of a pack, as opened by
+ *  pack_open.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int pack_stat(mail_pack_t pack, struct stat *st) {
+    return fstat(pack->fd, st);
+}
+
+/** Returns the generation of the data file of a pack, which together
+ *  with its device and inode identifies it (see pack_new_generation).
+ */
+uint64_t pack_generation(mail_pack_t pack) {
+    return pack->generation;
+}
+
+/** Asks the kernel to start reading a message of a pack into the page
+ *  cache, so that a later pack_contents does not wait for the disk.
+ *
+ *  Parameters: pack: Pack, as opened by pack_open.
+ *              offset, length: Location of the message in the data file.
+ */
+void pack_advise(mail_pack_t pack, uint64_t offset, uint64_t length) {
+    posix_fadvise(pack->fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+static ssize_t pack_cookie_read(void *c, char *buf, size_t size) {
+    struct pack_cookie *cookie = c;
+    uint64_t rem = cookie->length - cookie->pos;
+    if (size > rem) size = rem;
+    if (size == 0) return 0;
+    ssize_t rv;
+    do {
+        rv = pread(cookie->pack->fd, buf, size, cookie->offset + cookie->pos);
+    } while (rv < 0 && errno == EINTR);
+    if (rv > 0) cookie->pos += rv;
+    return rv;
+}
+
+static int pack_cookie_close(void *c) {
+    struct pack_cookie *cookie = c;
+    pack_release(cookie->pack);
+    free(cookie);
+    return 0;
+}
+
+/** Returns a file pointer that reads a single message from a pack.
+ *  Reads are served with pread on the shared data file descriptor, so
+ *  no additional file is opened. The file pointer holds a reference
+ *  to the pack, and must be closed with fclose().
+ *
+ *  Returns: FILE * object, or NULL in case of error.
+ */
+FILE *pack_contents(mail_pack_t pack, uint64_t offset, uint64_t length) {
+    struct pack_cookie *cookie = malloc(sizeof(struct pack_cookie));
+    if (!cookie) return NULL;
+    cookie->pack = pack;
+    cookie->offset = offset;
+    cookie->length = length;
+    cookie->pos = 0;
+
+    cookie_io_functions_t funcs = {
+        .read = pack_cookie_read,
+        .close = pack_cookie_close,
+    };
+    pack_retain(pack);
+    FILE *file = fopencookie(cookie, "r", funcs);
+    if (!file) {
+        pack_release(pack);
+        free(cookie);
+    }
+    return file;
+}
+
+static void *pack_compact_thread(void *userdir) {
+    if (pack_compact(userdir) < 0)
+        dlog("Compaction of %s failed\n", (char *) userdir);
+    free(userdir);
+    return NULL;
+}
+
+/** Marks messages in a pack as deleted, by appending tombstone records
+ *  to the index. If enough space is used by deleted messages, starts
+ *  a compaction of the pack in a background thread.
+ *
+ *  Parameters: pack: pack containing the messages.
+ *              ids: ids of the deleted messages.
+ *              lengths: sizes of the deleted messages.
+ *              n: number of messages in ids and lengths.
+ *
+ *  Returns: number of errors, if any.
+ */
+int pack_delete(mail_pack_t pack, const uint64_t ids[], const uint64_t lengths[], size_t n) {
+    char path[PATH_MAX];
+    struct pack_header hdr;
+    struct stat st;
+
+    if (n == 0) return 0;
+    int lockfd = pack_lock(pack->dir, LOCK_EX);
+    if (lockfd < 0) return n;
+
+    pack_path(path, pack->dir, PACK_INDEX_FILE);
+    int idxfd = open(path, O_RDWR | O_CLOEXEC);
+    if (idxfd < 0 || pread(idxfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(idxfd, &st) < 0) {
+        if (idxfd >= 0) close(idxfd);
+        close(lockfd);
+        return n;
+    }
+
+    off_t end = sizeof(hdr) + (st.st_size - sizeof(hdr)) / sizeof(struct pack_record) * sizeof(struct pack_record);
+    struct pack_record *tombs = calloc(n, sizeof(struct pack_record));
+    if (!tombs) {
+        close(idxfd);
+        close(lockfd);
+        return n;
+    }
+    for (size_t i = 0; i < n; i++) {
+        tombs[i].id = ids[i];
+        tombs[i].flags = PACK_TOMBSTONE;
+        hdr.dead_bytes += lengths[i];
+    }
+    int errors = 0;
+    if (pack_pwrite_all(idxfd, tombs, n * sizeof(struct pack_record), end) < 0 ||
+        pack_pwrite_all(idxfd, &hdr, sizeof(hdr), 0) < 0)
+        errors = n;
+    free(tombs);
+    close(idxfd);
+
+    pack_path(path, pack->dir, PACK_DATA_FILE);
+    if (!errors && hdr.dead_bytes >= PACK_COMPACT_MIN &&
+        stat(path, &st) == 0 && hdr.dead_bytes * 2 >= st.st_size) {
+        pthread_t thread;
+        char *userdir = strdup(pack->dir);
+        if (userdir && pthread_create(&thread, NULL, pack_compact_thread, userdir) == 0)
+            pthread_detach(thread);
+        else
+            free(userdir);
+    }
+
+    close(lockfd);
+    return errors;
+}
+
+/** Appends a message to the pack of a user directory, creating the
+ *  pack if it doesn't exist yet.
+ *
+ *  Parameters: userdir: directory of the user.
+ *              basefile: name of a file containing the message.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int pack_append_file(const char *userdir, const char *basefile) {
+    char path[PATH_MAX];
+    struct pack_header hdr;
+    struct stat st;
+    int rv = -1;
+
+    int infd = open(basefile, O_RDONLY | O_CLOEXEC);
+    if (infd < 0) return -1;
+    int lockfd = pack_lock(userdir, LOCK_EX);
+    if (lockfd < 0) {
+        close(infd);
+        return -1;
+    }
+
+    pack_path(path, userdir, PACK_INDEX_FILE);
+    int idxfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    pack_path(path, userdir, PACK_DATA_FILE);
+    int datafd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (idxfd < 0 || datafd < 0 || fstat(idxfd, &st) < 0)
+        goto out;
+
+    if (st.st_size < sizeof(hdr)) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+        hdr.version = PACK_VERSION;
+        st.st_size = sizeof(hdr);
+    } else if (pread(idxfd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        goto out;
+    }
+    if (!hdr.generation)
+        hdr.generation = pack_new_generation();
+
+    struct stat in_st, data_st;
+    if (fstat(infd, &in_st) < 0 || fstat(datafd, &data_st) < 0)
+        goto out;
+
+    struct pack_record record = {
+        .id = hdr.next_id++,
+        .offset = data_st.st_size,
+        .length = in_st.st_size,
+        .flags = PACK_LIVE,
+    };
+    off_t end = sizeof(hdr) + (st.st_size - sizeof(hdr)) / sizeof(record) * sizeof(record);
+    if (pack_copy_range(infd, 0, datafd, record.offset, record.length) < 0 ||
+        pack_pwrite_all(idxfd, &record, sizeof(record), end) < 0 ||
+        pack_pwrite_all(idxfd, &hdr, sizeof(hdr), 0) < 0)
+        goto out;
+    rv = 0;
+
+out:
+    if (idxfd >= 0) close(idxfd);
+    if (datafd >= 0) close(datafd);
+    close(lockfd);
+    close(infd);
+    return rv;
+}
+
+/** Rewrites the pack of a user directory without the messages marked
+ *  as deleted. The new data and index files are written under
+ *  temporary names and then renamed over the old ones. Sessions that
+ *  have the old data file open keep reading from it.
+ *
+ *  Parameters: userdir: directory of the user.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int pack_compact(const char *userdir) {
+    char path[PATH_MAX], tmppath[PATH_MAX];
+    struct pack_header hdr;
+    struct pack_record *records = NULL;
+    size_t nrecords, nlive;
+    int rv = -1;
+    int idxfd = -1, datafd = -1, newidx = -1, newdata = -1;
+
+    int lockfd = pack_lock(userdir, LOCK_EX);
+    if (lockfd < 0) return -1;
+
+    pack_path(path, userdir, PACK_INDEX_FILE);
+    idxfd = open(path, O_RDONLY | O_CLOEXEC);
+    pack_path(path, userdir, PACK_DATA_FILE);
+    datafd = open(path, O_RDONLY | O_CLOEXEC);
+    if (idxfd < 0 || datafd < 0 || pack_read_index(idxfd, &hdr, &records, &nrecords) < 0)
+        goto out;
+
+    nlive = pack_live_records(records, nrecords);
+    if (nlive == nrecords) {
+        // Nothing was deleted since the last compaction.
+        rv = 0;
+        goto out;
+    }
+
+    pack_path(tmppath, userdir, PACK_DATA_FILE PACK_TMP_SUFFIX);
+    newdata = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    pack_path(tmppath, userdir, PACK_INDEX_FILE PACK_TMP_SUFFIX);
+    newidx = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (newdata < 0 || newidx < 0)
+        goto out;
+
+    uint64_t offset = 0;
+    for (size_t i = 0; i < nlive; i++) {
+        if (pack_copy_range(datafd, records[i].offset, newdata, offset, records[i].length) < 0)
+            goto out;
+        records[i].offset = offset;
+        offset += records[i].length;
+    }
+    // Offsets change, and the new data file may get the inode of one
+    // that was removed, so it gets a new generation
+    hdr.dead_bytes = 0;
+    hdr.generation = pack_new_generation();
+    if (pack_pwrite_all(newidx, &hdr, sizeof(hdr), 0) < 0 ||
+        pack_pwrite_all(newidx, records, nlive * sizeof(struct pack_record), sizeof(hdr)) < 0 ||
+        fsync(newdata) < 0 || fsync(newidx) < 0)
+        goto out;
+
+    // The data file is replaced first: until the index is renamed,
+    // readers are held off by the lock.
+    pack_path(tmppath, userdir, PACK_DATA_FILE PACK_TMP_SUFFIX);
+    pack_path(path, userdir, PACK_DATA_FILE);
+    if (rename(tmppath, path) < 0)
+        goto out;
+    pack_path(tmppath, userdir, PACK_INDEX_FILE PACK_TMP_SUFFIX);
+    pack_path(path, userdir, PACK_INDEX_FILE);
+    if (rename(tmppath, path) < 0)
+        goto out;
+    dlog("Compacted %s: %zu messages kept\n", userdir, nlive);
+    rv = 0;
+
+out:
+    free(records);
+    if (idxfd >= 0) close(idxfd);
+    if (datafd >= 0) close(datafd);
+    if (newidx >= 0) close(newidx);
+    if (newdata >= 0) close(newdata);
+    close(lockfd);
+    return rv;
+}
+
+/** Internal function that writes the uncompressed contents of a
+ *  compressed message to a new file.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+static int pack_decompress_to(const char *path, const char *outfile) {
+    char buf[PACK_COPY_SIZE];
+    FILE *in = decompress_open(path);
+    if (!in) return -1;
+    int outfd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    off_t offset = 0;
+    size_t rv;
+    int error = outfd < 0;
+    while (!error && (rv = fread(buf, 1, sizeof(buf), in)) > 0) {
+        error = pack_pwrite_all(outfd, buf, rv, offset) < 0;
+        offset += rv;
+    }
+    if (ferror(in)) error = 1;
+    fclose(in);
+    if (outfd >= 0) close(outfd);
+    return error ? -1 : 0;
+}
+
+static int pack_compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/** Converts the messages of a user directory from the one file per
+ *  message layout to a pack. Messages are appended in the same order
+ *  load_user_mail lists them, and each message file is removed once
+ *  it has been added to the pack.
+ *
+ *  Parameters: userdir: directory of the user.
+ *
+ *  Returns: number of messages converted, or -1 in case of error.
+ */
+int pack_convert(const char *userdir) {
+    char path[PATH_MAX];
+    DIR *dir = opendir(userdir);
+    if (!dir) return -1;
+
+    struct dirent *dir_entry;
+    const size_t suflen = strlen(MAIL_FILE_SUFFIX);
+    char **names = NULL;
+    size_t nnames = 0, cap = 0;
+
+    while ((dir_entry = readdir(dir)) != NULL) {
+        size_t len = strlen(dir_entry->d_name);
+        if (dir_entry->d_type == DT_REG && len > suflen &&
+            !strcmp(dir_entry->d_name + len - suflen, MAIL_FILE_SUFFIX)) {
+            if (nnames == cap) {
+                size_t newcap = cap ? 2 * cap : 16;
+                char **newnames = realloc(names, newcap * sizeof(char *));
+                if (!newnames) break;
+                names = newnames;
+                cap = newcap;
+            }
+            if (!(names[nnames] = strdup(dir_entry->d_name))) break;
+            nnames++;
+        }
+    }
+    // The listing was cut short if memory ran out
+    if (dir_entry) {
+        closedir(dir);
+        for (size_t i = 0; i < nnames; i++)
+            free(names[i]);
+        free(names);
+        return -1;
+    }
+    closedir(dir);
+    qsort(names, nnames, sizeof(char *), pack_compare_names);
+
+    // Compressed messages are stored uncompressed in the pack
+    char tmppath[PATH_MAX];
+    pack_path(tmppath, userdir, PACK_CONVERT_FILE);
+
+    int converted = 0;
+    for (size_t i = 0; i < nnames; i++) {
+        pack_path(path, userdir, names[i]);
+        if (converted >= 0) {
+            const char *source = path;
+            if (strstr(names[i], COMPRESS_SIZE_MARKER)) {
+                source = pack_decompress_to(path, tmppath) == 0 ? tmppath : NULL;
+            }
+            if (source && pack_append_file(userdir, source) == 0 && unlink(path) == 0)
+                converted++;
+            else
+                converted = -1;
+            if (source == tmppath)
+                unlink(tmppath);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return converted;
+}
@@ -0,0 +1,52 @@
+/* mailpack.h
+ * Packed append-only mailbox segment format. Used internally by
+ * mailuser.c as an alternative to storing one file per message.
+ *
+ * A packed user directory contains three files:
+ *   mail.pack  message contents, appended one after the other
+ *   mail.idx   a header followed by fixed-size records describing
+ *              each message (id, offset, length) or the deletion of
+ *              a message (a tombstone record carrying the same id)
+ *   mail.lock  lock file, never renamed, used with flock()
+ */
+
+#ifndef _MAIL_PACK_H_
+#define _MAIL_PACK_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define PACK_DATA_FILE  "mail.pack"
+#define PACK_INDEX_FILE "mail.idx"
+#define PACK_LOCK_FILE  "mail.lock"
+
+#define PACK_LIVE      0
+#define PACK_TOMBSTONE 1
+
+struct pack_record {
+    uint64_t id;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+typedef struct mail_pack *mail_pack_t;
+
+int         pack_exists(const char *userdir);
+mail_pack_t pack_open(const char *userdir, struct pack_record **records, size_t *nrecords);
+void        pack_retain(mail_pack_t pack);
+void        pack_release(mail_pack_t pack);
+int         pack_stat(mail_pack_t pack, struct stat *st);
+uint64_t    pack_generation(mail_pack_t pack);
+FILE       *pack_contents(mail_pack_t pack, uint64_t offset, uint64_t length);
+void        pack_advise(mail_pack_t pack, uint64_t offset, uint64_t length);
+int         pack_delete(mail_pack_t pack, const uint64_t ids[], const uint64_t lengths[], size_t n);
+
+int         pack_append_file(const char *userdir, const char *basefile);
+int         pack_compact(const char *userdir);
+int         pack_convert(const char *userdir);
+
+#endif
@@ -0,0 +1,190 @@
+/* mailtool.c
+ * Maintenance tool for the mail storage used by mypopd.
+ *
+ * Usage: mailtool [-z level] <command> <args>...
+ *
+ *   pack <user>...                convert mailboxes to packed format
+ *   compact <user>...             reclaim space used by deleted mail
+ *   synth <user> <count> <size>   deliver count synthetic messages of
+ *                                 about size bytes each to a user
+ *   bench <user>...               read every message of the users and
+ *                                 report throughput and CPU time
+ *   shard <levels>                move the maildrops from the flat
+ *                                 layout to a layout sharded by a hash
+ *                                 of the user name, with the given
+ *                                 number of directory levels (1 to 4)
+ *
+ * The -z option saves synthetic messages compressed with the given
+ * level, if compression is supported by this build.
+ */
+
+#include "mailuser.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_BUFFER_SIZE (64 * 1024)
+
+static const char *synth_words[] = {
+    "the", "mail", "server", "message", "delivery", "report", "meeting",
+    "please", "attached", "review", "schedule", "project", "update",
+    "thanks", "regards", "tomorrow", "budget", "quarter", "team", "and",
+    "of", "to", "in", "for", "with", "on", "this", "that", "we", "you",
+};
+#define NUM_SYNTH_WORDS (sizeof(synth_words) / sizeof(synth_words[0]))
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Invalid arguments. Expected: %s [-z level] "
+            "pack|compact|synth|bench <user>... | shard <levels>\n", prog);
+}
+
+static double elapsed(struct timespec *start, clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Writes a synthetic text message of roughly size bytes to a file.
+ */
+static int synth_message(const char *file, const char *user, int num, int size) {
+    // The previous message is hard linked into the mailbox, so it must
+    // not be overwritten in place
+    unlink(file);
+    FILE *out = fopen(file, "w");
+    if (!out) return -1;
+    int len = fprintf(out, "From: Synthetic <synth@example.com>\r\n"
+                      "To: <%s>\r\nSubject: Synthetic message %d\r\n\r\n", user, num);
+    int col = 0;
+    while (len < size) {
+        const char *word = synth_words[rand() % NUM_SYNTH_WORDS];
+        // Some lines start with a dot, to exercise byte-stuffing
+        if (col == 0 && rand() % 40 == 0)
+            col += fprintf(out, ".");
+        col += fprintf(out, "%s%s", col > 1 ? " " : "", word);
+        if (col >= 72 || rand() % 64 == 0) {
+            fputs("\r\n", out);
+            len += col + 2;
+            col = 0;
+        }
+    }
+    return fclose(out);
+}
+
+static int do_synth(const char *user, int count, int size) {
+    char file[64];
+    snprintf(file, sizeof(file), "mailtool.tmp.%d", getpid());
+    user_list_t users = user_list_create();
+    user_list_add(&users, user);
+    mail_delivery_t delivery = mail_delivery_create();
+
+    int errors = 0;
+    for (int i = 0; i < count && delivery; i++) {
+        if (synth_message(file, user, i, size) < 0 ||
+            mail_delivery_save(delivery, file, users))
+            errors++;
+    }
+    unlink(file);
+    if (delivery) mail_delivery_destroy(delivery);
+    user_list_destroy(users);
+    printf("%s: %d messages delivered\n", user, count - errors);
+    return errors;
+}
+
+static int do_bench(int nusers, char *users[]) {
+    static char buf[BENCH_BUFFER_SIZE];
+    struct timespec wall, cpu;
+    size_t messages = 0, bytes = 0;
+    int errors = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    for (int i = 0; i < nusers; i++) {
+        mail_list_t list = load_user_mail(users[i]);
+        int len = mail_list_length(list, 1);
+        for (int pos = 0; pos < len; pos++) {
+            FILE *file = mail_item_contents(mail_list_retrieve(list, pos));
+            if (!file) {
+                errors++;
+                continue;
+            }
+            size_t rv;
+            while ((rv = fread(buf, 1, sizeof(buf), file)) > 0)
+                bytes += rv;
+            fclose(file);
+            messages++;
+        }
+        mail_list_destroy(list);
+    }
+    double wall_s = elapsed(&wall, CLOCK_MONOTONIC);
+    double cpu_s = elapsed(&cpu, CLOCK_PROCESS_CPUTIME_ID);
+    printf("%zu messages, %zu bytes, %.3f s wall, %.3f s CPU, %.1f MB/s\n",
+           messages, bytes, wall_s, cpu_s, bytes / 1e6 / (wall_s > 0 ? wall_s : 1e-9));
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "z:")) != -1) {
+        switch (opt) {
+        case 'z':
+            mail_compress_level = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    be_verbose = 0;
+    const char *command = argv[optind];
+    int errors = 0;
+    if (!strcmp(command, "synth")) {
+        if (argc - optind != 4) {
+            usage(argv[0]);
+            return 1;
+        }
+        errors = do_synth(argv[optind + 1], atoi(argv[optind + 2]), atoi(argv[optind + 3]));
+    } else if (!strcmp(command, "shard")) {
+        if (argc - optind != 2) {
+            usage(argv[0]);
+            return 1;
+        }
+        int moved = mail_store_shard(atoi(argv[optind + 1]));
+        if (moved < 0) {
+            fprintf(stderr, "Could not shard the mail store\n");
+            errors++;
+        } else {
+            printf("%d users moved\n", moved);
+        }
+    } else if (!strcmp(command, "bench")) {
+        errors = do_bench(argc - optind - 1, &argv[optind + 1]);
+    } else if (!strcmp(command, "pack") || !strcmp(command, "compact")) {
+        be_verbose = 1;
+        for (int i = optind + 1; i < argc; i++) {
+            if (!strcmp(command, "pack")) {
+                int n = mail_pack_convert(argv[i]);
+                if (n < 0) {
+                    fprintf(stderr, "%s: conversion failed\n", argv[i]);
+                    errors++;
+                } else {
+                    printf("%s: %d messages packed\n", argv[i], n);
+                }
+            } else if (mail_pack_compact(argv[i]) < 0) {
+                fprintf(stderr, "%s: compaction failed\n", argv[i]);
+                errors++;
+            }
+        }
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    return errors ? 1 : 0;
+}
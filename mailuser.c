@@ -7,53 +7,205 @@
  * Modified: Mar 5, 2022
  */
 
+#define _GNU_SOURCE
 #include "mailuser.h"
+#include "mailbackend.h"
+#include "mailpack.h"
+#include "compress.h"
+#include "arena.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <pthread.h>
 
 #define USER_FILE_NAME "users.txt"
 #define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_SEQ_FILE "mail.seq"
+// Records the layout of the mail store (see mail_store_shard)
+#define MAIL_LAYOUT_FILE ".layout"
+#define MAIL_MAX_SHARD_LEVELS 4
+// Longest name of a user directory, see mail_user_dir
+#define MAIL_DIR_MAX (sizeof(MAIL_BASE_DIRECTORY) + 3 * MAIL_MAX_SHARD_LEVELS + MAX_USERNAME_SIZE + 1)
+
+#define DELIVERY_HASH_SIZE 256
+#define DELIVERY_MAX_OPEN 1024
 
 struct user_list {
     char *user;
     struct user_list *next;
 };
 
-struct mail_item {
-    char file_name[2 * NAME_MAX];
-    size_t file_size;
-    int deleted;
+struct delivery_dir {
+    int dirfd;
+    int packed;
+    int dirty;          // changed since the last mail_delivery_sync
+    int created;        // created since the last mail_delivery_sync
+    struct delivery_dir *next;
+    char *path;
+    char user[];
 };
 
-struct mail_list {
-    struct mail_item item;
-    struct mail_list *next;
+struct mail_delivery {
+    struct delivery_dir *buckets[DELIVERY_HASH_SIZE];
+    int nopen;
 };
 
-/** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
- * 
- *  Returns: file pointer for users file, or NULL if file cannot be opened.
+struct mail_message {
+    char basefile[PATH_MAX];
+    char linkfile[PATH_MAX];    // file linked into mailboxes
+    char suffix[64];
+    int fd;                     // linkfile, once opened by mail_message_sync
+};
+
+int mail_compress_level = 0;
+
+// Store holding the maildrops (see mailbackend.h)
+static const struct mail_backend *backend = &mail_backend_dir;
+
+struct user_entry {
+    const char *name;
+    const char *password;
+    struct user_entry *next;
+};
+
+// Contents of the users file, kept in memory and looked up by a hash
+// of the case-folded user name
+struct user_table {
+    char *data;                 // the file, with the names and passwords
+    struct user_entry *entries;
+    struct user_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    // Identifies the version of the file the table was loaded from
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+static struct user_table *user_table;
+static pthread_rwlock_t user_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Internal function that returns a hash of a user name, ignoring case.
  */
-static FILE *user_file_list(void) {
+static uint32_t user_hash(const char *username) {
+    uint32_t h = 2166136261u;
+    for (; *username; username++)
+        h = (h ^ (unsigned char) tolower((unsigned char) *username)) * 16777619u;
+    return h;
+}
 
-    static FILE *file_ptr = NULL;
-    if (!file_ptr)
-        file_ptr = fopen(USER_FILE_NAME, "r+");
-    if (file_ptr)
-        rewind(file_ptr);
-    return file_ptr;
+/** Internal function that returns non-zero if a table was not loaded
+ *  from the version of the users file described by st (NULL if the
+ *  file does not exist).
+ */
+static int user_table_stale(struct user_table *table, const struct stat *st) {
+    if (!table) return 1;
+    if (!st) return table->exists;
+    return !table->exists || table->dev != st->st_dev || table->ino != st->st_ino ||
+        table->size != st->st_size || table->mtime.tv_sec != st->st_mtim.tv_sec ||
+        table->mtime.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+static void user_table_free(struct user_table *table) {
+    if (!table) return;
+    free(table->data);
+    free(table->entries);
+    free(table->buckets);
+    free(table);
 }
+
+/** Internal function that reads the users file into a new table. The
+ *  file is a list of user names and passwords separated by white
+ *  space; if a name appears more than once, the first one is used.
+ *
+ *  Returns: The table (empty if the file does not exist), or NULL if
+ *           no memory is available.
+ */
+static struct user_table *user_table_load(void) {
+    struct user_table *table = calloc(1, sizeof(struct user_table));
+    if (!table) return NULL;
+
+    struct stat st;
+    int fd = open(USER_FILE_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        table->exists = 1;
+        table->dev = st.st_dev;
+        table->ino = st.st_ino;
+        table->size = st.st_size;
+        table->mtime = st.st_mtim;
+        table->data = malloc(st.st_size + 1);
+        if (table->data) {
+            ssize_t len = read(fd, table->data, st.st_size);
+            table->data[len > 0 ? len : 0] = 0;
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    // At most one entry per two words
+    size_t max = table->data ? table->size / 4 + 1 : 1;
+    table->nbuckets = 16;
+    while (table->nbuckets < max) table->nbuckets *= 2;
+    table->entries = malloc(max * sizeof(struct user_entry));
+    table->buckets = calloc(table->nbuckets, sizeof(struct user_entry *));
+    if (!table->entries || !table->buckets || (table->exists && !table->data)) {
+        user_table_free(table);
+        return NULL;
+    }
+
+    static const char spaces[] = " \t\r\n";
+    char *saveptr, *name, *password;
+    name = table->data ? strtok_r(table->data, spaces, &saveptr) : NULL;
+    for (; name && (password = strtok_r(NULL, spaces, &saveptr)) != NULL && table->count < max;
+         name = strtok_r(NULL, spaces, &saveptr)) {
+        if (strlen(name) > MAX_USERNAME_SIZE || strlen(password) > MAX_PASSWORD_SIZE)
+            continue;
+        struct user_entry **bucket = &table->buckets[user_hash(name) & (table->nbuckets - 1)];
+        struct user_entry *e;
+        for (e = *bucket; e && strcasecmp(e->name, name); e = e->next)
+            ;
+        if (e) continue;
+        e = &table->entries[table->count++];
+        e->name = name;
+        e->password = password;
+        e->next = *bucket;
+        *bucket = e;
+    }
+    return table;
+}
+
+/** Reads the users file again, e.g., after users were added. Sessions
+ *  checking users at the same time see either the old or the new list.
+ *  The file is also read again automatically when it changes.
+ *
+ *  Returns: Number of users, or -1 if no memory is available.
+ */
+int mail_users_reload(void) {
+    struct user_table *table = user_table_load();
+    if (!table) return -1;
+    int count = table->count;
+    pthread_rwlock_wrlock(&user_table_lock);
+    struct user_table *old = user_table;
+    user_table = table;
+    pthread_rwlock_unlock(&user_table_lock);
+    user_table_free(old);
+    return count;
+}
+
 /** Checks if the user name is valid. If password is supplied, also
  *  checks if the password matches the user name. The username check
  *  ignores case (i.e., upper-case and lower-case letters are
@@ -73,15 +225,30 @@ static FILE *user_file_list(void) {
  *           password, and zero (false) otherwise.
  */
 int is_valid_user(const char *username, const char *password) {
-    FILE *file_ptr = user_file_list();
-    if (!file_ptr) return 0;
-    char user_file[MAX_USERNAME_SIZE+1];
-    char pw_file[MAX_PASSWORD_SIZE+1];
-    while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-        if (!strcasecmp(username, user_file))
-            return password == NULL || !strcmp(password, pw_file);
+    // The users file is only read again if it changed
+    struct stat st;
+    int exists = stat(USER_FILE_NAME, &st) == 0;
+
+    pthread_rwlock_rdlock(&user_table_lock);
+    while (user_table_stale(user_table, exists ? &st : NULL)) {
+        pthread_rwlock_unlock(&user_table_lock);
+        if (mail_users_reload() < 0)
+            return 0;
+        exists = stat(USER_FILE_NAME, &st) == 0;
+        pthread_rwlock_rdlock(&user_table_lock);
     }
-    return 0;
+
+    int rv = 0;
+    struct user_table *table = user_table;
+    struct user_entry *e = table->buckets[user_hash(username) & (table->nbuckets - 1)];
+    for (; e; e = e->next) {
+        if (!strcasecmp(username, e->name)) {
+            rv = password == NULL || !strcmp(password, e->password);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&user_table_lock);
+    return rv;
 }
 
 /** Creates a new, empty, list of users.
@@ -136,6 +303,634 @@ void user_list_destroy(user_list_t list) {
     }
 }
 
+/** Returns the name of the first user in a list of users.
+ *
+ *  Parameters: list: Non-empty list of users.
+ */
+const char *user_list_name(user_list_t list) {
+    return list->user;
+}
+
+/** Returns the list of users after the first one.
+ *
+ *  Parameters: list: Non-empty list of users.
+ */
+user_list_t user_list_next(user_list_t list) {
+    return list->next;
+}
+
+// Number of shard levels of the mail store (0 for the flat layout),
+// or -1 until the layout file is read
+static int store_levels = -1;
+
+/** Internal function that returns the number of shard levels of the
+ *  mail store, reading the layout file the first time, or every time
+ *  if reload is set.
+ */
+static int mail_store_levels(int reload) {
+    int levels = __atomic_load_n(&store_levels, __ATOMIC_RELAXED);
+    if (levels < 0 || reload) {
+        char buf[32];
+        levels = 0;
+        int fd = open(MAIL_BASE_DIRECTORY "/" MAIL_LAYOUT_FILE, O_RDONLY | O_CLOEXEC);
+        ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+        if (len > 0) {
+            buf[len] = 0;
+            if (sscanf(buf, "hashed %d", &levels) != 1 ||
+                levels < 0 || levels > MAIL_MAX_SHARD_LEVELS)
+                levels = 0;
+        }
+        if (fd >= 0) close(fd);
+        __atomic_store_n(&store_levels, levels, __ATOMIC_RELAXED);
+    }
+    return levels;
+}
+
+/** Internal function that writes the directory of a user in a layout
+ *  with the given number of shard levels. Each level is named after
+ *  one byte of a hash of the case-folded user name, e.g.,
+ *  "mail.store/3f/a0/user" with two levels.
+ */
+static size_t user_dir_at(int levels, const char *username, char *buf, size_t size) {
+    uint32_t h = user_hash(username);
+    char shards[3 * MAIL_MAX_SHARD_LEVELS + 1];
+    for (int i = 0; i < levels; i++)
+        sprintf(shards + 3 * i, "%02x/", (h >> (8 * i)) & 0xff);
+    shards[3 * levels] = 0;
+    return snprintf(buf, size, "%s/%s%s", MAIL_BASE_DIRECTORY, shards, username);
+}
+
+/** Writes the name of the directory holding the maildrop of a user.
+ *  The POP3 server and delivery both find users through this lookup.
+ *  In a sharded store (see mail_store_shard) users are spread over
+ *  nested directories, so no directory grows with the number of
+ *  users. Users not yet moved from the flat layout are still found.
+ *
+ *  Parameters: username: Name of the user.
+ *              buf: Buffer receiving the directory name.
+ *              size: Size of buf.
+ *
+ *  Returns: Length of the directory name (as snprintf). If the
+ *           directory does not exist, the name it should be created
+ *           with is returned.
+ */
+size_t mail_user_dir(const char *username, char *buf, size_t size) {
+    struct stat st;
+    int levels = mail_store_levels(0);
+    size_t len = user_dir_at(levels, username, buf, size);
+    if (len >= size || stat(buf, &st) == 0)
+        return len;
+
+    if (levels > 0) {
+        // Not moved yet from the flat layout
+        char flat[MAIL_DIR_MAX];
+        size_t flat_len = user_dir_at(0, username, flat, sizeof(flat));
+        if (flat_len < size && stat(flat, &st) == 0) {
+            strcpy(buf, flat);
+            return flat_len;
+        }
+    } else if (mail_store_levels(1) > 0) {
+        // The store was sharded since the layout was read
+        return mail_user_dir(username, buf, size);
+    }
+    return len;
+}
+
+/** Internal function that creates the directories leading to a path,
+ *  in a sharded store. Errors are ignored; creating the path itself
+ *  reports them.
+ */
+static void mkdir_parents(const char *path) {
+    char dir[MAIL_DIR_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + strlen(MAIL_BASE_DIRECTORY) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = 0;
+        mkdir(dir, 0777);
+        *p = '/';
+    }
+}
+
+/** Internal function that returns non-zero if a name in the base
+ *  directory of a sharded store is a shard directory.
+ */
+static int is_shard_name(const char *name) {
+    return strlen(name) == 2 && isxdigit((unsigned char) name[0]) &&
+        isxdigit((unsigned char) name[1]);
+}
+
+/** Internal function that adds the users in a directory of the mail
+ *  store to a list, descending into shard directories.
+ */
+static void list_users_at(user_list_t *list, const char *path, int levels, int top) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        if (dir_entry->d_type != DT_DIR || dir_entry->d_name[0] == '.')
+            continue;
+        // Users in the base directory have not been moved to a shard yet
+        if (levels > 0 && (!top || is_shard_name(dir_entry->d_name))) {
+            char sub[MAIL_DIR_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", path, dir_entry->d_name);
+            list_users_at(list, sub, levels - 1, 0);
+        } else {
+            user_list_add(list, dir_entry->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/** Selects the store holding the maildrops, and prepares it. Must be
+ *  called before any other thread uses the store.
+ *
+ *  Parameters: name: Name of the backend (see mailbackend.h).
+ *
+ *  Returns: 0 on success, -1 if there is no such backend or it could
+ *           not be prepared.
+ */
+int mail_backend_select(const char *name) {
+    static const struct mail_backend *const backends[] = {
+        &mail_backend_dir, &mail_backend_memory,
+    };
+    for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(name, backends[i]->name))
+            continue;
+        if (backends[i]->init && backends[i]->init() < 0)
+            return -1;
+        backend = backends[i];
+        return 0;
+    }
+    return -1;
+}
+
+/** Checks that the user list can be read and that the mail store can
+ *  be used. May block if the store is on a file system that does not
+ *  respond.
+ *
+ *  Returns: 0 if the store is usable, -1 otherwise.
+ */
+int mail_store_check(void) {
+    if (access(USER_FILE_NAME, R_OK) < 0)
+        return -1;
+    return backend->check();
+}
+
+/** Internal function that checks that the directory of the mail store
+ *  is readable and writable, or does not exist yet (the first delivery
+ *  creates it).
+ */
+static int dir_check(void) {
+    if (access(MAIL_BASE_DIRECTORY, R_OK | W_OK | X_OK) < 0 && errno != ENOENT)
+        return -1;
+    return 0;
+}
+
+/** Returns the list of users that have a maildrop in the mail store,
+ *  whether or not they have messages in it.
+ *
+ *  Returns: A user_list_t object, to be freed with user_list_destroy.
+ */
+user_list_t mail_store_users(void) {
+    return backend->users();
+}
+
+static user_list_t dir_users(void) {
+    user_list_t list = user_list_create();
+    list_users_at(&list, MAIL_BASE_DIRECTORY, mail_store_levels(1), 1);
+    return list;
+}
+
+/** Moves the maildrops of the mail store from the flat layout, with
+ *  every user directory directly under the base directory, to a
+ *  sharded layout with the given number of levels. The layout is
+ *  recorded first, so servers and deliveries running during the move
+ *  find each user in either place; a session that loads a maildrop
+ *  while it is being moved may see it empty.
+ *
+ *  Parameters: levels: Number of shard levels, from 1 to 4. Each level
+ *                      has up to 256 directories.
+ *
+ *  Returns: Number of users moved, or -1 in case of error (including
+ *           a store that is already sharded with a different number
+ *           of levels).
+ */
+int mail_store_shard(int levels) {
+    char tmp[] = MAIL_BASE_DIRECTORY "/" MAIL_LAYOUT_FILE ".tmp";
+    char buf[32];
+    int moved = 0;
+
+    if (levels < 1 || levels > MAIL_MAX_SHARD_LEVELS)
+        return -1;
+    int current = mail_store_levels(1);
+    if (current > 0 && current != levels)
+        return -1;
+
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    int len = sprintf(buf, "hashed %d\n", levels);
+    if (write(fd, buf, len) != len || fsync(fd) < 0 ||
+        rename(tmp, MAIL_BASE_DIRECTORY "/" MAIL_LAYOUT_FILE) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    __atomic_store_n(&store_levels, levels, __ATOMIC_RELAXED);
+
+    DIR *dir = opendir(MAIL_BASE_DIRECTORY);
+    if (!dir) return -1;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        if (dir_entry->d_type != DT_DIR || dir_entry->d_name[0] == '.' ||
+            is_shard_name(dir_entry->d_name))
+            continue;
+        char from[MAIL_DIR_MAX], to[MAIL_DIR_MAX];
+        user_dir_at(0, dir_entry->d_name, from, sizeof(from));
+        if (user_dir_at(levels, dir_entry->d_name, to, sizeof(to)) >= sizeof(to))
+            continue;
+        mkdir_parents(to);
+        if (rename(from, to) < 0) {
+            dlog("Could not move %s to %s\n", from, to);
+            continue;
+        }
+        moved++;
+    }
+    // One sync for all renames, instead of one per directory
+    syncfs(dirfd(dir));
+    closedir(dir);
+    return moved;
+}
+
+/** Reads the maildrop of a user as load_user_mail does, without
+ *  keeping it. This brings the directory, the file metadata and the
+ *  pack index into the kernel caches, so a later login does not have
+ *  to wait for the disk.
+ *
+ *  Parameters: username: Name of the user whose maildrop is read.
+ *              bytes: Set to the total size of the messages.
+ *
+ *  Returns: Number of messages in the maildrop.
+ */
+int mail_user_warm(const char *username, size_t *bytes) {
+    mail_list_t list = load_user_mail(username);
+    int count = mail_list_length(list, 1);
+    *bytes = mail_list_size(list);
+    // Nothing is marked as deleted, so this only frees the list
+    mail_list_destroy(list);
+    return count;
+}
+
+/** Internal function that returns a hash bucket for a user name.
+ */
+static unsigned delivery_hash(const char *user) {
+    unsigned h = 2166136261u;
+    for (; *user; user++)
+        h = (h ^ (unsigned char) *user) * 16777619u;
+    return h % DELIVERY_HASH_SIZE;
+}
+
+/** Internal function that closes all directories cached in a
+ *  delivery object.
+ */
+static void delivery_close_all(mail_delivery_t delivery) {
+    for (int i = 0; i < DELIVERY_HASH_SIZE; i++) {
+        while (delivery->buckets[i]) {
+            struct delivery_dir *next = delivery->buckets[i]->next;
+            close(delivery->buckets[i]->dirfd);
+            free(delivery->buckets[i]);
+            delivery->buckets[i] = next;
+        }
+    }
+    delivery->nopen = 0;
+}
+
+/** Internal function that returns the cached directory of a user,
+ *  opening it (and creating it, if needed) on first use.
+ *
+ *  Returns: the cached directory, or NULL in case of error.
+ */
+static struct delivery_dir *delivery_dir(mail_delivery_t delivery, const char *user) {
+    unsigned h = delivery_hash(user);
+    struct delivery_dir *dir;
+    for (dir = delivery->buckets[h]; dir; dir = dir->next)
+        if (!strcmp(dir->user, user))
+            return dir;
+
+    // Directories that are closed must not miss a pending sync
+    if (delivery->nopen >= DELIVERY_MAX_OPEN) {
+        mail_delivery_sync(delivery);
+        delivery_close_all(delivery);
+    }
+
+    // Create a directory for the user if it doesn't exist yet. If it
+    // exists mkdir will return an error, which is ignored.
+    char mail_dir[MAIL_DIR_MAX];
+    if (mail_user_dir(user, mail_dir, sizeof(mail_dir)) >= sizeof(mail_dir))
+        return NULL;
+    int created = mkdir(mail_dir, 0777) == 0;
+    if (!created && errno == ENOENT) {
+        mkdir_parents(mail_dir);
+        created = mkdir(mail_dir, 0777) == 0;
+    }
+    int dirfd = open(mail_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        return NULL;
+
+    dir = malloc(sizeof(struct delivery_dir) + strlen(user) + 1 + strlen(mail_dir) + 1);
+    if (!dir) {
+        close(dirfd);
+        return NULL;
+    }
+    dir->dirfd = dirfd;
+    dir->packed = faccessat(dirfd, PACK_INDEX_FILE, F_OK, 0) == 0;
+    dir->dirty = 0;
+    dir->created = created;
+    strcpy(dir->user, user);
+    dir->path = dir->user + strlen(user) + 1;
+    strcpy(dir->path, mail_dir);
+    dir->next = delivery->buckets[h];
+    delivery->buckets[h] = dir;
+    delivery->nopen++;
+    return dir;
+}
+
+/** Internal function that finds the first free message number in a
+ *  user directory that has no sequence file yet, i.e., one more than
+ *  the highest numbered message file.
+ */
+static unsigned long mail_seq_scan(int dirfd) {
+    unsigned long next = 0;
+    DIR *dir = fdopendir(dup(dirfd));
+    if (!dir) return 0;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long n = strtoul(dir_entry->d_name, &end, 10);
+        if (end != dir_entry->d_name && n >= next &&
+            (!strcmp(end, MAIL_FILE_SUFFIX) || !strncmp(end, COMPRESS_SIZE_MARKER, strlen(COMPRESS_SIZE_MARKER))))
+            next = n + 1;
+    }
+    closedir(dir);
+    return next;
+}
+
+/** Internal function that links a message into a user directory under
+ *  the next free message number. The number is taken from a per-user
+ *  sequence file, which is locked while it is advanced, so a delivery
+ *  normally costs a single link. Existing names are skipped only if a
+ *  file was created by other means.
+ *
+ *  Parameters: dirfd: Open user directory.
+ *              basefile: Name of the file to be linked.
+ *              suffix: Added to the message number to build the name.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+static int link_next_mail(int dirfd, const char *basefile, const char *suffix) {
+    char mail_file[NAME_MAX + 1];
+    char seqbuf[32];
+    unsigned long seq = 0;
+    int rv;
+
+    int seqfd = openat(dirfd, MAIL_SEQ_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (seqfd >= 0 && flock(seqfd, LOCK_EX) < 0) {
+        close(seqfd);
+        seqfd = -1;
+    }
+    ssize_t len = seqfd < 0 ? -1 : pread(seqfd, seqbuf, sizeof(seqbuf) - 1, 0);
+    if (len > 0) {
+        seqbuf[len] = 0;
+        seq = strtoul(seqbuf, NULL, 10);
+    } else {
+        seq = mail_seq_scan(dirfd);
+    }
+
+    do {
+        snprintf(mail_file, sizeof(mail_file), "%lu%s", seq++, suffix);
+    } while ((rv = linkat(AT_FDCWD, basefile, dirfd, mail_file, 0)) < 0 && errno == EEXIST);
+
+    if (seqfd >= 0) {
+        // The counter never decreases, so the new value is never
+        // shorter than the old one and no truncation is needed.
+        if (rv == 0 && pwrite(seqfd, seqbuf, sprintf(seqbuf, "%lu\n", seq), 0) < 0)
+            dlog("Could not update message sequence file\n");
+        close(seqfd);
+    }
+    return rv;
+}
+
+/** Creates an object for delivering several messages in a batch.
+ *  The directories of recipients are kept open between messages, so
+ *  messages are linked relative to the directory without looking up
+ *  the full path every time.
+ *
+ *  Returns: A mail_delivery_t object, or NULL in case of error.
+ */
+mail_delivery_t mail_delivery_create(void) {
+
+    // Create base directory if it doesn't exist yet (error ignored)
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    return calloc(1, sizeof(struct mail_delivery));
+}
+
+/** Prepares a message for delivery to any number of recipients.
+ *
+ *  If mail_compress_level is set and compression is supported, the
+ *  message is compressed once into a file next to basefile, and the
+ *  compressed file is linked into each recipient directory under a
+ *  name that records the uncompressed size. Packed mailboxes always
+ *  store messages uncompressed.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message. It must not
+ *                        change until the message is destroyed.
+ *
+ *  Returns: A mail_message_t object, or NULL in case of error.
+ */
+mail_message_t mail_message_create(const char *basefile) {
+    mail_message_t msg = malloc(sizeof(struct mail_message));
+    if (!msg) return NULL;
+    snprintf(msg->basefile, sizeof(msg->basefile), "%s", basefile);
+    strcpy(msg->linkfile, msg->basefile);
+    strcpy(msg->suffix, MAIL_FILE_SUFFIX);
+    msg->fd = -1;
+
+    if (mail_compress_level > 0 && compress_supported()) {
+        snprintf(msg->linkfile, sizeof(msg->linkfile), "%s.z", basefile);
+        long size = compress_file(basefile, msg->linkfile, mail_compress_level);
+        if (size >= 0) {
+            sprintf(msg->suffix, COMPRESS_SIZE_MARKER "%ld" MAIL_FILE_SUFFIX, size);
+        } else {
+            dlog("Could not compress %s, saving it uncompressed\n", basefile);
+            strcpy(msg->linkfile, msg->basefile);
+        }
+    }
+    return msg;
+}
+
+/** Writes the contents of a prepared message to disk, so that the
+ *  message survives a crash once it is linked into mailboxes. Messages
+ *  of a batch can be written in two passes: first start writing all
+ *  of them, then wait for each one, so the disk sees all the writes
+ *  at once instead of one flush per message.
+ *
+ *  Parameters: msg: Prepared message.
+ *              wait: If zero, only starts writing the contents. If
+ *                    non-zero, waits until they are on disk.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int mail_message_sync(mail_message_t msg, int wait) {
+    if (msg->fd < 0)
+        msg->fd = open(msg->linkfile, O_RDONLY | O_CLOEXEC);
+    if (msg->fd < 0)
+        return -1;
+    if (wait)
+        return fdatasync(msg->fd);
+    return sync_file_range(msg->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+/** Frees a prepared message, removing the compressed copy if one was
+ *  made. The temporary file given to mail_message_create is left for
+ *  the caller to remove.
+ *
+ *  Parameters: msg: Prepared message to be freed.
+ */
+void mail_message_destroy(mail_message_t msg) {
+    if (msg->fd >= 0)
+        close(msg->fd);
+    if (strcmp(msg->linkfile, msg->basefile))
+        unlink(msg->linkfile);
+    free(msg);
+}
+
+/** Saves a prepared message into the mail storage for a list of
+ *  users, as part of a batch delivery. The new directory entries are
+ *  not synced to disk until mail_delivery_sync is called.
+ *
+ *  Parameters: delivery: Batch delivery object.
+ *              msg: Message prepared with mail_message_create.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: Number of recipients the message could not be saved for.
+ */
+int mail_delivery_link(mail_delivery_t delivery, mail_message_t msg, user_list_t users) {
+    int errors = 0;
+
+    for (; users; users = users->next) {
+        struct delivery_dir *dir = delivery_dir(delivery, users->user);
+        if (!dir) {
+            errors++;
+            continue;
+        }
+        dir->dirty = 1;
+
+        // Users with a packed mailbox get the message appended to the pack
+        if (dir->packed) {
+            if (pack_append_file(dir->path, msg->basefile) < 0) {
+                dlog("Could not append mail to pack in %s\n", dir->path);
+                errors++;
+            }
+            continue;
+        }
+
+        if (link_next_mail(dir->dirfd, msg->linkfile, msg->suffix) < 0)
+            errors++;
+    }
+    return errors;
+}
+
+/** Saves a new email message into the mail storage for a list of
+ *  users, as part of a batch delivery. Same as preparing the message
+ *  with mail_message_create and linking it with mail_delivery_link.
+ *
+ *  Parameters: delivery: Batch delivery object.
+ *              basefile: Name of a temporary file containing the
+ *                        contents of the email message.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: Number of recipients the message could not be saved for.
+ */
+int mail_delivery_save(mail_delivery_t delivery, const char *basefile, user_list_t users) {
+    mail_message_t msg = mail_message_create(basefile);
+    if (!msg)
+        return user_list_len(users);
+    int errors = mail_delivery_link(delivery, msg, users);
+    mail_message_destroy(msg);
+    return errors;
+}
+
+/** Internal function that syncs a file of a user directory, if it
+ *  exists.
+ */
+static int sync_file_at(int dirfd, const char *name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    int rv = fsync(fd);
+    close(fd);
+    return rv;
+}
+
+/** Internal function that syncs the directories leading to a newly
+ *  created user directory, so the user directory can be found after
+ *  a crash.
+ */
+static int sync_parents(const char *path) {
+    char dir[MAIL_DIR_MAX];
+    int rv = 0;
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strrchr(dir, '/'); p; p = strrchr(dir, '/')) {
+        *p = 0;
+        int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fsync(fd) < 0)
+            rv = -1;
+        if (fd >= 0) close(fd);
+    }
+    return rv;
+}
+
+/** Makes the messages saved since the last call durable: syncs each
+ *  recipient directory that changed (and the pack files of packed
+ *  mailboxes) once, however many messages were saved into it. The
+ *  contents of the messages must already be on disk (see
+ *  mail_message_sync).
+ *
+ *  Parameters: delivery: Batch delivery object.
+ *
+ *  Returns: 0 on success, -1 if some directory could not be synced.
+ */
+int mail_delivery_sync(mail_delivery_t delivery) {
+    int rv = 0;
+    for (int i = 0; i < DELIVERY_HASH_SIZE; i++) {
+        for (struct delivery_dir *dir = delivery->buckets[i]; dir; dir = dir->next) {
+            if (!dir->dirty)
+                continue;
+            if (dir->packed && (sync_file_at(dir->dirfd, PACK_DATA_FILE) < 0 ||
+                                sync_file_at(dir->dirfd, PACK_INDEX_FILE) < 0))
+                rv = -1;
+            if (fsync(dir->dirfd) < 0)
+                rv = -1;
+            if (dir->created && sync_parents(dir->path) < 0)
+                rv = -1;
+            dir->dirty = dir->created = 0;
+        }
+    }
+    return rv;
+}
+
+/** Frees all resources used by a batch delivery object.
+ *
+ *  Parameters: delivery: Batch delivery object to be freed.
+ */
+void mail_delivery_destroy(mail_delivery_t delivery) {
+    delivery_close_all(delivery);
+    free(delivery);
+}
+
 /** Saves a new email message into the mail storage for a list of
  *  users.
  *
@@ -150,31 +945,47 @@ void user_list_destroy(user_list_t list) {
  *              users: List of recipient users to the message.
  */
 void save_user_mail(const char *basefile, user_list_t users) {
-  
-    char mail_file[2 * NAME_MAX + 1];
-  
-    // Create base directory if it doesn't exist yet (error ignored)
-    mkdir(MAIL_BASE_DIRECTORY, 0777);
-  
-    for (; users; users = users->next) {
-    
-        // Create a directory for the user if it doesn't exist yet. If it
-        // exists mkdir will return an error, which is ignored.
-        int i = 0;
-        sprintf(mail_file, "%s/%s", MAIL_BASE_DIRECTORY, users->user);
-        mkdir(mail_file, 0777);
-    
-        // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-        do {
-            sprintf(mail_file, "%s/%s/%d" MAIL_FILE_SUFFIX, MAIL_BASE_DIRECTORY, users->user, i++);
-        } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+    backend->deliver(basefile, users);
+}
+
+static int dir_deliver(const char *basefile, user_list_t users) {
+    mail_delivery_t delivery = mail_delivery_create();
+    if (!delivery) return -1;
+    int errors = mail_delivery_save(delivery, basefile, users);
+    mail_delivery_destroy(delivery);
+    return errors;
+}
+
+/** Adds an empty item at the end of a list of emails, growing the list
+ *  if needed. Used by backends to load maildrops.
+ *
+ *  Returns: The new item, or NULL if no memory is available.
+ */
+struct mail_item *mail_list_append(mail_list_t list) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 16;
+        struct mail_item *items = list->arena ?
+            arena_realloc(list->arena, list->items, list->capacity * sizeof(struct mail_item),
+                          capacity * sizeof(struct mail_item)) :
+            realloc(list->items, capacity * sizeof(struct mail_item));
+        if (!items) return NULL;
+        list->items = items;
+        list->capacity = capacity;
     }
+    return &list->items[list->count++];
+}
+
+static int mail_item_compare(const void *a, const void *b) {
+    return strcmp(((const struct mail_item *) a)->file_name,
+                  ((const struct mail_item *) b)->file_name);
 }
 
 /** Reads the list of available email messages for a username, based
  *  on existing email files created using save_user_mail (or
  *  equivalent). Only file names and sizes are loaded into memory, the
- *  messages themselves are not kept in memory. If the user does not
+ *  messages themselves are not kept in memory. If the user has a
+ *  packed mailbox (see mailpack.h), its messages are listed first,
+ *  based on a single read of the pack index. If the user does not
  *  exist or does not have any messages, an empty list is returned.
  *
  *  Parameters: username: Name of the user whose email messages should
@@ -184,18 +995,79 @@ void save_user_mail(const char *basefile, user_list_t users) {
  *           available for the provided username.
  */
 mail_list_t load_user_mail(const char *username) {
-  
-    char filename[2 * NAME_MAX + 1];
-    sprintf(filename, "%s/%s", MAIL_BASE_DIRECTORY, username);
+    return load_user_mail_arena(NULL, username);
+}
+
+/** Reads the list of available email messages for a username, like
+ *  load_user_mail, with all memory for the list taken from an arena.
+ *  mail_list_destroy must still be called to delete messages, but
+ *  the memory is only released with the arena.
+ *
+ *  Parameters: arena: Arena the list is allocated from, or NULL to
+ *                     use malloc.
+ *              username: Name of the user whose email messages should
+ *                        be retrieved.
+ *
+ *  Returns: A mail_list_t object containing a list of email messages
+ *           available for the provided username, or NULL if no
+ *           memory is available.
+ */
+mail_list_t load_user_mail_arena(arena_t arena, const char *username) {
+    mail_list_t list = arena ? arena_alloc(arena, sizeof(struct mail_list)) :
+        malloc(sizeof(struct mail_list));
+    if (!list) return NULL;
+    list->arena = arena;
+    list->count = list->capacity = 0;
+    list->items = NULL;
+    if (backend->load(list, username) < 0)
+        dlog("Could not load all messages of %s\n", username);
+    return list;
+}
+
+/** Internal function that lists the messages of a user in the mail
+ *  store directory, as load_user_mail describes.
+ */
+static int dir_load(mail_list_t list, const char *username) {
+    char filename[MAIL_DIR_MAX];
+    size_t len = mail_user_dir(username, filename, sizeof(filename));
     dlog("Loading mail for user %s from %s\n", username, filename);
-  
+    // A name this long cannot have a maildrop
+    if (len >= sizeof(filename)) return 0;
+    int rv = 0;
+
+    // Messages in a pack come first, in delivery order
+    struct pack_record *records;
+    size_t nrecords;
+    mail_pack_t pack = pack_open(filename, &records, &nrecords);
+    if (pack) {
+        for (size_t i = 0; i < nrecords; i++) {
+            struct mail_item *item = mail_list_append(list);
+            if (!item) {
+                rv = -1;
+                break;
+            }
+            snprintf(item->file_name, sizeof(item->file_name), "%s/%s#%llu",
+                     filename, PACK_DATA_FILE, (unsigned long long) records[i].id);
+            item->file_size = records[i].length;
+            item->deleted = 0;
+            item->compressed = 0;
+            item->have_id = 0;
+            item->pack = pack;
+            item->pack_id = records[i].id;
+            item->pack_offset = records[i].offset;
+            pack_retain(pack);
+        }
+        free(records);
+        pack_release(pack);
+    }
+    size_t npacked = list->count;
+
     DIR *dir = opendir(filename);
-    if (!dir) return NULL;
+    if (!dir) return rv;
   
     struct stat file_stat;
     struct dirent *dir_entry;
     const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-    struct mail_list *list = NULL;
   
     while ((dir_entry = readdir(dir)) != NULL) {
     
@@ -206,49 +1078,137 @@ mail_list_t load_user_mail(const char *username) {
             // Check if the filename ends with the mail suffix
             !strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
       
-            struct mail_list *node = malloc(sizeof(struct mail_list));
-            sprintf(node->item.file_name, "%s/%s/%s",
-                    MAIL_BASE_DIRECTORY, username, dir_entry->d_name);
-      
-            if (stat(node->item.file_name, &file_stat) < 0) {
-                free(node);
+            struct mail_item *item = mail_list_append(list);
+            if (!item) {
+                rv = -1;
+                break;
+            }
+            size_t dir_len = strlen(filename), name_len = strlen(dir_entry->d_name);
+            if (dir_len + name_len + 2 > sizeof(item->file_name)) {
+                list->count--;
                 continue;
             }
+            memcpy(item->file_name, filename, dir_len);
+            item->file_name[dir_len] = '/';
+            memcpy(item->file_name + dir_len + 1, dir_entry->d_name, name_len + 1);
       
-            node->item.file_size = file_stat.st_size;
-            node->item.deleted = 0;
-            struct mail_list *next = list;
-            struct mail_list **prev = &list;
-            while (next && strcmp(node->item.file_name, next->item.file_name) > 0) {
-                prev = &next->next;
-                next = next->next;
+            // Compressed messages carry their uncompressed size in the
+            // name, so they don't need to be opened or decompressed
+            char *marker = strstr(dir_entry->d_name, COMPRESS_SIZE_MARKER);
+            if (marker) {
+                item->file_size = strtoul(marker + strlen(COMPRESS_SIZE_MARKER), NULL, 10);
+                item->compressed = 1;
+                item->have_id = 0;
+            } else if (stat(item->file_name, &file_stat) < 0) {
+                list->count--;
+                continue;
+            } else {
+                item->file_size = file_stat.st_size;
+                item->compressed = 0;
+                item->have_id = 1;
+                item->id.dev = file_stat.st_dev;
+                item->id.ino = file_stat.st_ino;
+                item->id.mtime = file_stat.st_mtim;
+                item->id.offset = 0;
+                item->id.generation = 0;
             }
-            node->next = next;
-            *prev = node;
+            item->deleted = 0;
+            item->pack = NULL;
         }
     }
     closedir(dir);
-    return list;
+
+    // Individual messages are listed in file name order
+    qsort(list->items + npacked, list->count - npacked, sizeof(struct mail_item),
+          mail_item_compare);
+    return rv;
 }
 
 /** Frees all memory used by a list of emails. Also deletes any files
- *  marked to be deleted.
+ *  marked to be deleted, and the user directory if no messages are
+ *  left in it. For a list allocated from an arena, the memory is
+ *  released with the arena instead.
  *
  *  Parameters: list: List of emails to be deleted.
  *  Return:     number of errors, if any
  */
 int mail_list_destroy(mail_list_t list) {
+    if (!list) return 0;
+    int errors = backend->commit(list);
+    if (!list->arena) {
+        free(list->items);
+        free(list);
+    }
+    return errors;
+}
+
+/** Internal function that removes a user directory once its last
+ *  message has been deleted. The sequence file is removed under its
+ *  lock, and only if no message was delivered in the meantime;
+ *  otherwise rmdir fails and the directory is kept.
+ */
+static void remove_user_dir(const char *user_dir) {
+    int dirfd = open(user_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) return;
+    int seqfd = openat(dirfd, MAIL_SEQ_FILE, O_RDWR | O_CLOEXEC);
+    if (seqfd >= 0 && flock(seqfd, LOCK_EX) == 0 && mail_seq_scan(dirfd) == 0)
+        unlinkat(dirfd, MAIL_SEQ_FILE, 0);
+    rmdir(user_dir);
+    if (seqfd >= 0) close(seqfd);
+    close(dirfd);
+}
+
+static int dir_commit(mail_list_t list) {
     int errors = 0;
-    while (list) {
-        if (list->item.deleted) {
-            if (unlink(list->item.file_name) < 0) {
+    mail_pack_t pack = NULL;
+    uint64_t *pack_ids = NULL, *pack_lengths = NULL;
+    size_t ndeleted = 0;
+    char user_dir[2 * NAME_MAX] = "";
+
+    for (size_t i = 0; i < list->count; i++) {
+        struct mail_item *item = &list->items[i];
+        if (item->pack) {
+            // All packed messages in a list come from the same pack;
+            // deletions are recorded in one batch at the end.
+            if (item->deleted) {
+                if (!pack) {
+                    pack = item->pack;
+                    pack_retain(pack);
+                }
+                // A deletion that cannot be recorded is counted as an error
+                uint64_t *ids = realloc(pack_ids, (ndeleted + 1) * sizeof(uint64_t));
+                if (ids) pack_ids = ids;
+                uint64_t *lengths = realloc(pack_lengths, (ndeleted + 1) * sizeof(uint64_t));
+                if (lengths) pack_lengths = lengths;
+                if (ids && lengths) {
+                    pack_ids[ndeleted] = item->pack_id;
+                    pack_lengths[ndeleted++] = item->file_size;
+                } else {
+                    errors++;
+                }
+            }
+            pack_release(item->pack);
+        } else if (item->deleted) {
+            if (unlink(item->file_name) < 0) {
                 errors++;
+            } else if (!user_dir[0]) {
+                strcpy(user_dir, item->file_name);
+                *strrchr(user_dir, '/') = '\0';
             }
         }
-        mail_list_t next = list->next;
-        free(list);
-        list = next;
     }
+
+    // Remove the user directory if the last message was deleted. If
+    // there are other files in it, rmdir fails and the error is ignored.
+    if (user_dir[0])
+        remove_user_dir(user_dir);
+
+    if (pack) {
+        errors += pack_delete(pack, pack_ids, pack_lengths, ndeleted);
+        pack_release(pack);
+    }
+    free(pack_ids);
+    free(pack_lengths);
     return errors;
 }
 
@@ -266,10 +1226,9 @@ int mail_list_destroy(mail_list_t list) {
  */
 int mail_list_length(mail_list_t list, int includedeleted) {
     int rv = 0;
-    while (list) {
-        if (includedeleted || !list->item.deleted) rv++;
-        list = list->next;
-    }
+    if (!list) return 0;
+    for (size_t i = 0; i < list->count; i++)
+        if (includedeleted || !list->items[i].deleted) rv++;
     return rv;
 }
 
@@ -291,13 +1250,9 @@ int mail_list_length(mail_list_t list, int includedeleted) {
  */
 mail_item_t mail_list_retrieve(mail_list_t list, unsigned int pos) {
   
-    while (list) {
-        if (!pos--)
-            return list->item.deleted ? NULL : &list->item;
-        list = list->next;
-    }
-  
-    return NULL;
+    if (!list || pos >= list->count || list->items[pos].deleted)
+        return NULL;
+    return &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -309,10 +1264,9 @@ mail_item_t mail_list_retrieve(mail_list_t list, unsigned int pos) {
  */
 size_t mail_list_size(mail_list_t list) {
     size_t rv = 0;
-    while (list) {
-        rv += list->item.deleted ? 0 : list->item.file_size;
-        list = list->next;
-    }
+    if (!list) return 0;
+    for (size_t i = 0; i < list->count; i++)
+        rv += list->items[i].deleted ? 0 : list->items[i].file_size;
     return rv;
 }
 
@@ -320,7 +1274,8 @@ size_t mail_list_size(mail_list_t list) {
  *
  *  Parameters: item: Email message to be assessed.
  *
- *  Returns: Size, in bytes, of an email message.
+ *  Returns: Size, in bytes, of an email message. For compressed
+ *           messages this is the uncompressed size.
  */
 size_t mail_item_size(mail_item_t item) {
     return item->file_size;
@@ -329,6 +1284,7 @@ size_t mail_item_size(mail_item_t item) {
 /** Returns a file pointer that can be used to read the contents of an
  *  email message. The caller is responsible for closing the file
  *  using the `fclose()` function once the data is no longer needed.
+ *  Compressed messages are decompressed as they are read.
  *
  *  Parameters: item: Email message to be retrieved.
  *
@@ -336,7 +1292,139 @@ size_t mail_item_size(mail_item_t item) {
  *           contents.
  */
 FILE *mail_item_contents(mail_item_t item) {
-    return fopen(item->file_name, "r");
+    return backend->contents(item, -1);
+}
+
+/** Starts reading the contents of an email message into the page
+ *  cache, so that reading it later does not wait for the disk. The
+ *  message file is opened (and kept open) so it is not looked up again
+ *  and its data cannot be evicted by a rename or unlink in between.
+ *
+ *  Parameters: item: Email message to be read ahead.
+ *
+ *  Returns: Descriptor of the open message file, to be passed to
+ *           mail_item_contents_fd, or -1 if no descriptor is kept open
+ *           (messages in a pack, or in case of error).
+ */
+int mail_item_prefetch(mail_item_t item) {
+    return backend->prefetch(item);
+}
+
+static int dir_prefetch(mail_item_t item) {
+    if (item->pack) {
+        pack_advise(item->pack, item->pack_offset, item->file_size);
+        return -1;
+    }
+    int fd = open(item->file_name, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    return fd;
+}
+
+/** Same as mail_item_contents, reading the message from a descriptor
+ *  returned by mail_item_prefetch, if any.
+ *
+ *  Parameters: item: Email message to be retrieved.
+ *              fd: Descriptor of the open message file, or -1. It is
+ *                  closed when the returned file is closed (or on
+ *                  error).
+ *
+ *  Returns: FILE * object, or NULL in case of error retrieving the
+ *           contents.
+ */
+FILE *mail_item_contents_fd(mail_item_t item, int fd) {
+    return backend->contents(item, fd);
+}
+
+static FILE *dir_contents(mail_item_t item, int fd) {
+    if (fd >= 0 && item->pack) {
+        close(fd);
+        fd = -1;
+    }
+    if (item->pack)
+        return pack_contents(item->pack, item->pack_offset, item->file_size);
+    if (fd < 0)
+        return item->compressed ? decompress_open(item->file_name) : fopen(item->file_name, "r");
+    if (item->compressed)
+        return decompress_fdopen(fd);
+    FILE *file = fdopen(fd, "r");
+    if (!file) close(fd);
+    return file;
+}
+
+/** Returns an identifier for the stored contents of an email
+ *  message, which can be used as a key to cache the contents. The
+ *  identifier changes if the stored message is replaced or modified.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *              id: Set to the identifier of the message contents.
+ *
+ *  Returns: 0 on success, -1 if the message cannot be identified.
+ */
+int mail_item_id(mail_item_t item, struct mail_item_id *id) {
+    return backend->id(item, id);
+}
+
+static int dir_id(mail_item_t item, struct mail_item_id *id) {
+    struct stat file_stat;
+
+    if (!item->have_id) {
+        if (item->pack) {
+            // Packs are append-only, so a message is identified by the
+            // data file and its offset in it. Compaction replaces the
+            // data file, possibly with one that reuses a freed inode,
+            // so the generation of the file is part of the id.
+            if (pack_stat(item->pack, &file_stat) < 0)
+                return -1;
+            item->id.mtime.tv_sec = item->id.mtime.tv_nsec = 0;
+            item->id.offset = item->pack_offset;
+            item->id.generation = pack_generation(item->pack);
+        } else {
+            if (stat(item->file_name, &file_stat) < 0)
+                return -1;
+            item->id.mtime = file_stat.st_mtim;
+            item->id.offset = 0;
+            item->id.generation = 0;
+        }
+        item->id.dev = file_stat.st_dev;
+        item->id.ino = file_stat.st_ino;
+        item->have_id = 1;
+    }
+    *id = item->id;
+    return 0;
+}
+
+/** Writes the unique id of a message, as used by UIDL. The id does not
+ *  change as long as the message is stored in the same way: a message
+ *  stored in its own file is identified by the file name (without the
+ *  suffix and the compression marker), which includes the number it
+ *  was given on delivery, and a message stored in a pack by its id in
+ *  the pack. Converting a maildrop to a pack changes the ids.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *              buf: Buffer receiving the id, with space for at least
+ *                   MAIL_UID_MAX + 1 characters. No NUL is added.
+ *
+ *  Returns: Length of the id.
+ */
+size_t mail_item_uid(mail_item_t item, char *buf) {
+    return backend->uid(item, buf);
+}
+
+static size_t dir_uid(mail_item_t item, char *buf) {
+    if (item->pack)
+        return sprintf(buf, "P%llu", (unsigned long long) item->pack_id);
+
+    const char *base = strrchr(item->file_name, '/');
+    base = base ? base + 1 : item->file_name;
+    const char *marker = strstr(base, COMPRESS_SIZE_MARKER);
+    size_t len = marker ? marker - base : strlen(base) - strlen(MAIL_FILE_SUFFIX);
+    if (len > MAIL_UID_MAX)
+        len = MAIL_UID_MAX;
+    // Ids may only contain printable characters other than space
+    for (size_t i = 0; i < len; i++)
+        buf[i] = base[i] > ' ' && base[i] < 0x7f ? base[i] : '_';
+    return len;
 }
 
 /** Marks a message for deletion in the internal email list. Does not
@@ -360,11 +1448,57 @@ int mail_list_undelete(mail_list_t list) {
   
     int rv = 0;
   
-    while (list) {
-        rv += list->item.deleted;
-        list->item.deleted = 0;
-        list = list->next;
+    if (!list) return 0;
+    for (size_t i = 0; i < list->count; i++) {
+        rv += list->items[i].deleted;
+        list->items[i].deleted = 0;
     }
   
     return rv;
 }
+
+/** Converts the mailbox of a user from one file per message to a
+ *  packed mailbox (see mailpack.h). Once converted, new messages for
+ *  the user are appended to the pack by save_user_mail.
+ *
+ *  Parameters: username: Name of the user whose mailbox should be
+ *                        converted.
+ *
+ *  Returns: Number of messages converted, or -1 in case of error.
+ */
+int mail_pack_convert(const char *username) {
+    char filename[MAIL_DIR_MAX];
+    if (mail_user_dir(username, filename, sizeof(filename)) >= sizeof(filename))
+        return -1;
+    return pack_convert(filename);
+}
+
+/** Reclaims the space used by deleted messages in the packed mailbox
+ *  of a user. Compaction also happens automatically in the background
+ *  once enough messages are deleted.
+ *
+ *  Parameters: username: Name of the user whose mailbox should be
+ *                        compacted.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int mail_pack_compact(const char *username) {
+    char filename[MAIL_DIR_MAX];
+    if (mail_user_dir(username, filename, sizeof(filename)) >= sizeof(filename))
+        return -1;
+    return pack_compact(filename);
+}
+
+const struct mail_backend mail_backend_dir = {
+    .name = "dir",
+    .init = NULL,
+    .load = dir_load,
+    .commit = dir_commit,
+    .contents = dir_contents,
+    .prefetch = dir_prefetch,
+    .id = dir_id,
+    .uid = dir_uid,
+    .deliver = dir_deliver,
+    .users = dir_users,
+    .check = dir_check,
+};
@@ -11,24 +11,69 @@
 #define _MAILUSER_H_
 
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "arena.h"
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
+// Longest unique id allowed by RFC 1939 for UIDL
+#define MAIL_UID_MAX 70
 
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
+typedef struct mail_delivery *mail_delivery_t;
+typedef struct mail_message *mail_message_t;
+
+// Identifies the stored contents of a message. Messages with the same
+// id have the same contents, even if they are in different mailboxes
+// (e.g., hard links of the same delivered message).
+struct mail_item_id {
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;
+    uint64_t        offset;
+    uint64_t        generation;     // of the pack (see mailpack.h), or 0
+};
+
+// Compression level for newly saved messages (0 saves them
+// uncompressed). Reading compressed messages is always transparent.
+extern int  mail_compress_level;
 
 int 	    is_valid_user(const char *username, const char *password);
+int         mail_users_reload(void);
 
 user_list_t user_list_create(void);
 void	    user_list_add(user_list_t *list, const char *username);
 void 	    user_list_destroy(user_list_t list);
 int 	    user_list_len(user_list_t list);
+const char *user_list_name(user_list_t list);
+user_list_t user_list_next(user_list_t list);
 
 void 	    save_user_mail(const char *basefile, user_list_t users);
 
+mail_delivery_t mail_delivery_create(void);
+int             mail_delivery_save(mail_delivery_t delivery, const char *basefile, user_list_t users);
+int             mail_delivery_link(mail_delivery_t delivery, mail_message_t msg, user_list_t users);
+int             mail_delivery_sync(mail_delivery_t delivery);
+
+mail_message_t  mail_message_create(const char *basefile);
+int             mail_message_sync(mail_message_t msg, int wait);
+void            mail_message_destroy(mail_message_t msg);
+void            mail_delivery_destroy(mail_delivery_t delivery);
+
+user_list_t mail_store_users(void);
+size_t      mail_user_dir(const char *username, char *buf, size_t size);
+int         mail_store_shard(int levels);
+int         mail_store_check(void);
+int         mail_backend_select(const char *name);
+int         mail_user_warm(const char *username, size_t *bytes);
+
 mail_list_t load_user_mail(const char *username);
+mail_list_t load_user_mail_arena(arena_t arena, const char *username);
 int         mail_list_destroy(mail_list_t list);
 int         mail_list_length(mail_list_t list, int includedeleted);
 mail_item_t mail_list_retrieve(mail_list_t list, unsigned int pos);
@@ -37,6 +82,13 @@ int         mail_list_undelete(mail_list_t list);
 
 size_t      mail_item_size(mail_item_t item);
 FILE       *mail_item_contents(mail_item_t item);
+int         mail_item_prefetch(mail_item_t item);
+FILE       *mail_item_contents_fd(mail_item_t item, int fd);
+int         mail_item_id(mail_item_t item, struct mail_item_id *id);
+size_t      mail_item_uid(mail_item_t item, char *buf);
 void        mail_item_delete(mail_item_t item);
 
+int         mail_pack_convert(const char *username);
+int         mail_pack_compact(const char *username);
+
 #endif
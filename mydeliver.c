@@ -0,0 +1,445 @@
+/* mydeliver.c
+ * Batch local delivery into the mail storage used by mypopd.
+ *
+ * Usage: mydeliver [-z level] [-j threads] [-b batch] [-r user]... [mbox...]
+ *
+ * Reads messages from the given mbox files, or from standard input.
+ * If the input does not start with a "From " line, it is taken as a
+ * single message. Each message is delivered to the users given with
+ * -r or, if there are none, to the users listed in the message's
+ * Envelope-to header fields. Recipients not in users.txt are skipped.
+ *
+ * Each message is written once to a temporary file in the current
+ * directory (which must be on the same file system as mail.store),
+ * and hard linked into every recipient's mailbox by a pool of threads.
+ * Users are split between the threads by a hash of their name, so a
+ * mailbox is only ever written by one thread. Messages are delivered
+ * in batches: the contents of a batch are written to disk together,
+ * and each thread then syncs every directory it changed once per
+ * batch, instead of once per message.
+ *
+ *   -z level    save messages compressed with the given level
+ *   -j threads  number of delivery threads (default: number of CPUs)
+ *   -b batch    messages per batch (default 256)
+ *   -r user     deliver every message to user
+ */
+
+#define _GNU_SOURCE
+#include "mailuser.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define MAX_THREADS 64
+#define DEFAULT_BATCH 256
+#define TEMP_FILE_PATTERN "mydeliver.tmp.XXXXXX"
+
+struct message {
+    char file[sizeof(TEMP_FILE_PATTERN)];
+    mail_message_t msg;
+    user_list_t rcpts[MAX_THREADS];     // recipients handled by each thread
+};
+
+struct batch {
+    struct message *messages;
+    int count;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    mail_delivery_t delivery;
+    unsigned long delivered;    // recipients
+    unsigned long failed;
+    unsigned long sync_errors;
+};
+
+// Input being read, one line ahead
+struct input {
+    FILE *file;
+    char *line;
+    size_t cap;
+    ssize_t len;        // length of line, or -1 at the end of the input
+    int mbox;           // the input is an mbox, not a single message
+};
+
+static int nthreads;
+static struct worker workers[MAX_THREADS];
+static user_list_t fixed_rcpts;
+static unsigned long messages_read, messages_failed, rcpts_unknown, inputs_failed;
+
+// Batch handed to the threads; protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static struct batch *current;
+static unsigned long generation;
+static int pending;
+static int stopping;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Invalid arguments. Expected: %s [-z level] [-j threads] "
+            "[-b batch] [-r user]... [mbox...]\n", prog);
+}
+
+/** Internal function that returns the thread that delivers to a user.
+ *  User names are not case sensitive, so the hash ignores case.
+ */
+static int user_thread(const char *user) {
+    unsigned h = 2166136261u;
+    for (; *user; user++)
+        h = (h ^ (unsigned char) tolower((unsigned char) *user)) * 16777619u;
+    return h % nthreads;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (generation == seen && !stopping)
+            pthread_cond_wait(&start, &lock);
+        if (generation == seen)
+            break;
+        seen = generation;
+        struct batch *batch = current;
+        pthread_mutex_unlock(&lock);
+
+        for (int i = 0; i < batch->count; i++) {
+            user_list_t rcpts = batch->messages[i].rcpts[w->index];
+            if (!rcpts) continue;
+            int errors = mail_delivery_link(w->delivery, batch->messages[i].msg, rcpts);
+            w->failed += errors;
+            w->delivered += user_list_len(rcpts) - errors;
+        }
+        if (mail_delivery_sync(w->delivery) < 0)
+            w->sync_errors++;
+
+        pthread_mutex_lock(&lock);
+        if (--pending == 0)
+            pthread_cond_signal(&finished);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/** Internal function that waits until the threads are done with the
+ *  batch they were given, if any.
+ */
+static void wait_batch(void) {
+    pthread_mutex_lock(&lock);
+    while (pending)
+        pthread_cond_wait(&finished, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+/** Internal function that writes the messages of a batch to disk and
+ *  hands the batch to the threads. Writing is started for every
+ *  message before waiting for any of them.
+ */
+static void dispatch_batch(struct batch *batch) {
+    for (int i = 0; i < batch->count; i++)
+        mail_message_sync(batch->messages[i].msg, 0);
+    for (int i = 0; i < batch->count; i++) {
+        if (mail_message_sync(batch->messages[i].msg, 1) < 0)
+            dlog("Could not sync %s\n", batch->messages[i].file);
+    }
+
+    pthread_mutex_lock(&lock);
+    current = batch;
+    generation++;
+    pending = nthreads;
+    pthread_cond_broadcast(&start);
+    pthread_mutex_unlock(&lock);
+}
+
+/** Internal function that frees the messages of a batch the threads
+ *  are done with.
+ */
+static void release_batch(struct batch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        struct message *m = &batch->messages[i];
+        mail_message_destroy(m->msg);
+        unlink(m->file);
+        for (int t = 0; t < nthreads; t++) {
+            user_list_destroy(m->rcpts[t]);
+            m->rcpts[t] = NULL;
+        }
+    }
+    batch->count = 0;
+}
+
+/** Internal function that adds the valid recipients in a list of
+ *  addresses (separated by commas or spaces, optionally in angle
+ *  brackets) to the lists of the threads that deliver to them.
+ */
+static void add_recipients(struct message *m, char *addresses) {
+    char *saveptr;
+    for (char *addr = strtok_r(addresses, ", \t\r\n", &saveptr); addr;
+         addr = strtok_r(NULL, ", \t\r\n", &saveptr)) {
+        if (*addr == '<') addr++;
+        size_t len = strlen(addr);
+        if (len && addr[len - 1] == '>') addr[--len] = 0;
+        if (!len) continue;
+        if (!is_valid_user(addr, NULL)) {
+            dlog("Unknown recipient %s\n", addr);
+            rcpts_unknown++;
+            continue;
+        }
+        user_list_add(&m->rcpts[user_thread(addr)], addr);
+    }
+}
+
+static void input_open(struct input *in, FILE *file) {
+    in->file = file;
+    in->line = NULL;
+    in->cap = 0;
+    in->len = getline(&in->line, &in->cap, file);
+    in->mbox = in->len >= 5 && !strncmp(in->line, "From ", 5);
+}
+
+static void input_close(struct input *in) {
+    free(in->line);
+    if (in->file != stdin)
+        fclose(in->file);
+}
+
+static int is_blank(const char *line) {
+    return !strcmp(line, "\n") || !strcmp(line, "\r\n");
+}
+
+/** Internal function that reads the next message of the input into a
+ *  new temporary file and finds its recipients.
+ *
+ *  Returns: 1 if a message was read, 0 at the end of the input, -1 if
+ *           the message could not be saved (it is skipped).
+ */
+static int read_message(struct input *in, struct message *m) {
+    if (in->len < 0)
+        return 0;
+    // The "From " line separates messages; it is not part of them
+    if (in->mbox)
+        in->len = getline(&in->line, &in->cap, in->file);
+
+    strcpy(m->file, TEMP_FILE_PATTERN);
+    int fd = mkstemp(m->file);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!out && fd >= 0) close(fd);
+
+    int header = 1, envelope = 0;
+    const char *held = NULL;
+    for (; in->len >= 0; in->len = getline(&in->line, &in->cap, in->file)) {
+        char *line = in->line;
+        size_t len = in->len;
+        if (in->mbox && !strncmp(line, "From ", 5))
+            break;
+
+        if (header && is_blank(line)) {
+            header = 0;
+        } else if (header && !fixed_rcpts) {
+            if (!strncasecmp(line, "Envelope-to:", 12)) {
+                envelope = 1;
+                char *copy = strdup(line + 12);
+                if (copy) add_recipients(m, copy);
+                free(copy);
+            } else if (envelope && (line[0] == ' ' || line[0] == '\t')) {
+                char *copy = strdup(line);
+                if (copy) add_recipients(m, copy);
+                free(copy);
+            } else {
+                envelope = 0;
+            }
+        }
+
+        if (!out)
+            continue;
+        // In an mbox, the blank line before a "From " line belongs to
+        // the separator, and ">From " lines were quoted (mboxrd)
+        if (in->mbox) {
+            if (held) fputs(held, out);
+            held = NULL;
+            if (is_blank(line)) {
+                held = line[0] == '\r' ? "\r\n" : "\n";
+                continue;
+            }
+            if (line[0] == '>' && !strncmp(line + strspn(line, ">"), "From ", 5)) {
+                line++;
+                len--;
+            }
+        }
+        fwrite(line, 1, len, out);
+    }
+
+    messages_read++;
+    if (!out || fclose(out) != 0) {
+        dlog("Could not save message %lu\n", messages_read);
+        unlink(m->file);
+        goto failed;
+    }
+
+    if (fixed_rcpts) {
+        for (user_list_t u = fixed_rcpts; u; u = user_list_next(u))
+            user_list_add(&m->rcpts[user_thread(user_list_name(u))], user_list_name(u));
+    }
+    int have_rcpts = 0;
+    for (int t = 0; t < nthreads; t++)
+        have_rcpts |= m->rcpts[t] != NULL;
+    if (!have_rcpts) {
+        dlog("Message %lu has no valid recipients\n", messages_read);
+        unlink(m->file);
+        goto failed;
+    }
+
+    m->msg = mail_message_create(m->file);
+    if (m->msg)
+        return 1;
+    unlink(m->file);
+
+failed:
+    messages_failed++;
+    for (int t = 0; t < nthreads; t++) {
+        user_list_destroy(m->rcpts[t]);
+        m->rcpts[t] = NULL;
+    }
+    return -1;
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int batch_size = DEFAULT_BATCH;
+    int opt;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "z:j:b:r:")) != -1) {
+        switch (opt) {
+        case 'z':
+            mail_compress_level = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        case 'r':
+            if (!is_valid_user(optarg, NULL)) {
+                fprintf(stderr, "Unknown recipient %s\n", optarg);
+                return 1;
+            }
+            user_list_add(&fixed_rcpts, optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    if (batch_size < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Each thread keeps up to a thousand mailbox directories open
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].index = t;
+        workers[t].delivery = mail_delivery_create();
+        if (!workers[t].delivery ||
+            pthread_create(&workers[t].thread, NULL, worker_thread, &workers[t]) != 0) {
+            fprintf(stderr, "Could not start delivery threads\n");
+            return 1;
+        }
+    }
+
+    // One batch is filled while the threads deliver the other
+    struct batch batches[2];
+    for (int b = 0; b < 2; b++) {
+        batches[b].messages = calloc(batch_size, sizeof(struct message));
+        batches[b].count = 0;
+        if (!batches[b].messages) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    struct batch *filling = &batches[0];
+
+    struct timespec wall;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    int arg = optind;
+    do {
+        struct input in;
+        FILE *file = arg < argc ? fopen(argv[arg], "r") : stdin;
+        if (!file) {
+            fprintf(stderr, "Could not open %s\n", argv[arg]);
+            inputs_failed++;
+            continue;
+        }
+        input_open(&in, file);
+        int rv;
+        while ((rv = read_message(&in, &filling->messages[filling->count])) != 0) {
+            if (rv > 0 && ++filling->count == batch_size) {
+                wait_batch();
+                struct batch *other = filling == &batches[0] ? &batches[1] : &batches[0];
+                release_batch(other);
+                dispatch_batch(filling);
+                filling = other;
+            }
+        }
+        input_close(&in);
+    } while (++arg < argc);
+
+    wait_batch();
+    struct batch *other = filling == &batches[0] ? &batches[1] : &batches[0];
+    release_batch(other);
+    if (filling->count) {
+        dispatch_batch(filling);
+        wait_batch();
+        release_batch(filling);
+    }
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&start);
+    pthread_mutex_unlock(&lock);
+    unsigned long delivered = 0, failed = 0, sync_errors = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        mail_delivery_destroy(workers[t].delivery);
+        delivered += workers[t].delivered;
+        failed += workers[t].failed;
+        sync_errors += workers[t].sync_errors;
+    }
+    double wall_s = elapsed(&wall);
+    if (wall_s <= 0) wall_s = 1e-9;
+
+    unsigned long messages = messages_read - messages_failed;
+    printf("%lu messages, %lu recipients delivered in %.3f s: %.0f messages/s, %.0f recipients/s\n",
+           messages, delivered, wall_s, messages / wall_s, delivered / wall_s);
+    if (messages_failed || failed || rcpts_unknown || sync_errors)
+        printf("%lu messages skipped, %lu deliveries failed, %lu unknown recipients, %lu sync errors\n",
+               messages_failed, failed, rcpts_unknown, sync_errors);
+    free(batches[0].messages);
+    free(batches[1].messages);
+    user_list_destroy(fixed_rcpts);
+    return inputs_failed || messages_failed || failed || sync_errors ? 1 : 0;
+}
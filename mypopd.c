@@ -1,15 +1,38 @@
 #include "netbuffer.h"
 #include "mailuser.h"
+#include "mailcache.h"
+#include "prefetch.h"
+#include "wireformat.h"
+#include "reaper.h"
+#include "warmup.h"
+#include "trace.h"
+#include "capture.h"
+#include "tls.h"
+#include "admin.h"
 #include "server.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <ctype.h>
 
 #define MAX_LINE_LENGTH 1024
+// Longest command (TOP msg n) plus the terminating NULL pointer
+#define MAX_WORDS 4
+#define RETR_CHUNK_SIZE (64 * 1024)
+// Segments sent per writev when a message is streamed (IOV_MAX on Linux)
+#define RETR_MAX_IOV 1024
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_PREFETCH_MB 32
+// RFC 1939 requires the autologout timer to be at least 10 minutes
+#define DEFAULT_IDLE_TIMEOUT 600
+// Clients that read nothing of a response for this long, or that read
+// it slower than this many bytes per second, are disconnected
+#define DEFAULT_WRITE_TIMEOUT 60
+#define DEFAULT_MIN_WRITE_RATE 1024
 
 typedef enum state {
     Undefined,
@@ -18,29 +41,187 @@ typedef enum state {
     Update
 } State;
 
+// Multi-line LIST or UIDL response, rendered on first use and kept
+// until DELE or RSET changes the maildrop. The buffer is allocated
+// from the session arena and reused when the listing is rendered again.
+struct listing {
+    char *data;
+    size_t len;
+    size_t cap;
+    int valid;
+};
+
 typedef struct serverstate {
     int fd;
+    arena_t arena;     // Memory released when the session ends
     net_buffer_t nb;
     char recvbuf[MAX_LINE_LENGTH + 1];
-    char *words[MAX_LINE_LENGTH];
+    char *words[MAX_WORDS];
     int nwords;
     State state;
-    struct utsname my_uname;
     // TODO: Add additional fields as necessary
-    char current_user[MAX_USERNAME_SIZE];  // Add this field to store the username
+    char *current_user;        // Username from USER, allocated from the arena
+    size_t current_user_size;
+    mail_list_t mail;  // Maildrop, loaded once the user is authenticated
+    struct listing list;
+    struct listing uidl;
+    prefetch_t prefetch;       // Read-ahead state, created by the first RETR
+    struct idle_timer idle;
+    struct admin_session admin; // Entry in the session registry
+    struct send_guard guard;    // Limits for clients that read slowly
 
 } serverstate;
 
-static void handle_client(void *new_fd);
+// Idle timeouts, in seconds, for the AUTHORIZATION and TRANSACTION states
+static int auth_timeout = DEFAULT_IDLE_TIMEOUT;
+static int transaction_timeout = DEFAULT_IDLE_TIMEOUT;
+static int write_timeout = DEFAULT_WRITE_TIMEOUT;
+static size_t min_write_rate = DEFAULT_MIN_WRITE_RATE;
+// Sent to every client, built once at startup from the host name
+static char greeting[128];
+
+static void handle_client(void *arg);
 // Function to handle incoming commands
 int handle_command(serverstate *ss, const char *command);
+static const char *command_name(const char *command);
+static const char *const state_names[] = {
+    "UNDEFINED", "AUTHORIZATION", "TRANSACTION", "UPDATE",
+};
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+    size_t cache_mb = DEFAULT_CACHE_MB;
+    size_t prefetch_mb = DEFAULT_PREFETCH_MB;
+    const char *certfile = NULL, *keyfile = NULL;
+    int warmup_threads = 0;
+    const char *trace_path = NULL;
+    double trace_rate = 1;
+    const char *capture_dir = NULL;
+    const char *admin_path = NULL;
+    const char *backend = "dir";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:p:a:t:c:k:u:d:s:r:w:A:W:NT:F:C:S:o:b:P:L:M:")) != -1) {
+        switch (opt) {
+        case 'm':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            prefetch_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            auth_timeout = atoi(optarg);
+            break;
+        case 't':
+            transaction_timeout = atoi(optarg);
+            break;
+        case 'c':
+            certfile = optarg;
+            break;
+        case 'k':
+            keyfile = optarg;
+            break;
+        case 'u':
+            server_options.upgrade_path = optarg;
+            break;
+        case 'd':
+            server_options.drain_timeout = atoi(optarg);
+            break;
+        case 's':
+            server_options.stack_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'r':
+            server_options.report_interval = atoi(optarg);
+            break;
+        case 'w':
+            warmup_threads = atoi(optarg);
+            break;
+        case 'A':
+            server_options.acceptor_cpus = optarg;
+            break;
+        case 'W':
+            server_options.worker_cpus = optarg;
+            break;
+        case 'N':
+            server_options.numa_placement = 1;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'F':
+            trace_rate = atof(optarg);
+            break;
+        case 'C':
+            capture_dir = optarg;
+            break;
+        case 'S':
+            admin_path = optarg;
+            break;
+        case 'o':
+            write_timeout = atoi(optarg);
+            break;
+        case 'b':
+            min_write_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            server_options.probe_port = optarg;
+            break;
+        case 'L':
+            server_options.busy_sessions = atoi(optarg);
+            break;
+        case 'M':
+            backend = optarg;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Invalid arguments. Expected: %s [-m cache_mb] "
+                "[-p prefetch_mb] [-a auth_timeout] [-t transaction_timeout] "
+                "[-o write_timeout] [-b min_write_rate] "
+                "[-c tls_cert.pem -k tls_key.pem] [-u upgrade_socket] "
+                "[-d drain_timeout] [-s stack_kb] [-r report_interval] "
+                "[-w warmup_threads] [-A acceptor_cpus] [-W worker_cpus] [-N] "
+                "[-T trace.json [-F trace_fraction]] [-C capture_dir] "
+                "[-S admin_socket] [-P probe_port [-L busy_sessions]] [-M dir|memory] <port>\n", argv[0]);
+        return 1;
+    }
+    if (certfile && tls_init(certfile, keyfile ? keyfile : certfile) < 0) {
+        fprintf(stderr, "Could not set up TLS with %s\n", certfile);
+        return 1;
+    }
+    if (trace_path && trace_init(trace_path, trace_rate) < 0) {
+        fprintf(stderr, "Could not create trace file %s\n", trace_path);
+        return 1;
+    }
+    if (capture_dir && capture_init(capture_dir) < 0) {
+        fprintf(stderr, "Could not write captures to %s\n", capture_dir);
+        return 1;
+    }
+    if (admin_path && admin_start(admin_path) < 0) {
+        fprintf(stderr, "Could not create admin socket %s\n", admin_path);
         return 1;
     }
-    run_server(argv[1], handle_client);
+    // The memory backend loads the whole store here
+    if (mail_backend_select(backend) < 0) {
+        fprintf(stderr, "Could not set up mail store backend %s\n", backend);
+        return 1;
+    }
+    struct utsname my_uname;
+    uname(&my_uname);
+    snprintf(greeting, sizeof(greeting), "+OK POP3 Server on %s ready\r\n", my_uname.nodename);
+    mail_cache_init(cache_mb * 1024 * 1024);
+    if (reaper_start() < 0) {
+        fprintf(stderr, "Could not start idle session reaper\n");
+        return 1;
+    }
+    if (prefetch_init(prefetch_mb * 1024 * 1024) < 0)
+        fprintf(stderr, "Could not start message read-ahead\n");
+    // The server accepts connections while maildrops are warmed up
+    if (warmup_threads > 0 && warmup_start(warmup_threads) < 0)
+        fprintf(stderr, "Could not start maildrop warm-up\n");
+    server_options.ready_check = mail_store_check;
+    run_server(argv[optind], handle_client);
     return 0;
 }
 
@@ -95,9 +276,26 @@ int do_user(serverstate *ss, const char *username) {
         return 1; // Indicate failure
     }
     // Validate the username using the is_valid_user function
-    if (is_valid_user(username, NULL)) {
+    uint64_t start = trace_start();
+    int valid = is_valid_user(username, NULL);
+    trace_event("is_valid_user", "auth", start);
+    if (valid) {
         // Store the username in the server state (for later use in PASS command)
-        strncpy(ss->current_user, username, sizeof(ss->current_user) - 1);
+        size_t len = strlen(username) + 1;
+        if (len > ss->current_user_size) {
+            // Grow geometrically, so repeated USER commands can only
+            // take a bounded amount of memory from the arena
+            size_t size = len > 2 * ss->current_user_size ? len : 2 * ss->current_user_size;
+            char *user = arena_alloc(ss->arena, size);
+            if (!user) {
+                send_formatted(ss->fd, "-ERR Server out of memory\r\n");
+                return 1;
+            }
+            ss->current_user = user;
+            ss->current_user_size = size;
+        }
+        memcpy(ss->current_user, username, len);
+        admin_set_user(&ss->admin, username);
         return send_formatted(ss->fd, "+OK User accepted, proceed with PASS\r\n") <= 0 ? 1 : 0;
     } else {
         // Respond with an error if the user is not found
@@ -115,14 +313,20 @@ int do_pass(serverstate *ss, const char *password) {
     if (ss->state != Authorization) {
         return send_formatted(ss->fd, "-ERR Command PASS only allowed in AUTHORIZATION state\r\n") <= 0 ? 1 : 1;
     }
-    if (ss->current_user[0] == '\0') {  // Check if current_user is not set
+    if (!ss->current_user) {  // Check if current_user is not set
         return send_formatted(ss->fd, "-ERR No user set\r\n") <= 0 ? 1 : 1;
     }
     if (password == NULL) {
         return send_formatted(ss->fd, "-ERR Missing password\r\n") <= 0 ? 1 : 1;
     }
-    if (is_valid_user(ss->current_user, password)) {
+    uint64_t start = trace_start();
+    int valid = is_valid_user(ss->current_user, password);
+    trace_event("is_valid_user", "auth", start);
+    if (valid) {
         ss->state = Transaction;
+        start = trace_start();
+        ss->mail = load_user_mail_arena(ss->arena, ss->current_user);
+        trace_event("load_user_mail", "storage", start);
         return send_formatted(ss->fd, "+OK User authenticated, proceed\r\n") <= 0 ? 1 : 0;
     } else {
         return send_formatted(ss->fd, "-ERR Invalid password\r\n") <= 0 ? 1 : 1;
@@ -139,7 +343,7 @@ int do_stat(serverstate *ss){
     if(ss->state!=Transaction){
         return send_formatted(ss->fd,"-ERR STAT command only allowed in TRANSACTION state\r\n")<=0?1:1;
     }
-    mail_list_t mail_list=load_user_mail(ss->current_user);
+    mail_list_t mail_list=ss->mail;
     if(!mail_list){
         // return send_formatted(ss->fd,"-ERR Could not retrieve maildrop\r\n")<=0?1:1;
         return send_formatted(ss->fd,"+OK 0 0\r\n")<=0?1:0;  // Return +OK even if the maildrop is empty
@@ -151,22 +355,272 @@ int do_stat(serverstate *ss){
 }
 
 
+// Renders the multi-line LIST (or UIDL) response for the maildrop in
+// one pass, with each line built in place. Returns 0 on success, -1 if
+// no memory is available.
+static int render_listing(serverstate *ss, struct listing *listing, int uidl) {
+    int count = mail_list_length(ss->mail, 1);
+    // Longest line: message number, space, size or id, CRLF
+    size_t need = 64 + (size_t) count * (11 + (uidl ? MAIL_UID_MAX + 1 : 21) + 2);
+    if (listing->cap < need) {
+        size_t cap = listing->cap ? 2 * listing->cap : 1024;
+        if (cap < need) cap = need;
+        char *data = arena_realloc(ss->arena, listing->data, listing->cap, cap);
+        if (!data) return -1;
+        listing->data = data;
+        listing->cap = cap;
+    }
+
+    char *out = listing->data;
+    if (uidl)
+        out += sprintf(out, "+OK Unique-id listing follows\r\n");
+    else
+        out += sprintf(out, "+OK %d messages\r\n", mail_list_length(ss->mail, 0));
+    for (int pos = 0; pos < count; pos++) {
+        mail_item_t item = mail_list_retrieve(ss->mail, pos);
+        if (!item) continue;
+        out += format_uint(out, pos + 1);
+        *out++ = ' ';
+        out += uidl ? mail_item_uid(item, out) : format_uint(out, mail_item_size(item));
+        *out++ = '\r';
+        *out++ = '\n';
+    }
+    memcpy(out, ".\r\n", 3);
+    listing->len = out + 3 - listing->data;
+    listing->valid = 1;
+    return 0;
+}
+
+// Handles LIST and UIDL: with a message number, a single-line response
+// for that message; otherwise, the (cached) listing of all messages.
+static int do_listing(serverstate *ss, struct listing *listing, int uidl) {
+    int rv = checkstate(ss, Transaction);
+    if (rv) return rv;
+
+    if (ss->nwords >= 2 && ss->words[1]) {
+        int msg_num = atoi(ss->words[1]);
+        mail_item_t item = msg_num > 0 ? mail_list_retrieve(ss->mail, msg_num - 1) : NULL;
+        if (!item)
+            return send_formatted(ss->fd, "-ERR No such message\r\n") <= 0 ? -1 : 1;
+        if (!uidl)
+            return send_formatted(ss->fd, "+OK %d %zu\r\n", msg_num, mail_item_size(item)) <= 0 ? -1 : 0;
+        char uid[MAIL_UID_MAX + 1];
+        int len = mail_item_uid(item, uid);
+        return send_formatted(ss->fd, "+OK %d %.*s\r\n", msg_num, len, uid) <= 0 ? -1 : 0;
+    }
+
+    if (!listing->valid && render_listing(ss, listing, uidl) < 0)
+        return send_formatted(ss->fd, "-ERR Server out of memory\r\n") <= 0 ? -1 : 1;
+    return send_all(ss->fd, listing->data, listing->len) < 0 ? -1 : 0;
+}
+
 int do_list(serverstate *ss) {
     dlog("Executing list\n");
-    // TODO: Implement this function
-    return 0;
+    return do_listing(ss, &ss->list, 0);
+}
+
+int do_uidl(serverstate *ss) {
+    dlog("Executing uidl\n");
+    return do_listing(ss, &ss->uidl, 1);
+}
+
+// Reads a message and converts it to the format used in a multi-line
+// response, including the terminating ".\r\n". The message is read
+// from msg_fd if it was read ahead (-1 otherwise), which is closed.
+// Returns a malloc'ed buffer, or NULL if the message could not be read.
+static char *read_wire_message(mail_item_t item, int msg_fd, size_t *size) {
+    // Session threads may run on small stacks, so the chunk is not
+    // kept on the stack
+    struct wire_state state;
+    char *chunk = malloc(RETR_CHUNK_SIZE);
+    FILE *file = chunk ? mail_item_contents_fd(item, msg_fd) : NULL;
+    if (!file) {
+        if (!chunk && msg_fd >= 0) close(msg_fd);
+        free(chunk);
+        return NULL;
+    }
+
+    size_t cap = mail_item_size(item) + mail_item_size(item) / 8 + 64;
+    size_t len = 0, rv;
+    char *buf = malloc(cap);
+    wire_init(&state);
+    while (buf && (rv = fread(chunk, 1, RETR_CHUNK_SIZE, file)) > 0) {
+        if (cap - len < WIRE_ENCODED_MAX(rv)) {
+            cap = 2 * cap + WIRE_ENCODED_MAX(rv);
+            buf = realloc(buf, cap);
+            if (!buf) break;
+        }
+        len += wire_encode(&state, chunk, rv, buf + len);
+    }
+    if (buf && !ferror(file)) {
+        if (cap - len < WIRE_ENCODED_MAX(0))
+            buf = realloc(buf, len + WIRE_ENCODED_MAX(0));
+        if (buf)
+            len += wire_finish(&state, buf + len);
+    } else {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(file);
+    free(chunk);
+    *size = len;
+    return buf;
+}
+
+static const char retr_status[] = "+OK Message follows\r\n";
+
+// Sends a message that is not cached without copying it: the message
+// is read in chunks, and the converted chunks are sent with writev as
+// segments pointing into the chunk. The status line is sent with the
+// first segments. The message is read from msg_fd as in
+// read_wire_message. Returns 0 on success, 1 if the message could not
+// be read (before anything was sent), or -1 if the session must end.
+static int send_wire_message(int fd, mail_item_t item, int msg_fd) {
+    struct wire_state state;
+    char *chunk = malloc(RETR_CHUNK_SIZE);
+    struct iovec *iov = malloc(RETR_MAX_IOV * sizeof(struct iovec));
+    FILE *file = chunk && iov ? mail_item_contents_fd(item, msg_fd) : NULL;
+    if (!file) {
+        if ((!chunk || !iov) && msg_fd >= 0) close(msg_fd);
+        free(chunk);
+        free(iov);
+        return send_formatted(fd, "-ERR Could not read message\r\n") <= 0 ? -1 : 1;
+    }
+
+    // The last entry is kept for the end of the message
+    const size_t max_iov = RETR_MAX_IOV - 1;
+    int sent = 0, rv = 0;
+    size_t n = 0, len;
+    char end[WIRE_ENCODED_MAX(0)];
+    iov[n].iov_base = (void *) retr_status;
+    iov[n++].iov_len = sizeof(retr_status) - 1;
+    wire_init(&state);
+    while (rv == 0 && (len = fread(chunk, 1, RETR_CHUNK_SIZE, file)) > 0) {
+        for (size_t pos = 0, used; pos < len && rv == 0; pos += used) {
+            if (max_iov - n < WIRE_MIN_IOV) {
+                rv = send_all_iov(fd, iov, n) < 0 ? -1 : 0;
+                sent = 1;
+                n = 0;
+            }
+            n += wire_encode_iov(&state, chunk + pos, len - pos, iov + n, max_iov - n, &used);
+        }
+        // The segments point into the chunk, which is about to be reused
+        if (rv == 0 && len == RETR_CHUNK_SIZE) {
+            rv = send_all_iov(fd, iov, n) < 0 ? -1 : 0;
+            sent = 1;
+            n = 0;
+        }
+    }
+    if (rv == 0 && ferror(file)) {
+        rv = sent ? -1 : send_formatted(fd, "-ERR Could not read message\r\n") <= 0 ? -1 : 1;
+    } else if (rv == 0) {
+        iov[n].iov_base = end;
+        iov[n++].iov_len = wire_finish(&state, end);
+        rv = send_all_iov(fd, iov, n) < 0 ? -1 : 0;
+    }
+    fclose(file);
+    free(chunk);
+    free(iov);
+    return rv;
 }
 
 int do_retr(serverstate *ss) {
     dlog("Executing retr\n");
-    // TODO: Implement this function
-    return 0;
+    if (ss->state != Transaction) {
+        return send_formatted(ss->fd, "-ERR Command RETR only allowed in TRANSACTION state\r\n") <= 0 ? 1 : 1;
+    }
+    if (ss->nwords < 2 || !ss->words[1]) {
+        return send_formatted(ss->fd, "-ERR No message number specified\r\n") <= 0 ? 1 : 1;
+    }
+    int msg_num = atoi(ss->words[1]);
+    mail_item_t item = msg_num > 0 ? mail_list_retrieve(ss->mail, msg_num - 1) : NULL;
+    if (item == NULL) {
+        return send_formatted(ss->fd, "-ERR No such message\r\n") <= 0 ? 1 : 1;
+    }
+
+    // Clients that download the whole maildrop retrieve the messages in
+    // order, so the next messages are read ahead while this one is sent
+    if (!ss->prefetch)
+        ss->prefetch = prefetch_create(ss->arena);
+    int msg_fd = prefetch_take(ss->prefetch, msg_num - 1);
+    prefetch_access(ss->prefetch, ss->mail, msg_num - 1);
+
+    // Messages are served from the shared cache when possible, so a
+    // message delivered to many users is only read and converted once.
+    // Messages the cache would not take are streamed instead.
+    struct mail_item_id id;
+    int have_id = mail_item_id(item, &id) == 0;
+    mail_cache_entry_t entry = have_id ? mail_cache_lookup(&id) : NULL;
+    char *buf = NULL;
+    const char *data;
+    size_t size;
+
+    if (!entry && (!have_id || mail_item_size(item) > mail_cache_max_entry())) {
+        uint64_t start = trace_start();
+        int rv = send_wire_message(ss->fd, item, msg_fd);
+        trace_event("send_message", "network", start);
+        return rv;
+    } else if (entry) {
+        if (msg_fd >= 0) close(msg_fd);
+        data = mail_cache_data(entry, &size);
+    } else {
+        uint64_t start = trace_start();
+        buf = read_wire_message(item, msg_fd, &size);
+        trace_event("read_message", "storage", start);
+        if (!buf) {
+            return send_formatted(ss->fd, "-ERR Could not read message\r\n") <= 0 ? 1 : 1;
+        }
+        if (have_id && (entry = mail_cache_insert(&id, buf, size)) != NULL) {
+            buf = NULL;
+            data = mail_cache_data(entry, &size);
+        } else {
+            data = buf;
+        }
+    }
+
+    int rv = 0;
+    uint64_t start = trace_start();
+    struct iovec iov[2] = {
+        { (void *) retr_status, sizeof(retr_status) - 1 },
+        { (void *) data, size },
+    };
+    if (send_all_iov(ss->fd, iov, 2) < 0)
+        rv = 1;
+    trace_event("send_message", "network", start);
+    if (entry) mail_cache_release(entry);
+    free(buf);
+    return rv;
 }
 
 int do_rset(serverstate *ss) {
     dlog("Executing rset\n");
-    // TODO: Implement this function
-    return 0;
+    if (ss->state != Transaction) {
+        return send_formatted(ss->fd, "-ERR Command RSET only allowed in TRANSACTION state\r\n") <= 0 ? 1 : 1;
+    }
+    int restored = mail_list_undelete(ss->mail);
+    ss->list.valid = ss->uidl.valid = 0;
+    return send_formatted(ss->fd, "+OK %d message(s) restored\r\n", restored) <= 0 ? 1 : 0;
+}
+
+int do_capa(serverstate *ss) {
+    dlog("Executing CAPA command\n");
+    return send_formatted(ss->fd, "+OK Capability list follows\r\nUSER\r\nUIDL\r\n%s.\r\n",
+                          tls_available() && !tls_active(ss->fd) ? "STLS\r\n" : "") <= 0 ? 1 : 0;
+}
+
+int do_stls(serverstate *ss) {
+    dlog("Executing STLS command\n");
+    if (ss->state != Authorization || ss->current_user || tls_active(ss->fd)) {
+        return send_formatted(ss->fd, "-ERR Command STLS not allowed now\r\n") <= 0 ? 1 : 1;
+    }
+    if (!tls_available()) {
+        return send_formatted(ss->fd, "-ERR TLS not available\r\n") <= 0 ? 1 : 1;
+    }
+    if (send_formatted(ss->fd, "+OK Begin TLS negotiation\r\n") <= 0) return -1;
+    // Commands pipelined before the handshake must not be processed
+    // as if they had been received over TLS (RFC 2595, section 4)
+    nb_clear(ss->nb);
+    return tls_start(ss->fd) < 0 ? -1 : 0;
 }
 
 int do_noop(serverstate *ss) {
@@ -198,10 +652,7 @@ int do_dele(serverstate *ss){
     if(msg_num<=0){
         return send_formatted(ss->fd,"-ERR Invalid message number\r\n")<=0?1:1;
     }
-    mail_list_t mail_list=load_user_mail(ss->current_user);
-    if(!mail_list){
-        return send_formatted(ss->fd,"-ERR Could not retrieve maildrop\r\n")<=0?1:1;
-    }
+    mail_list_t mail_list=ss->mail;
     mail_item_t item = mail_list_retrieve(mail_list,msg_num-1);
     if(item==NULL){
         return send_formatted(ss->fd,"-ERR No such message\r\n")<=0?1:1;
@@ -210,24 +661,58 @@ int do_dele(serverstate *ss){
     //     return send_formatted(ss->fd,"-ERR Message %d already deleted\r\n",msg_num)<=0?1:1;
     // }
     mail_item_delete(item);
+    ss->list.valid = ss->uidl.valid = 0;
     return send_formatted(ss->fd,"+OK Message %d deleted\r\n",msg_num)<=0?1:0;
 }
 
+/** Extends the idle deadline of a session, after a command and
+ *  whenever a send makes progress (see send_progress): a session that
+ *  sends a long response is not idle. Clients that stop reading are
+ *  left to send_guard.
+ */
+static void session_touch(void *arg) {
+    serverstate *ss = arg;
+    reaper_touch(&ss->idle, ss->state == Transaction ? transaction_timeout : auth_timeout);
+}
 
-void handle_client(void *new_fd) {
-    int fd = *(int *)(new_fd);
+void handle_client(void *arg) {
+    int fd = (int) (intptr_t) arg;
 
-    size_t len;
+    int len;
     serverstate mstate, *ss = &mstate;
 
+    trace_session_begin(fd);
+    uint64_t session_start = trace_start();
     ss->fd = fd;
-    ss->nb = nb_create(fd, MAX_LINE_LENGTH);
+    ss->arena = arena_create();
+    ss->nb = ss->arena ? nb_create_arena(ss->arena, fd, MAX_LINE_LENGTH) : NULL;
+    if (!ss->nb) {
+        send_formatted(fd, "-ERR Server out of memory\r\n");
+        arena_destroy(ss->arena);
+        close(fd);
+        trace_session_end();
+        return;
+    }
     ss->state = Authorization;
-    uname(&ss->my_uname);
+    ss->current_user = NULL;
+    ss->current_user_size = 0;
+    ss->mail = NULL;
+    ss->prefetch = NULL;
+    ss->list = ss->uidl = (struct listing) { 0 };
+    capture_t capture = capture_begin();
+    reaper_register(&ss->idle, fd, auth_timeout);
+    admin_register(&ss->admin, fd, state_names[ss->state]);
+    send_counter = &ss->admin.bytes_sent;
+    send_progress = session_touch;
+    send_progress_arg = ss;
+    ss->guard = (struct send_guard) { .timeout = write_timeout, .min_rate = min_write_rate };
+    send_guard = &ss->guard;
     // TODO: Initialize additional fields in `serverstate`, if any
-    if (send_formatted(fd, "+OK POP3 Server on %s ready\r\n", ss->my_uname.nodename) <= 0) return;
+    uint64_t start = trace_start();
+    int ready = send_all(fd, greeting, strlen(greeting)) > 0;
+    trace_event("greeting", "network", start);
 
-    while ((len = nb_read_line(ss->nb, ss->recvbuf)) >= 0) {
+    while (ready && (len = nb_read_line(ss->nb, ss->recvbuf)) > 0) {
         if (ss->recvbuf[len - 1] != '\n') {
             // command line is too long, stop immediately
             send_formatted(fd, "-ERR Syntax error, command unrecognized\r\n");
@@ -246,13 +731,21 @@ void handle_client(void *new_fd) {
             send_formatted(fd, "-ERR Syntax error, blank command unrecognized\r\n");
             break;
         }
+        capture_command(capture, ss->recvbuf);
         // Split the command into its component "words"
-        ss->nwords = split(ss->recvbuf, ss->words);
+        ss->nwords = split_max(ss->recvbuf, ss->words, MAX_WORDS);
         char *command = ss->words[0];
 
         /* TODO: Handle the different values of `command` and dispatch it to the correct implementation
          *  TOP, UIDL, APOP commands do not need to be implemented and therefore may return an error response */
+        start = trace_start();
+        // Throughput is measured for each response separately
+        ss->guard.window_start = 0;
+        admin_set_command(&ss->admin, command_name(command));
         int response = handle_command(ss, command);
+        admin_set_command(&ss->admin, NULL);
+        admin_set_state(&ss->admin, state_names[ss->state]);
+        trace_event(command_name(command), "command", start);
         if (response == -1) {
             // Server should exit
             dlog("Server should exit. received -1 from handle_command\n");
@@ -266,11 +759,65 @@ void handle_client(void *new_fd) {
             // send_formatted(fd, "+OK Command successful\r\n");
             dlog("Received 0 from handle_command\n");
         }
+        session_touch(ss);
     }
-    // TODO: Clean up fields in `serverstate`, if required
+    // The reaper and the admin socket must not touch the socket once
+    // it is closed
+    reaper_unregister(&ss->idle);
+    admin_unregister(&ss->admin);
+    send_counter = NULL;
+    send_progress = NULL;
+    send_guard = NULL;
+    capture_end(capture);
+    if (ss->idle.expired)
+        dlog("%x: Session timed out\n", fd);
+    // Deletions are only committed if the session reached the UPDATE
+    // state through QUIT
+    if (ss->mail) {
+        // Messages read ahead refer to the maildrop
+        prefetch_end(ss->prefetch);
+        if (ss->state != Update)
+            mail_list_undelete(ss->mail);
+        start = trace_start();
+        if (mail_list_destroy(ss->mail))
+            dlog("%x: Could not delete some messages\n", fd);
+        trace_event("update", "storage", start);
+    }
+    struct mail_cache_stats cstats;
+    mail_cache_get_stats(&cstats);
+    dlog("Message cache: %lu hits, %lu misses, %lu evictions, %zu bytes in %zu messages\n",
+         cstats.hits, cstats.misses, cstats.evictions, cstats.bytes, cstats.entries);
+    struct prefetch_stats pstats;
+    prefetch_get_stats(&pstats);
+    dlog("Read-ahead: %lu issued, %lu hits, %lu waits, %lu unused, %lu denied, %zu bytes\n",
+         pstats.issued, pstats.hits, pstats.waits, pstats.unused, pstats.denied, pstats.bytes);
+    struct send_guard_stats gstats;
+    send_guard_get_stats(&gstats);
+    dlog("Slow readers: %lu sends waited, %lu clients stalled, %lu too slow\n",
+         gstats.waits, gstats.stalled, gstats.slow);
+    struct arena_stats astats;
+    arena_get_stats(&astats);
+    dlog("Session memory: %lu slabs allocated, %lu reused, %lu large allocations\n",
+         astats.slabs_allocated, astats.slabs_reused, astats.large_allocations);
+    // The maildrop is released with the arena
     nb_destroy(ss->nb);
+    arena_destroy(ss->arena);
+    tls_end(fd);
     close(fd);
-    free(new_fd);
+    trace_event("session", "session", session_start);
+    trace_session_end();
+}
+
+// Returns the name of a command as a constant string, for tracing
+static const char *command_name(const char *command) {
+    static const char *const names[] = {
+        "USER", "PASS", "QUIT", "STAT", "LIST", "UIDL", "RETR", "DELE",
+        "RSET", "NOOP", "CAPA", "STLS",
+    };
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (!strcasecmp(command, names[i]))
+            return names[i];
+    return "unknown";
 }
 
 int handle_command(serverstate *ss, const char *command) {
@@ -293,21 +840,27 @@ int handle_command(serverstate *ss, const char *command) {
     }
     // LIST command can be handled in Transaction state
     else if (strcmp(command, "LIST") == 0) {
-        if (checkstate(ss, Transaction)) {
-            // Handle LIST command
-        }
+        return do_list(ss);
+    }
+    // UIDL command can be handled in Transaction state
+    else if (strcasecmp(command, "UIDL") == 0) {
+        return do_uidl(ss);
     }
     // RETR command can be handled in Transaction state
     else if (strcmp(command, "RETR") == 0) {
-        if (checkstate(ss, Transaction)) {
-            // Handle RETR command
-        }
+        return do_retr(ss);
     }
     // RSET command can be handled in Transaction state
     else if (strcmp(command, "RSET") == 0) {
-        if (checkstate(ss, Transaction)) {
-            // Handle RSET command
-        }
+        return do_rset(ss);
+    }
+    // STLS command can be handled in Authorization state, before USER
+    else if (strcasecmp(command, "STLS") == 0) {
+        return do_stls(ss);
+    }
+    // CAPA command can be handled in any state
+    else if (strcasecmp(command, "CAPA") == 0) {
+        return do_capa(ss);
     }
     // NOOP command can be handled in Transaction state
     else if (strcasecmp(command, "NOOP") == 0) {
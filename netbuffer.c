@@ -6,23 +6,108 @@
  */
 
 #include "netbuffer.h"
+#include "tls.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
+// Receive buffers of this size are kept in a shared pool when not in
+// use, so an idle connection does not hold one
+#define NB_POOL_BUFSIZE 1024
+#define NB_POOL_MAX     1024
+
 struct net_buffer {
     int    fd;
     size_t max_bytes;
     size_t avail_data;
-    // Buffer set as size zero, but since it's the last member of the
-    // struct, it is possible to malloc additional memory after this
-    // struct to be used as part of the buffer (e.g., nb->buf[5] will
-    // read from a location 5 bytes ahead of the end of the buffer).
-    char   buf[0];
+    int    in_arena;
+    // Only allocated while there is data in the buffer (or a read is
+    // about to put data in it)
+    char  *buf;
+};
+
+struct pool_buffer {
+    struct pool_buffer *next;
 };
 
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_buffer *pool;
+static int pool_size;
+
+/** Internal function that gives a buffer to nb, from the pool if
+ *  possible.
+ *
+ *  Returns: 0 on success, -1 if no memory is available.
+ */
+static int nb_acquire(net_buffer_t nb) {
+    if (nb->buf) return 0;
+    if (nb->max_bytes == NB_POOL_BUFSIZE) {
+        pthread_mutex_lock(&pool_lock);
+        struct pool_buffer *entry = pool;
+        if (entry) {
+            pool = entry->next;
+            pool_size--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        nb->buf = (char *) entry;
+    }
+    if (!nb->buf)
+        nb->buf = malloc(nb->max_bytes);
+    return nb->buf ? 0 : -1;
+}
+
+/** Internal function that returns the buffer of nb to the pool, once
+ *  all data in it has been consumed.
+ */
+static void nb_release(net_buffer_t nb) {
+    if (!nb->buf || nb->avail_data) return;
+    if (nb->max_bytes == NB_POOL_BUFSIZE) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_size < NB_POOL_MAX) {
+            struct pool_buffer *entry = (struct pool_buffer *) nb->buf;
+            entry->next = pool;
+            pool = entry;
+            pool_size++;
+            nb->buf = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    free(nb->buf);
+    nb->buf = NULL;
+}
+
+/** Internal function that receives more data into the buffer. If the
+ *  buffer is empty, waits for the socket to be readable before taking
+ *  a buffer, so a connection waiting for a command holds no memory
+ *  for it. Non-blocking sockets are waited for until data arrives.
+ *
+ *  Returns: Same as recv.
+ */
+static int nb_fill(net_buffer_t nb) {
+    struct pollfd pfd = { .fd = nb->fd, .events = POLLIN };
+    if (!nb->buf) {
+        while (!tls_pending(nb->fd) && poll(&pfd, 1, -1) < 0)
+            if (errno != EINTR)
+                return -1;
+        if (nb_acquire(nb) < 0)
+            return -1;
+    }
+    int rv;
+    while ((rv = tls_recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0)) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+    }
+    if (rv <= 0)
+        nb_release(nb);
+    return rv;
+}
+
 /** Creates a new buffer for handling data read from a socket.
  *
  *  Note: The maximum buffer size passed as parameter will also
@@ -40,10 +125,35 @@ struct net_buffer {
  */
 net_buffer_t nb_create(int fd, size_t max_buffer_size) {
 
-    net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
+    net_buffer_t nb = malloc(sizeof(struct net_buffer));
     nb->fd          = fd;
     nb->max_bytes   = max_buffer_size;
     nb->avail_data  = 0;
+    nb->in_arena    = 0;
+    nb->buf         = NULL;
+    return nb;
+}
+
+/** Creates a new buffer like nb_create, with memory taken from an
+ *  arena. The buffer is released with the arena, but nb_destroy must
+ *  still be called to release the receive buffer.
+ *
+ *  Parameters: arena: Arena the buffer is allocated from.
+ *              fd: Socket file descriptor.
+ *              max_buffer_size: Maximum number of bytes to be stored
+ *                               locally for a connection.
+ *
+ *  Returns: A net_buffer_t object, or NULL if no memory is available.
+ */
+net_buffer_t nb_create_arena(arena_t arena, int fd, size_t max_buffer_size) {
+
+    net_buffer_t nb = arena_alloc(arena, sizeof(struct net_buffer));
+    if (!nb) return NULL;
+    nb->fd          = fd;
+    nb->max_bytes   = max_buffer_size;
+    nb->avail_data  = 0;
+    nb->in_arena    = 1;
+    nb->buf         = NULL;
     return nb;
 }
 
@@ -52,7 +162,11 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size) {
  *  Parameters: nb: buffer object to be freed.
  */
 void nb_destroy(net_buffer_t nb) {
-    free(nb);
+    if (!nb) return;
+    nb->avail_data = 0;
+    nb_release(nb);
+    if (!nb->in_arena)
+        free(nb);
 }
 
 /** Reads a single line from the socket/buffer (i.e., a string ending
@@ -88,11 +202,11 @@ int nb_read_line(net_buffer_t nb, char out[]) {
     char *eos;
     int rv;
     // Check if the buffer already has a line-feed character.
-    while ((eos = memchr(nb->buf, '\n', nb->avail_data)) == NULL) {
+    while (!nb->buf || (eos = memchr(nb->buf, '\n', nb->avail_data)) == NULL) {
 
         // Check if the buffer has space for more data to be received
         if (nb->avail_data < nb->max_bytes) {
-            rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+            rv = nb_fill(nb);
             // If recv returns an error, return the same error.
             if (rv < 0)
                 return rv;
@@ -100,6 +214,10 @@ int nb_read_line(net_buffer_t nb, char out[]) {
             // If recv returns 0 (i.e., end of data), return whatever is
             // available in the buffer.
             if (rv == 0) {
+                if (!nb->buf) {
+                    out[0] = 0;
+                    return 0;
+                }
                 eos = nb->buf + nb->avail_data - 1;
                 break;
             }
@@ -120,6 +238,8 @@ int nb_read_line(net_buffer_t nb, char out[]) {
     // remaining data to the start of the buffer.
     if (nb->avail_data)
         memmove(nb->buf, eos + 1, nb->avail_data);
+    else
+        nb_release(nb);
     return rv;
 }
 
@@ -131,7 +251,7 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
 
         // Check if the buffer has space for more data to be received
         if (nb->avail_data < nb->max_bytes) {
-            rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+            rv = nb_fill(nb);
             // If recv returns an error, return the same error.
             if (rv < 0)
                 return rv;
@@ -139,6 +259,8 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
             // available in the buffer.
             if (rv == 0) {
                 num = nb->avail_data;
+                if (!num)
+                    return 0;
                 break;
             }
             nb->avail_data += rv;
@@ -156,5 +278,19 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
     // remaining data to the start of the buffer.
     if (nb->avail_data)
         memmove(nb->buf, &nb->buf[num], nb->avail_data);
+    else
+        nb_release(nb);
     return num;
 }
+
+/** Discards any data received but not yet returned by nb_read_line
+ *  or nb_read_bytes. Used when the connection changes to a different
+ *  layer (e.g., TLS), so data sent before the change is not processed
+ *  after it.
+ *
+ *  Parameter: nb: buffer object to be cleared.
+ */
+void nb_clear(net_buffer_t nb) {
+    nb->avail_data = 0;
+    nb_release(nb);
+}
@@ -9,10 +9,14 @@
 
 #include <string.h>
 
+#include "arena.h"
+
 typedef struct net_buffer *net_buffer_t;
 
 net_buffer_t nb_create(int fd, size_t max_buffer_size);
+net_buffer_t nb_create_arena(arena_t arena, int fd, size_t max_buffer_size);
 void         nb_destroy(net_buffer_t nb);
 int          nb_read_line(net_buffer_t nb, char out[]);
 int          nb_read_bytes(net_buffer_t nb, char out[], size_t num);
+void         nb_clear(net_buffer_t nb);
 #endif
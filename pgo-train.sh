@@ -0,0 +1,55 @@
+#!/bin/bash
+# Training workload for the profile-guided build (make pgo).
+#
+# Builds a synthetic mail store for the users in users.txt, with mostly
+# small messages, some large ones and one packed maildrop, then replays
+# a mix of POP3 sessions against the (instrumented) mypopd with
+# popreplay. Runs in a temporary directory, so the mail.store in the
+# current directory is left alone. The profiles are written when the
+# programs exit.
+#
+# Usage: ./pgo-train.sh [sessions per user]
+
+sessions=${1:-40}
+src=$(pwd)
+port=$(expr $$ % 20000 + 30000)
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+cp users.txt $dir/
+cd $dir
+mkdir scripts
+n=0
+while read user password ; do
+    [ "$user" = "" ] && continue
+    n=$(expr $n + 1)
+    $src/mailtool synth $user 40 2000 > /dev/null
+    $src/mailtool synth $user 4 100000 > /dev/null
+    $src/mailtool -z 6 synth $user 4 20000 > /dev/null
+    [ $n = 1 ] && $src/mailtool pack $user > /dev/null
+    for s in $(seq 1 $sessions) ; do
+        script=scripts/$n.$s
+        printf 'USER %s\r\nPASS %s\r\nSTAT\r\nNOOP\r\nCAPA\r\nLIST\r\nUIDL\r\n' $user "$password" > $script
+        for m in $(seq $(expr $s % 8 + 1) 6 48) ; do
+            printf 'RETR %d\r\n' $m >> $script
+        done
+        # Some sessions delete mail and undo it, some fail to log in or
+        # send unknown commands
+        case $(expr $s % 5) in
+            0) printf 'DELE 2\r\nDELE 3\r\nLIST\r\nUIDL 4\r\nRSET\r\nLIST 2\r\n' >> $script ;;
+            1) printf 'RETR 999\r\nXYZZY\r\n' >> $script ;;
+            2) printf 'USER %s\r\nPASS wrong\r\n' $user > $script ;;
+        esac
+        printf 'QUIT\r\n' >> $script
+    done
+done < users.txt
+
+$src/mypopd $port > /dev/null 2>&1 &
+pid=$!
+sleep 1
+$src/popreplay 127.0.0.1 $port scripts/*
+rv=$?
+# SIGINT makes the server exit, which writes its profile
+kill -INT $pid
+wait $pid
+exit $rv
@@ -0,0 +1,560 @@
+/* popreplay.c
+ * Replays client sessions recorded by mypopd -C (see capture.h) or
+ * written by hand in the in.p format of test.sh, against a running
+ * server, and reports throughput and response latency per command.
+ *
+ * Usage: popreplay [-x speed] [-t timeout] [-u users.txt] host port file...
+ *
+ * All sessions run concurrently from a single thread, using epoll.
+ * Sessions start at the same offsets from each other as when they were
+ * recorded, and each command is sent after its recorded delay, but
+ * never before the response to the previous command has arrived. With
+ * -x, all delays are divided by the given speed-up factor. Files
+ * without timing directives start immediately and send each command
+ * as soon as the previous response arrives. A session fails if the
+ * server does not complete a response within the timeout (-t, in
+ * seconds).
+ *
+ * Sessions change the mail store (e.g., DELE then QUIT), so replays
+ * should run against a server started on a copy of the store.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_LINE_LENGTH 1024
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define MAX_EVENTS 256
+
+struct command {
+    char *line;       // including CRLF
+    size_t len;
+    double delay;     // in ms, before the command is sent
+    int multiline;    // response is multi-line if it starts with +OK
+    int stat;         // index in stats
+};
+
+struct script {
+    const char *path;
+    double start;     // in ms, relative to the first session
+    int ncommands;
+    struct command *commands;
+};
+
+enum session_state { Pending, Connecting, Waiting, Sending, Receiving, Done };
+
+struct session {
+    struct script *script;
+    enum session_state state;
+    int fd;
+    int next;         // next command to be sent
+    unsigned seq;     // number of the current response, for deadlines
+    double sent_at;   // when the current command (or connect) was sent
+    size_t sent;      // bytes of the current command sent so far
+    // Response parser
+    int multiline;
+    int status_char;  // first character of the status line, 0 if none yet
+    int in_status;
+    int line_start;
+    int dot;
+};
+
+struct command_stats {
+    const char *name;
+    double *latencies;
+    size_t count;
+    size_t cap;
+    unsigned long errors;
+};
+
+static struct command_stats stats[] = {
+    { "connect" }, { "USER" }, { "PASS" }, { "STAT" }, { "LIST" }, { "UIDL" },
+    { "RETR" }, { "TOP" }, { "DELE" }, { "RSET" }, { "NOOP" }, { "CAPA" },
+    { "STLS" }, { "QUIT" }, { "other" },
+};
+#define NSTATS (sizeof(stats) / sizeof(stats[0]))
+#define STAT_CONNECT 0
+#define STAT_OTHER (NSTATS - 1)
+
+// Timer heap, ordered by wake-up time. A timer with seq 0 starts the
+// session or sends its next command; any other timer is the deadline
+// for response seq, and is ignored if that response has arrived.
+struct timer {
+    double when;
+    struct session *session;
+    unsigned seq;
+};
+static struct timer *heap;
+static size_t heap_len, heap_cap;
+
+static double speed = 1;
+static double timeout = 10000;
+static struct addrinfo *server_addr;
+static int epoll_fd;
+static double t0;
+static unsigned long sessions_done, sessions_failed, sessions_closed_early;
+static unsigned long long bytes_received;
+
+static double now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static void heap_push(double when, struct session *session, unsigned seq) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? 2 * heap_cap : 1024;
+        heap = realloc(heap, heap_cap * sizeof(struct timer));
+        if (!heap) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    size_t i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].when > when) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i].when = when;
+    heap[i].session = session;
+    heap[i].seq = seq;
+}
+
+static struct timer heap_pop(void) {
+    struct timer top = heap[0], last = heap[--heap_len];
+    size_t i = 0, child;
+    while ((child = 2 * i + 1) < heap_len) {
+        if (child + 1 < heap_len && heap[child + 1].when < heap[child].when)
+            child++;
+        if (heap[child].when >= last.when)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void stat_add(int stat, double latency, int error) {
+    struct command_stats *s = &stats[stat];
+    if (s->count == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 1024;
+        s->latencies = realloc(s->latencies, s->cap * sizeof(double));
+        if (!s->latencies) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->latencies[s->count++] = latency;
+    s->errors += error;
+}
+
+static int stat_of(const char *line) {
+    for (int i = 1; i < STAT_OTHER; i++) {
+        size_t len = strlen(stats[i].name);
+        if (!strncasecmp(line, stats[i].name, len) &&
+            (line[len] == ' ' || line[len] == '\r' || line[len] == '\n' || !line[len]))
+            return i;
+    }
+    return STAT_OTHER;
+}
+
+/** Looks up the password of a user in the users file.
+ *
+ *  Returns: The password (to be freed), or NULL if the user is unknown.
+ */
+static char *find_password(const char *users_file, const char *user) {
+    char u[MAX_LINE_LENGTH], p[MAX_LINE_LENGTH];
+    char *rv = NULL;
+    FILE *file = fopen(users_file, "r");
+    if (!file) return NULL;
+    while (!rv && fscanf(file, "%1023s%1023s", u, p) == 2)
+        if (!strcasecmp(u, user))
+            rv = strdup(p);
+    fclose(file);
+    return rv;
+}
+
+/** Loads a session script. Directive lines set the timing, and
+ *  passwords replaced with "*" are looked up in the users file.
+ *
+ *  Returns: 0 on success, -1 if the file cannot be read.
+ */
+static int load_script(struct script *script, const char *path, const char *users_file,
+                       double *session_time) {
+    char line[MAX_LINE_LENGTH + 3], user[MAX_LINE_LENGTH] = "";
+    double delay = 0;
+    int cap = 0;
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    script->path = path;
+    script->ncommands = 0;
+    script->commands = NULL;
+    *session_time = -1;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#') {
+            if (!strncmp(line, "#session ", 9))
+                *session_time = atof(line + 9);
+            else if (!strncmp(line, "#delay ", 7))
+                delay = atof(line + 7);
+            continue;
+        }
+        // A blank line makes the server close the connection
+        if (!line[0])
+            continue;
+
+        char *password = NULL;
+        if (!strncasecmp(line, "USER ", 5)) {
+            sscanf(line + 5, "%1023s", user);
+        } else if (!strcasecmp(line, "PASS *")) {
+            password = find_password(users_file, user);
+            if (!password)
+                fprintf(stderr, "%s: no password for user '%s'\n", path, user);
+        }
+
+        if (script->ncommands == cap) {
+            cap = cap ? 2 * cap : 16;
+            script->commands = realloc(script->commands, cap * sizeof(struct command));
+        }
+        struct command *command = &script->commands[script->ncommands++];
+        command->len = password ? strlen(password) + 7 : strlen(line) + 2;
+        command->line = malloc(command->len + 1);
+        if (password)
+            sprintf(command->line, "PASS %s\r\n", password);
+        else
+            sprintf(command->line, "%s\r\n", line);
+        free(password);
+        command->delay = delay;
+        command->stat = stat_of(line);
+        // Multi-line responses: RETR, TOP and CAPA, and LIST and UIDL
+        // without arguments
+        command->multiline = !strncasecmp(line, "RETR", 4) || !strncasecmp(line, "TOP", 3) ||
+            !strcasecmp(line, "CAPA") || !strcasecmp(line, "LIST") || !strcasecmp(line, "UIDL");
+        delay = 0;
+    }
+    fclose(file);
+    return 0;
+}
+
+static void session_close(struct session *session, int failed) {
+    if (session->fd >= 0)
+        close(session->fd);
+    session->fd = -1;
+    session->state = Done;
+    sessions_done++;
+    if (failed)
+        sessions_failed++;
+    else if (session->next < session->script->ncommands)
+        sessions_closed_early++;
+}
+
+static void session_watch(struct session *session, int op, int events) {
+    struct epoll_event ev = { .events = events, .data.ptr = session };
+    if (epoll_ctl(epoll_fd, op, session->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        session_close(session, 1);
+    }
+}
+
+static void session_connect(struct session *session) {
+    session->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (session->fd < 0) {
+        perror("socket");
+        session_close(session, 1);
+        return;
+    }
+    session->sent_at = now_ms();
+    session->state = Connecting;
+    // The greeting is parsed like the response to a command
+    session->multiline = 0;
+    session->status_char = 0;
+    session->in_status = 1;
+    heap_push(session->sent_at + timeout, session, ++session->seq);
+    if (connect(session->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        session_close(session, 1);
+        return;
+    }
+    session_watch(session, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT);
+}
+
+/** Sends (the rest of) the current command of a session.
+ */
+static void session_send(struct session *session) {
+    struct command *command = &session->script->commands[session->next];
+    while (session->sent < command->len) {
+        ssize_t rv = send(session->fd, command->line + session->sent,
+                          command->len - session->sent, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EAGAIN) {
+            if (session->state != Sending)
+                session_watch(session, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+            session->state = Sending;
+            return;
+        }
+        if (rv <= 0) {
+            session_close(session, 1);
+            return;
+        }
+        session->sent += rv;
+    }
+    if (session->state == Sending)
+        session_watch(session, EPOLL_CTL_MOD, EPOLLIN);
+    session->state = Receiving;
+}
+
+static void session_start_command(struct session *session) {
+    struct command *command = &session->script->commands[session->next];
+    session->sent_at = now_ms();
+    session->sent = 0;
+    session->multiline = command->multiline;
+    session->status_char = 0;
+    session->in_status = 1;
+    heap_push(session->sent_at + timeout, session, ++session->seq);
+    session_send(session);
+}
+
+/** Called when the response to the current command (or the greeting)
+ *  is complete. Schedules the next command, or ends the session.
+ */
+static void session_response_done(struct session *session) {
+    double now = now_ms();
+    int stat = session->state == Connecting || session->state == Waiting ?
+        STAT_CONNECT : session->script->commands[session->next].stat;
+    stat_add(stat, now - session->sent_at, session->status_char != '+');
+    if (stat != STAT_CONNECT)
+        session->next++;
+
+    if (session->next >= session->script->ncommands) {
+        session_close(session, 0);
+        return;
+    }
+    // The recorded delay is counted from when the previous command
+    // was sent, so the server's response time is part of it
+    double when = session->sent_at + session->script->commands[session->next].delay / speed;
+    session->state = Waiting;
+    heap_push(when > now ? when : now, session, 0);
+}
+
+/** Parses part of a response. Returns the number of bytes used, which
+ *  is less than len if the response ends before the end of the data.
+ */
+static size_t session_parse(struct session *session, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (session->in_status) {
+            if (!session->status_char)
+                session->status_char = c;
+            if (c == '\n') {
+                session->in_status = 0;
+                if (!session->multiline || session->status_char != '+') {
+                    session_response_done(session);
+                    return i + 1;
+                }
+                session->line_start = 1;
+                session->dot = 0;
+            }
+            continue;
+        }
+        // Multi-line response, which ends with a line with a single dot
+        if (session->line_start && c == '.')
+            session->dot = 1;
+        else if (session->dot == 1 && c == '\r')
+            session->dot = 2;
+        else if (session->dot == 2 && c == '\n') {
+            session_response_done(session);
+            return i + 1;
+        } else
+            session->dot = 0;
+        session->line_start = c == '\n';
+    }
+    return len;
+}
+
+static void session_io(struct session *session, unsigned events) {
+    static char buf[RECV_BUFFER_SIZE];
+
+    if (session->state == Connecting && (events & (EPOLLOUT | EPOLLERR))) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err) {
+            fprintf(stderr, "%s: connect: %s\n", session->script->path, strerror(err));
+            session_close(session, 1);
+            return;
+        }
+        session_watch(session, EPOLL_CTL_MOD, EPOLLIN);
+        if (session->state == Done) return;
+    }
+    if (session->state == Sending && (events & EPOLLOUT)) {
+        session_send(session);
+        if (session->state == Done) return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    while (session->state != Done) {
+        ssize_t rv = recv(session->fd, buf, sizeof(buf), 0);
+        if (rv < 0 && errno == EAGAIN)
+            return;
+        if (rv <= 0) {
+            // The server closed the connection (e.g., after QUIT)
+            session_close(session, 0);
+            return;
+        }
+        bytes_received += rv;
+        // Data after the end of a response is not expected, since
+        // commands are not pipelined, and is ignored
+        if (session->state == Connecting || session->state == Receiving)
+            session_parse(session, buf, rv);
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(struct command_stats *s, double p) {
+    size_t i = (size_t) (p * (s->count - 1) + 0.5);
+    return s->latencies[i];
+}
+
+static void report(double elapsed) {
+    unsigned long commands = 0;
+    printf("%-8s %8s %7s %9s %9s %9s %9s\n", "command", "count", "errors",
+           "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (int i = 0; i < NSTATS; i++) {
+        struct command_stats *s = &stats[i];
+        if (!s->count) continue;
+        qsort(s->latencies, s->count, sizeof(double), compare_double);
+        printf("%-8s %8zu %7lu %9.3f %9.3f %9.3f %9.3f\n", s->name, s->count, s->errors,
+               percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99),
+               s->latencies[s->count - 1]);
+        if (i != STAT_CONNECT)
+            commands += s->count;
+    }
+    printf("%lu sessions (%lu failed, %lu closed early by the server) in %.3fs\n",
+           sessions_done, sessions_failed, sessions_closed_early, elapsed / 1000);
+    printf("%.1f sessions/s, %.1f commands/s, %.2f MB/s received\n",
+           sessions_done * 1000 / elapsed, commands * 1000 / elapsed,
+           bytes_received / 1e6 * 1000 / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    const char *users_file = "users.txt";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:t:u:")) != -1) {
+        switch (opt) {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 't':
+            timeout = atof(optarg) * 1000;
+            break;
+        case 'u':
+            users_file = optarg;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind < 3 || speed <= 0 || timeout <= 0) {
+        fprintf(stderr, "Invalid arguments. Expected: %s [-x speed] [-t timeout] [-u users.txt] "
+                "host port file...\n", argv[0]);
+        return 1;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int rv = getaddrinfo(argv[optind], argv[optind + 1], &hints, &server_addr);
+    if (rv) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(rv));
+        return 1;
+    }
+
+    int nsessions = argc - optind - 2;
+    struct script *scripts = calloc(nsessions, sizeof(struct script));
+    struct session *sessions = calloc(nsessions, sizeof(struct session));
+    double *session_times = calloc(nsessions, sizeof(double));
+    if (!scripts || !sessions || !session_times) {
+        perror("calloc");
+        return 1;
+    }
+
+    // Session start times are kept relative to the earliest session
+    double first = -1;
+    int n = 0;
+    for (int i = 0; i < nsessions; i++) {
+        const char *path = argv[optind + 2 + i];
+        if (load_script(&scripts[n], path, users_file, &session_times[n]) < 0) {
+            perror(path);
+            continue;
+        }
+        if (session_times[n] >= 0 && (first < 0 || session_times[n] < first))
+            first = session_times[n];
+        n++;
+    }
+    nsessions = n;
+    for (int i = 0; i < nsessions; i++)
+        scripts[i].start = session_times[i] >= 0 ? session_times[i] - first : 0;
+    free(session_times);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    t0 = now_ms();
+    for (int i = 0; i < nsessions; i++) {
+        sessions[i].script = &scripts[i];
+        sessions[i].state = Pending;
+        sessions[i].fd = -1;
+        heap_push(t0 + scripts[i].start / speed, &sessions[i], 0);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (sessions_done < nsessions) {
+        double now = now_ms();
+        while (heap_len && heap[0].when <= now) {
+            struct timer timer = heap_pop();
+            struct session *session = timer.session;
+            if (timer.seq) {
+                if (timer.seq == session->seq && session->state != Waiting &&
+                    session->state != Done) {
+                    fprintf(stderr, "%s: timed out waiting for %s\n", session->script->path,
+                            session->state == Connecting ? "greeting" :
+                            stats[session->script->commands[session->next].stat].name);
+                    session_close(session, 1);
+                }
+            } else if (session->state == Pending)
+                session_connect(session);
+            else if (session->state == Waiting)
+                session_start_command(session);
+        }
+        if (sessions_done == nsessions)
+            break;
+        int wait = heap_len ? (int) (heap[0].when - now) + 1 : -1;
+        int nevents = epoll_wait(epoll_fd, events, MAX_EVENTS, wait);
+        if (nevents < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < nevents; i++)
+            session_io(events[i].data.ptr, events[i].events);
+    }
+
+    report(now_ms() - t0);
+    freeaddrinfo(server_addr);
+    return sessions_failed ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+/* prefetch.c
+ * Read-ahead of messages for sessions that retrieve them in order.
+ * Each session has a few slots for messages being read ahead. Slots
+ * are queued for a single background I/O thread, which opens the
+ * message and asks the kernel to read it (mail_item_prefetch); the
+ * file is then kept open until the session retrieves the message or
+ * moves past it. All slots are protected by a single lock, which is
+ * only held for short updates.
+ */
+
+#include "prefetch.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PREFETCH_MAX_DEPTH 8
+// Data a session tries to keep read ahead: large messages are read
+// ahead one at a time, small ones up to PREFETCH_MAX_DEPTH at a time
+#define PREFETCH_WINDOW (1024 * 1024)
+// Smallest amount charged to the budget per message, so that small
+// messages cannot keep too many files open
+#define PREFETCH_MIN_CHARGE (64 * 1024)
+
+enum slot_state { Free, Queued, Busy, Ready };
+
+struct prefetch_slot {
+    enum slot_state state;
+    int pos;
+    mail_item_t item;
+    int fd;             // set by the I/O thread, -1 if not kept open
+    size_t charge;      // amount charged to the budget
+    struct prefetch_slot *next;
+};
+
+struct prefetch {
+    int last;           // position of the last message retrieved
+    int run;            // number of consecutive messages retrieved
+    size_t avg_size;    // moving average of the retrieved messages' sizes
+    struct prefetch_slot slots[PREFETCH_MAX_DEPTH];
+};
+
+static size_t budget;   // 0 if read-ahead is disabled
+// Protected by lock
+static size_t used;
+static struct prefetch_stats stats;
+static struct prefetch_slot *queue_head, *queue_tail;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+static void *prefetch_thread(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!queue_head)
+            pthread_cond_wait(&queued, &lock);
+        struct prefetch_slot *slot = queue_head;
+        queue_head = slot->next;
+        if (!queue_head) queue_tail = NULL;
+        slot->state = Busy;
+        mail_item_t item = slot->item;
+        pthread_mutex_unlock(&lock);
+
+        int fd = mail_item_prefetch(item);
+
+        pthread_mutex_lock(&lock);
+        slot->fd = fd;
+        slot->state = Ready;
+        pthread_cond_broadcast(&finished);
+    }
+    return NULL;
+}
+
+/** Starts the I/O thread.
+ *
+ *  Parameters: budget_bytes: Most data read ahead at any time, for
+ *                            all sessions. 0 disables read-ahead.
+ *
+ *  Returns: 0 on success, -1 if the thread could not be started.
+ */
+int prefetch_init(size_t budget_bytes) {
+    pthread_t thread;
+    budget = budget_bytes;
+    if (!budget) return 0;
+    if (pthread_create(&thread, NULL, prefetch_thread, NULL) != 0) {
+        budget = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/** Creates the read-ahead state of a session.
+ *
+ *  Parameters: arena: Session arena the state is allocated from.
+ *
+ *  Returns: The state, or NULL if read-ahead is disabled or no memory
+ *           is available.
+ */
+prefetch_t prefetch_create(arena_t arena) {
+    if (!budget) return NULL;
+    prefetch_t pf = arena_calloc(arena, 1, sizeof(struct prefetch));
+    if (pf) pf->last = -1;
+    return pf;
+}
+
+/** Internal function that releases a slot, waiting for the I/O thread
+ *  if it is working on it. Must be called with the lock held.
+ *
+ *  Returns: The file kept open for the message, or -1.
+ */
+static int release_slot(struct prefetch_slot *slot) {
+    int fd = -1;
+    if (slot->state == Queued) {
+        struct prefetch_slot **pp = &queue_head, *prev = NULL;
+        while (*pp != slot) {
+            prev = *pp;
+            pp = &(*pp)->next;
+        }
+        *pp = slot->next;
+        if (queue_tail == slot) queue_tail = prev;
+    } else {
+        while (slot->state == Busy)
+            pthread_cond_wait(&finished, &lock);
+        fd = slot->fd;
+    }
+    used -= slot->charge;
+    stats.bytes = used;
+    slot->state = Free;
+    return fd;
+}
+
+/** Takes the result of the read-ahead of a message that is about to
+ *  be retrieved, waiting for it if it is in progress.
+ *
+ *  Parameters: pf: Read-ahead state of the session, or NULL.
+ *              pos: Position of the message in the maildrop.
+ *
+ *  Returns: A descriptor of the open message file, to be passed to
+ *           mail_item_contents_fd, or -1 if the message was not read
+ *           ahead (or is not kept open).
+ */
+int prefetch_take(prefetch_t pf, int pos) {
+    int fd = -1;
+    if (!pf) return -1;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+        struct prefetch_slot *slot = &pf->slots[i];
+        if (slot->state == Free || slot->pos != pos)
+            continue;
+        if (slot->state == Queued)
+            stats.unused++;
+        else if (slot->state == Busy)
+            stats.waits++;
+        else
+            stats.hits++;
+        fd = release_slot(slot);
+    }
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+/** Internal function that returns a free slot for a message, or NULL
+ *  if no slot is free or the message already has a slot.
+ */
+static struct prefetch_slot *free_slot(prefetch_t pf, int pos) {
+    struct prefetch_slot *rv = NULL;
+    for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+        if (pf->slots[i].state == Free && !rv)
+            rv = &pf->slots[i];
+        else if (pf->slots[i].state != Free && pf->slots[i].pos == pos)
+            return NULL;
+    }
+    return rv;
+}
+
+/** Records that a message is being retrieved. If the session retrieves
+ *  messages in order, queues the following messages for read-ahead.
+ *  Messages read ahead that the session has moved past are released.
+ *
+ *  Parameters: pf: Read-ahead state of the session, or NULL.
+ *              list: Maildrop of the session.
+ *              pos: Position of the message being retrieved.
+ */
+void prefetch_access(prefetch_t pf, mail_list_t list, int pos) {
+    if (!pf) return;
+    mail_item_t item = mail_list_retrieve(list, pos);
+    if (!item) return;
+
+    size_t size = mail_item_size(item);
+    pf->avg_size = pf->avg_size ? (3 * pf->avg_size + size) / 4 : size;
+    pf->run = pos == pf->last + 1 ? pf->run + 1 : 1;
+    pf->last = pos;
+    size_t window = PREFETCH_WINDOW / (pf->avg_size ? pf->avg_size : 1);
+    int depth = window < 1 ? 1 : window > PREFETCH_MAX_DEPTH ? PREFETCH_MAX_DEPTH : window;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+        struct prefetch_slot *slot = &pf->slots[i];
+        if (slot->state != Free && (slot->pos <= pos || slot->pos > pos + depth || pf->run < 2)) {
+            stats.unused++;
+            int fd = release_slot(slot);
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    // Read-ahead starts with the second consecutive message
+    int queued_any = 0;
+    for (int next = pos + 1; pf->run >= 2 && next <= pos + depth; next++) {
+        mail_item_t next_item = mail_list_retrieve(list, next);
+        if (!next_item) continue;
+        struct prefetch_slot *slot = free_slot(pf, next);
+        if (!slot) continue;
+        slot->charge = mail_item_size(next_item);
+        if (slot->charge < PREFETCH_MIN_CHARGE)
+            slot->charge = PREFETCH_MIN_CHARGE;
+        if (used + slot->charge > budget) {
+            stats.denied++;
+            break;
+        }
+        used += slot->charge;
+        stats.bytes = used;
+        stats.issued++;
+        slot->state = Queued;
+        slot->pos = next;
+        slot->item = next_item;
+        slot->fd = -1;
+        slot->next = NULL;
+        if (queue_tail)
+            queue_tail->next = slot;
+        else
+            queue_head = slot;
+        queue_tail = slot;
+        queued_any = 1;
+    }
+    if (queued_any)
+        pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+}
+
+/** Releases all messages read ahead for a session. Must be called
+ *  before the session's maildrop is destroyed.
+ *
+ *  Parameters: pf: Read-ahead state of the session, or NULL.
+ */
+void prefetch_end(prefetch_t pf) {
+    if (!pf) return;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < PREFETCH_MAX_DEPTH; i++) {
+        if (pf->slots[i].state != Free) {
+            stats.unused++;
+            int fd = release_slot(&pf->slots[i]);
+            if (fd >= 0) close(fd);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/** Returns the read-ahead counters, for all sessions.
+ */
+void prefetch_get_stats(struct prefetch_stats *out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,39 @@
+/* prefetch.h
+ * Read-ahead of messages for sessions that retrieve them in order, as
+ * download clients do (RETR 1, RETR 2, ...). Once a session retrieves
+ * consecutive messages, the next few messages are opened and read into
+ * the page cache by a background I/O thread, so reading them from disk
+ * overlaps with sending the current message to the client. The files
+ * are kept open until the session retrieves the messages.
+ *
+ * The number of messages read ahead depends on their size, and the
+ * data read ahead by all sessions is bounded by a global budget.
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include "mailuser.h"
+#include "arena.h"
+
+#include <stddef.h>
+
+typedef struct prefetch *prefetch_t;
+
+struct prefetch_stats {
+    unsigned long issued;    // messages queued for read-ahead
+    unsigned long hits;      // retrieved after their read-ahead finished
+    unsigned long waits;     // retrieved while their read-ahead ran
+    unsigned long unused;    // cancelled or never retrieved
+    unsigned long denied;    // not queued because the budget was used up
+    size_t        bytes;     // data currently read ahead
+};
+
+int        prefetch_init(size_t budget);
+prefetch_t prefetch_create(arena_t arena);
+int        prefetch_take(prefetch_t pf, int pos);
+void       prefetch_access(prefetch_t pf, mail_list_t list, int pos);
+void       prefetch_end(prefetch_t pf);
+void       prefetch_get_stats(struct prefetch_stats *stats);
+
+#endif
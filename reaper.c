@@ -0,0 +1,103 @@
+/* reaper.c
+ * Closes sessions that have been idle for too long. Each session
+ * registers a timer with its socket; when the timer expires, the
+ * socket is shut down, which makes the session's pending recv return
+ * so the session thread cleans up on its own.
+ */
+
+#include "reaper.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+time_t reaper_now;
+
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer_wheel_t reaper_wheel;
+
+/** Internal function called for each timer that comes up in the wheel.
+ *  Sessions that were active since the timer was scheduled are
+ *  rescheduled for their new deadline; the others are shut down.
+ *  A session whose last response is still being read by the client
+ *  (the data queued in the socket changed since the timer last came
+ *  up) is active too, even if it has sent nothing for a while.
+ */
+static void reaper_expired(struct tw_timer *tw, void *arg) {
+    struct idle_timer *timer = (struct idle_timer *) tw;
+    time_t now = *(time_t *) arg;
+    time_t deadline = __atomic_load_n(&timer->deadline, __ATOMIC_RELAXED);
+
+    if (deadline <= now) {
+        size_t queued = unsent_bytes(timer->fd), last = timer->queued;
+        timer->queued = queued;
+        if (queued ? queued != last : last > 0) {
+            deadline = now + __atomic_load_n(&timer->timeout, __ATOMIC_RELAXED) + 1;
+            __atomic_store_n(&timer->deadline, deadline, __ATOMIC_RELAXED);
+        }
+    }
+    if (deadline > now) {
+        tw_add(reaper_wheel, tw, deadline);
+        return;
+    }
+    dlog("%x: Session idle for too long, closing connection\n", timer->fd);
+    timer->expired = 1;
+    shutdown(timer->fd, SHUT_RDWR);
+}
+
+static void *reaper_thread(void *arg) {
+    while (1) {
+        sleep(1);
+        time_t now = time(NULL);
+        pthread_mutex_lock(&reaper_lock);
+        __atomic_store_n(&reaper_now, now, __ATOMIC_RELAXED);
+        tw_advance(reaper_wheel, now, reaper_expired, &now);
+        pthread_mutex_unlock(&reaper_lock);
+    }
+    return NULL;
+}
+
+/** Starts the reaper thread.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int reaper_start(void) {
+    pthread_t thread;
+    reaper_now = time(NULL);
+    reaper_wheel = tw_create(reaper_now);
+    if (!reaper_wheel || pthread_create(&thread, NULL, reaper_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+/** Starts tracking a session. The socket is shut down if the session
+ *  deadline passes without being extended by reaper_touch.
+ *
+ *  Parameters: timer: timer for the session, owned by the session.
+ *              fd: socket of the session.
+ *              timeout: initial idle timeout, in seconds.
+ */
+void reaper_register(struct idle_timer *timer, int fd, int timeout) {
+    timer->fd = fd;
+    timer->expired = 0;
+    timer->queued = 0;
+    timer->tw.next = NULL;
+    timer->tw.pprev = NULL;
+    pthread_mutex_lock(&reaper_lock);
+    reaper_touch(timer, timeout);
+    if (reaper_wheel)
+        tw_add(reaper_wheel, &timer->tw, __atomic_load_n(&timer->deadline, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+/** Stops tracking a session. Must be called before the socket is
+ *  closed, so the reaper never shuts down a reused descriptor.
+ */
+void reaper_unregister(struct idle_timer *timer) {
+    pthread_mutex_lock(&reaper_lock);
+    tw_remove(&timer->tw);
+    pthread_mutex_unlock(&reaper_lock);
+}
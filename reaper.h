@@ -0,0 +1,43 @@
+/* reaper.h
+ * Closes sessions that have been idle for too long (the autologout
+ * timer in RFC 1939). Session deadlines are kept in a timer wheel
+ * scanned once per second by a background thread.
+ */
+
+#ifndef _REAPER_H_
+#define _REAPER_H_
+
+#include "timerwheel.h"
+
+#include <time.h>
+
+struct idle_timer {
+    struct tw_timer tw;
+    int fd;
+    int expired;
+    time_t deadline;            // written by the session, without the lock
+    int timeout;                // that deadline was last set from, likewise
+    size_t queued;              // unsent bytes when the timer last came up
+};
+
+// Coarse clock, in seconds, updated by the reaper thread once per tick
+extern time_t reaper_now;
+
+int  reaper_start(void);
+void reaper_register(struct idle_timer *timer, int fd, int timeout);
+void reaper_unregister(struct idle_timer *timer);
+
+/** Extends the deadline of a session. This is only a store to memory:
+ *  the timer wheel is updated lazily, when the old deadline comes up,
+ *  so it can be called on every command at no cost. Since reaper_now
+ *  may be up to a second behind, one second is added so sessions are
+ *  never closed early. The reaper thread reads the deadline while the
+ *  session runs, so both are accessed atomically.
+ */
+static inline void reaper_touch(struct idle_timer *timer, int timeout) {
+    time_t now = __atomic_load_n(&reaper_now, __ATOMIC_RELAXED);
+    __atomic_store_n(&timer->timeout, timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&timer->deadline, now + timeout + 1, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,91 @@
+#!/bin/bash
+# Concurrency scaling benchmark for mypopd.
+#
+# Builds a synthetic mail store for the users in users.txt, then for
+# each core count from 1 to the given maximum runs mypopd pinned to that
+# many CPUs (with taskset) and replays the same set of concurrent,
+# command-heavy POP3 sessions against it with popreplay. The load is
+# split over several popreplay processes, pinned to the CPUs the server
+# does not use when there are enough of them. Prints the command rate
+# for each core count and the speed-up relative to one core.
+#
+# The sessions do not change the store, so every run sees the same
+# data. Runs in a temporary directory, so the mail.store in the current
+# directory is left alone. Exits with a non-zero status if a session
+# fails or the server exits with an error (e.g., when it was built with
+# -fsanitize=thread and a data race was found; see make tsan). With the
+# memory backend (mailbackend.h), the server reads the store once at
+# start, so the rate measures the protocol and the sockets alone.
+#
+# Usage: ./scale-bench.sh [max cores] [sessions per user] [generators]
+#                         [backend]
+#
+# Further options for mypopd can be given in MYPOPD_OPTS.
+
+ncpu=$(nproc)
+max=${1:-$(expr $ncpu / 2)}
+sessions=${2:-100}
+generators=${3:-4}
+backend=${4:-dir}
+[ $max -lt 1 ] && max=1
+if [ $max -gt $ncpu ] ; then
+    echo "Only $ncpu CPUs available, measuring up to $ncpu cores" >&2
+    max=$ncpu
+fi
+src=$(pwd)
+port=$(expr $$ % 20000 + 30000)
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+cp users.txt $dir/
+cd $dir
+mkdir scripts
+n=0
+while read user password ; do
+    [ "$user" = "" ] && continue
+    n=$(expr $n + 1)
+    $src/mailtool synth $user 20 2000 > /dev/null
+    $src/mailtool synth $user 2 50000 > /dev/null
+    for s in $(seq 1 $sessions) ; do
+        script=scripts/$(expr $s % $generators).$n.$s
+        printf 'USER %s\r\nPASS %s\r\nSTAT\r\nLIST\r\nUIDL\r\n' $user "$password" > $script
+        for m in $(seq $(expr $s % 4 + 1) 4 22) ; do
+            printf 'LIST %d\r\nUIDL %d\r\nRETR %d\r\nNOOP\r\n' $m $m $m >> $script
+        done
+        printf 'STAT\r\nQUIT\r\n' >> $script
+    done
+done < users.txt
+commands=$(cat scripts/* | grep -c '^[A-Z]')
+
+rv=0
+base=
+printf '%5s %12s %8s\n' cores commands/s speedup
+for cores in $(seq 1 $max) ; do
+    port=$(expr $port + 1)
+    taskset -c 0-$(expr $cores - 1) $src/mypopd -M $backend $MYPOPD_OPTS $port > /dev/null 2> server.log &
+    pid=$!
+    sleep 1
+    # Generators use the remaining CPUs if there are enough of them
+    gencpus=
+    [ $(expr $cores + $generators) -le $ncpu ] && gencpus="taskset -c $cores-$(expr $ncpu - 1)"
+    start=$EPOCHREALTIME
+    pids=
+    for g in $(seq 0 $(expr $generators - 1)) ; do
+        $gencpus $src/popreplay 127.0.0.1 $port scripts/$g.* > gen.$g.log &
+        pids="$pids $!"
+    done
+    for p in $pids ; do
+        wait $p || { echo "popreplay failed:" >&2 ; tail -n 3 gen.*.log >&2 ; rv=1 ; }
+    done
+    end=$EPOCHREALTIME
+    kill -INT $pid
+    if ! wait $pid ; then
+        echo "mypopd exited with an error:" >&2
+        cat server.log >&2
+        rv=1
+    fi
+    rate=$(awk "BEGIN { printf \"%.0f\", $commands / ($end - $start) }")
+    [ "$base" = "" ] && base=$rate
+    printf '%5d %12d %8.2f\n' $cores $rate $(awk "BEGIN { print $rate / $base }")
+done
+exit $rv
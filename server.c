@@ -10,18 +10,27 @@
  * Programming (http://beej.us/guide/bgnet/).
  */
 
+#define _GNU_SOURCE
 #include "server.h"
+#include "affinity.h"
+#include "trace.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
@@ -29,8 +38,53 @@
 #include <signal.h>
 #include <pthread.h>
 
+#define DRAIN_POLL_INTERVAL_MS 100
+// Smallest stack accepted for session threads; RETR and the TLS
+// handshake need a few tens of kilobytes
+#define SESSION_STACK_MIN (64 * 1024)
+// Seconds between readiness checks for health probes; a status older
+// than PROBE_STALE seconds means the check itself is stuck
+#define PROBE_INTERVAL 1
+#define PROBE_STALE 5
+#define PROBE_LINE_MAX 96
+
+struct server_options server_options = {
+    .upgrade_path = NULL,
+    .drain_timeout = 300,
+    .stack_size = 0,
+    .report_interval = 0,
+    .acceptor_cpus = NULL,
+    .worker_cpus = NULL,
+    .numa_placement = 0,
+    .probe_port = NULL,
+    .busy_sessions = 0,
+    .ready_check = NULL,
+};
+
 int server_socket;
 
+// Number of sessions currently being handled
+static int active_sessions;
+static void (*session_handler)(void *);
+// CPUs session threads may run on, if worker_cpus or acceptor_cpus
+// is set (otherwise threads are not pinned)
+static cpu_set_t worker_set;
+static int pin_workers;
+// Placement statistics, updated by the acceptor thread
+static unsigned long placed_on_node[AFFINITY_MAX_NODES];
+static unsigned long placed_unknown;   // incoming CPU not reported
+static unsigned long placed_fallback;  // node has no CPU in worker_set
+// Written to wake up the accept loop when the server starts draining
+static int wake_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t draining;
+// Health probe listener, and the status line sent to probes, updated
+// by the probe thread and protected by probe_lock
+static int probe_socket = -1;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static char probe_line[PROBE_LINE_MAX];
+static size_t probe_len;
+static time_t probe_updated;
+
 // Signal handler to gracefully close the server
 void sigint_handler(int signum) {
     printf("Server shutting down\n");
@@ -38,22 +92,202 @@ void sigint_handler(int signum) {
     exit(0);
 }
 
-/* TODO: Fill in the server code. You are required to listen on all interfaces for connections. For each connection,
- * invoke the handler on a new thread. */
-void run_server(const char *port, void (*handler)(void *)) {
+// Signal handler to stop accepting connections and exit once the
+// current sessions are finished
+void sigterm_handler(int signum) {
+    server_drain();
+}
+
+/** Stops accepting new connections. The server exits once all current
+ *  sessions end, or once server_options.drain_timeout seconds have
+ *  passed. Safe to call from a signal handler.
+ */
+void server_drain(void) {
+    draining = 1;
+    if (wake_pipe[1] >= 0 && write(wake_pipe[1], "", 1) < 0) {
+        // Nothing to do: the pipe is only a wake-up hint
+    }
+}
+
+static void *session_main(void *arg) {
+    session_handler(arg);
+    __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/** Internal function that returns the resident memory of the process,
+ *  in bytes, or 0 if it cannot be determined.
+ */
+static size_t resident_bytes(void) {
+    unsigned long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** Internal thread that periodically reports how much memory each
+ *  session uses. Measured with idle connections (e.g., clients that
+ *  connect and send nothing), this is the footprint of an idle session.
+ */
+static void *report_thread(void *arg) {
+    size_t baseline = *(size_t *) arg;
+    free(arg);
+    while (1) {
+        sleep(server_options.report_interval);
+        size_t resident = resident_bytes();
+        int sessions = __atomic_load_n(&active_sessions, __ATOMIC_RELAXED);
+        long per_session = sessions ? ((long) resident - (long) baseline) / sessions : 0;
+        printf("Memory: %zu bytes resident, %d sessions, %ld bytes per session\n",
+               resident, sessions, per_session);
+        if (server_options.numa_placement) {
+            printf("Placement:");
+            for (int node = 0; node < affinity_nodes(); node++)
+                printf(" node%d %lu,", node,
+                       __atomic_load_n(&placed_on_node[node], __ATOMIC_RELAXED));
+            printf(" unknown %lu, fallback %lu\n",
+                   __atomic_load_n(&placed_unknown, __ATOMIC_RELAXED),
+                   __atomic_load_n(&placed_fallback, __ATOMIC_RELAXED));
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/** Internal thread that keeps the status line for health probes up to
+ *  date, so probes are answered without checking anything. The check
+ *  may block (e.g., on a file system that does not respond), which is
+ *  why it does not run on the acceptor.
+ */
+static void *probe_thread(void *arg) {
+    while (1) {
+        char line[PROBE_LINE_MAX];
+        int ready = !server_options.ready_check || server_options.ready_check() == 0;
+        int sessions = __atomic_load_n(&active_sessions, __ATOMIC_RELAXED);
+        int len;
+        if (!ready)
+            len = snprintf(line, sizeof(line), "-ERR Not ready, mail store unavailable\r\n");
+        else if (server_options.busy_sessions > 0 && sessions >= server_options.busy_sessions)
+            len = snprintf(line, sizeof(line), "-ERR Busy, %d sessions\r\n", sessions);
+        else
+            len = snprintf(line, sizeof(line), "+OK Ready, %d sessions\r\n", sessions);
+        pthread_mutex_lock(&probe_lock);
+        memcpy(probe_line, line, len);
+        probe_len = len;
+        probe_updated = time(NULL);
+        pthread_mutex_unlock(&probe_lock);
+        sleep(PROBE_INTERVAL);
+    }
+    return NULL;
+}
+
+/** Internal function that answers a health probe with the current
+ *  status line and closes the connection. Runs on the acceptor, and
+ *  never blocks: the line fits in any socket buffer.
+ */
+static void answer_probe(void) {
+    int sock = accept4(probe_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0) return;
+    char line[PROBE_LINE_MAX];
+    pthread_mutex_lock(&probe_lock);
+    size_t len = probe_len;
+    memcpy(line, probe_line, len);
+    time_t updated = probe_updated;
+    pthread_mutex_unlock(&probe_lock);
+    if (time(NULL) - updated > PROBE_STALE)
+        len = snprintf(line, sizeof(line), "-ERR Not ready, readiness check not responding\r\n");
+    if (send(sock, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        // The prober is gone; nothing to report
+    }
+    close(sock);
+}
+
+/** Internal function that pins the acceptor (the calling thread) and
+ *  sets up the CPUs of session threads, based on the options.
+ */
+static void setup_affinity(void) {
+    cpu_set_t set;
+
+    if (server_options.numa_placement)
+        printf("Found %d NUMA nodes\n", affinity_init());
+
+    if (server_options.worker_cpus) {
+        if (cpuset_parse(server_options.worker_cpus, &worker_set) < 0) {
+            fprintf(stderr, "Invalid CPU list: %s\n", server_options.worker_cpus);
+            exit(1);
+        }
+        pin_workers = 1;
+    } else if (server_options.acceptor_cpus || server_options.numa_placement) {
+        // Threads inherit the affinity of the acceptor, so sessions
+        // get the CPUs the process had before the acceptor is pinned
+        if (sched_getaffinity(0, sizeof(worker_set), &worker_set) == 0)
+            pin_workers = 1;
+    }
+
+    if (server_options.acceptor_cpus) {
+        if (cpuset_parse(server_options.acceptor_cpus, &set) < 0) {
+            fprintf(stderr, "Invalid CPU list: %s\n", server_options.acceptor_cpus);
+            exit(1);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "Could not pin acceptor to CPUs %s\n", server_options.acceptor_cpus);
+    }
+}
+
+/** Internal function that chooses the CPUs a session thread runs on.
+ *  With NUMA placement, the thread runs on the node of the CPU that
+ *  processed the connection's packets, so the session's memory (first
+ *  touched by the thread) is allocated on that node too.
+ */
+static void place_session(pthread_attr_t *attr, int sock) {
+    if (!pin_workers) return;
+
+    cpu_set_t set = worker_set;
+    if (server_options.numa_placement) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        int node = getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 ?
+            affinity_cpu_node(cpu) : -1;
+        if (node < 0) {
+            __atomic_add_fetch(&placed_unknown, 1, __ATOMIC_RELAXED);
+        } else {
+            cpu_set_t node_set;
+            affinity_node_cpus(node, &node_set);
+            CPU_AND(&node_set, &node_set, &worker_set);
+            if (CPU_COUNT(&node_set)) {
+                set = node_set;
+                __atomic_add_fetch(&placed_on_node[node], 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_add_fetch(&placed_fallback, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/** Internal function that creates a socket listening on all interfaces.
+ *
+ *  Parameters: port: Port to listen on.
+ *              type: Flags for the socket type (e.g., SOCK_NONBLOCK).
+ *              reuse: Whether the port may be bound while connections
+ *                     to it are still in TIME_WAIT.
+ *
+ *  Returns: the socket, or -1 in case of error (reported on stderr).
+ */
+static int open_listener(const char *port, int type, int reuse) {
     struct sockaddr_in server_addr;
-    
-    // Set up signal handler to close the server gracefully
-    // Possibly not necessary, but good practice
-    signal(SIGINT, sigint_handler);
 
     // Create the main socket
     // this will be the socket that listens for incoming connections
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
+    int sock = socket(AF_INET, SOCK_STREAM | type, 0);
+    if (sock < 0) {
         perror("Error opening socket");
-        exit(1);
+        return -1;
     }
+    if (reuse)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     //configure the sockaddr_in struct
     server_addr.sin_family = AF_INET; // set to AF_INET to use IPv4
@@ -62,41 +296,341 @@ void run_server(const char *port, void (*handler)(void *)) {
     memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero)); // zero the rest of the struct
 
     // Bind the socket to the address and port
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Error binding socket");
-        exit(1);
+        close(sock);
+        return -1;
     }
-    
+
     printf("Server bound to port %s\n", port);
-    // Listen for incoming connections
-    if (listen(server_socket, 10) < 0) {
+    // Listen for incoming connections; a short backlog drops SYNs when
+    // many clients connect at once, and they only retry after a second
+    if (listen(sock, SOMAXCONN) < 0) {
         perror("Error listening on socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/** Internal function that creates the listening socket for POP3
+ *  connections, exiting if it cannot be created. The socket is
+ *  non-blocking: after an upgrade it is shared with the old server,
+ *  and a connection that both were woken up for must not leave the
+ *  loser blocked in accept, away from probes and the drain request.
+ */
+static int create_listener(const char *port) {
+    int sock = open_listener(port, SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
         exit(1);
+    return sock;
+}
+
+/** Internal function that returns whether a socket listens on a port.
+ */
+static int listens_on(int sock, const char *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(sock, (struct sockaddr *) &addr, &len) == 0 &&
+        addr.sin_family == AF_INET && ntohs(addr.sin_port) == atoi(port);
+}
+
+/** Internal function that sets up the health probe listener and starts
+ *  the thread keeping its status line up to date. Without a listener,
+ *  the server runs without health probes.
+ *
+ *  Parameters: port: Port to answer probes on.
+ *              sock: Probe listener taken over from the server being
+ *                    replaced, or -1. Used if it listens on port.
+ */
+static void start_probe_listener(const char *port, int sock) {
+    pthread_t thread;
+    probe_updated = time(NULL);
+    probe_len = snprintf(probe_line, sizeof(probe_line), "-ERR Starting\r\n");
+    if (sock >= 0 && listens_on(sock, port)) {
+        printf("Took over probe socket from running server\n");
+        probe_socket = sock;
+    } else {
+        if (sock >= 0)
+            close(sock);
+        // Non-blocking, since a server the listener is handed over to
+        // may take a probe this one was woken up for. This side closes
+        // probe connections, which leaves them in TIME_WAIT on the port.
+        probe_socket = open_listener(port, SOCK_NONBLOCK | SOCK_CLOEXEC, 1);
+    }
+    if (probe_socket < 0) {
+        fprintf(stderr, "Health probes disabled\n");
+        return;
+    }
+    if (pthread_create(&thread, NULL, probe_thread, NULL) != 0) {
+        perror("Error creating probe thread");
+        close(probe_socket);
+        probe_socket = -1;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static void upgrade_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+/** Internal function that asks a running server for its listening
+ *  sockets, through the upgrade socket at path. The running server
+ *  passes the descriptors with SCM_RIGHTS and starts draining.
+ *
+ *  Parameters: path: Path of the upgrade socket.
+ *              probe: Set to the health probe listener of the running
+ *                     server, or -1 if it has none.
+ *
+ *  Returns: the listening socket, or -1 if no server answered.
+ */
+static int receive_listener(const char *path, int *probe) {
+    *probe = -1;
+    struct sockaddr_un addr;
+    upgrade_address(&addr, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    char byte;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    int fd = -1;
+    if (send(sock, "U", 1, MSG_NOSIGNAL) == 1 && recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            // The probe listener follows, if the server has one
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (cmsg->cmsg_len >= CMSG_LEN(2 * sizeof(int)))
+                memcpy(probe, CMSG_DATA(cmsg) + sizeof(int), sizeof(int));
+        }
     }
-    
-    // Accept incoming connections
+    close(sock);
+    return fd;
+}
+
+/** Internal thread that waits for a new server process on the upgrade
+ *  socket, hands it the listening sockets and starts draining.
+ */
+static void *upgrade_thread(void *arg) {
+    int listener = *(int *) arg;
+    free(arg);
+
     while (1) {
+        int sock = accept(listener, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            perror("Error accepting upgrade connection");
+            return NULL;
+        }
+
+        char byte;
+        int fds[2] = { server_socket, probe_socket };
+        int nfds = probe_socket >= 0 ? 2 : 1;
+        union {
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct iovec iov = { .iov_base = "L", .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+        int sent = recv(sock, &byte, 1, 0) == 1 && sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+        close(sock);
+        if (sent) {
+            printf("Listening socket handed over to new server, draining\n");
+            close(listener);
+            server_drain();
+            return NULL;
+        }
+    }
+}
+
+/** Internal function that creates the upgrade socket, on which a new
+ *  server process can ask for the listening socket. Whoever connects
+ *  gets the socket and makes this server drain, so only the user
+ *  running the server may connect.
+ */
+static void start_upgrade_listener(const char *path) {
+    struct sockaddr_un addr;
+    upgrade_address(&addr, path);
+    // A previous server (or the one being replaced) may have left the
+    // socket file behind
+    unlink(path);
+
+    int *listener = malloc(sizeof(int));
+    if (!listener) {
+        fprintf(stderr, "Error creating upgrade socket: out of memory\n");
+        return;
+    }
+    *listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    pthread_t thread;
+    if (*listener < 0 ||
+        bind(*listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 ||
+        listen(*listener, 1) < 0 ||
+        pthread_create(&thread, NULL, upgrade_thread, listener) != 0) {
+        perror("Error creating upgrade socket");
+        if (*listener >= 0) close(*listener);
+        free(listener);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/** Internal function that waits for the current sessions to end, then
+ *  exits the process.
+ */
+static void drain_and_exit(void) {
+    close(server_socket);
+    // Unless the listener was handed over to a new server, probes are
+    // refused, so load balancers stop sending clients
+    if (probe_socket >= 0)
+        close(probe_socket);
+    time_t deadline = time(NULL) + server_options.drain_timeout;
+    int remaining;
+    while ((remaining = __atomic_load_n(&active_sessions, __ATOMIC_ACQUIRE)) > 0 &&
+           time(NULL) < deadline)
+        poll(NULL, 0, DRAIN_POLL_INTERVAL_MS);
+    printf("Server drained, %d sessions still active, exiting\n", remaining);
+    exit(0);
+}
+
+/* TODO: Fill in the server code. You are required to listen on all interfaces for connections. For each connection,
+ * invoke the handler on a new thread. */
+void run_server(const char *port, void (*handler)(void *)) {
+    session_handler = handler;
+
+    // Set up signal handler to close the server gracefully
+    // Possibly not necessary, but good practice
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigterm_handler);
+    if (pipe(wake_pipe) < 0) {
+        perror("Error creating pipe");
+        exit(1);
+    }
+
+    setup_affinity();
+
+    // If another server is running, take over its listening sockets
+    // instead of binding new ones, so no connection or probe is refused
+    int probe = -1;
+    server_socket = -1;
+    if (server_options.upgrade_path) {
+        server_socket = receive_listener(server_options.upgrade_path, &probe);
+        if (server_socket >= 0) {
+            // An older server may have handed over a blocking socket
+            fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+            printf("Took over listening socket from running server\n");
+        }
+    }
+    if (server_socket < 0)
+        server_socket = create_listener(port);
+    // The probe listener must exist before it can be handed over
+    if (server_options.probe_port)
+        start_probe_listener(server_options.probe_port, probe);
+    else if (probe >= 0)
+        close(probe);
+    if (server_options.upgrade_path)
+        start_upgrade_listener(server_options.upgrade_path);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (server_options.stack_size) {
+        size_t stack_size = server_options.stack_size;
+        if (stack_size < SESSION_STACK_MIN)
+            stack_size = SESSION_STACK_MIN;
+        if (pthread_attr_setstacksize(&attr, stack_size) != 0)
+            perror("Error setting thread stack size");
+    }
+
+    if (server_options.report_interval > 0) {
+        // Memory used before any session, so the report only counts
+        // what sessions add to it
+        size_t *baseline = malloc(sizeof(size_t));
+        *baseline = resident_bytes();
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, report_thread, baseline) == 0)
+            pthread_detach(thread);
+        else
+            free(baseline);
+    }
+
+    // Accept incoming connections; probes are answered in between
+    struct pollfd fds[3] = {
+        { .fd = server_socket, .events = POLLIN },
+        { .fd = wake_pipe[0], .events = POLLIN },
+        { .fd = probe_socket, .events = POLLIN },
+    };
+    while (!draining) {
+        if (poll(fds, 3, -1) < 0)
+            continue;
+        if (fds[2].revents & POLLIN)
+            answer_probe();
+        if (!(fds[0].revents & POLLIN))
+            continue;
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+        // Session sockets are non-blocking, so sends to clients that
+        // stop reading can be given up (see send_guard)
+        int client_socket = accept4(server_socket, (struct sockaddr *)&client_addr, &client_addr_len,
+                                    SOCK_NONBLOCK);
         if (client_socket < 0) {
-            perror("Error accepting connection");
+            // Another process sharing the socket may have taken it;
+            // the socket is non-blocking, so go back to polling
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Error accepting connection");
             continue;
         }
-        printf("Connection accepted from %s\n", inet_ntoa(client_addr.sin_addr));
+        trace_accepted(client_socket);
+        // Responses are written as a status line followed by the body;
+        // with Nagle's algorithm, the body waits for the client's
+        // delayed ACK of the status line
+        int one = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        printf("Connection accepted from %s\n", client_ip);
         
         // Create a new thread to handle the connection
+        // The socket is passed in the pointer itself, so nothing has
+        // to be allocated for (or freed by) the thread
         pthread_t thread;
-        int *client_socket_ptr = malloc(sizeof(int));
-        *client_socket_ptr = client_socket;
-        if (pthread_create(&thread, NULL, (void *(*)(void *))handler, client_socket_ptr) != 0) {
+        place_session(&attr, client_socket);
+        __atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&thread, &attr, session_main, (void *) (intptr_t) client_socket) != 0) {
             perror("Error creating thread");
+            __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
             close(client_socket);
-            free(client_socket_ptr);
-        } else {
-            pthread_detach(thread);
         }
     }
+    drain_and_exit();
 }
-
-
@@ -12,6 +12,40 @@
 
 #include <stdio.h>
 
+struct server_options {
+    // UNIX socket on which a new server process can take over the
+    // listening sockets, including the probe port's (NULL disables
+    // upgrades)
+    const char *upgrade_path;
+    // Seconds to wait for sessions to end once the server is draining
+    int drain_timeout;
+    // Stack size for session threads, in bytes (0 uses the default)
+    size_t stack_size;
+    // If non-zero, memory use per session is reported every
+    // report_interval seconds
+    int report_interval;
+    // CPU lists (e.g., "0-3,8") for the thread accepting connections
+    // and for session threads (NULL does not pin threads)
+    const char *acceptor_cpus;
+    const char *worker_cpus;
+    // If non-zero, each session thread runs on the NUMA node of the
+    // CPU that received the connection (SO_INCOMING_CPU)
+    int numa_placement;
+    // Port on which health probes are answered with a status line
+    // (NULL disables it), and the number of sessions from which the
+    // server reports itself busy (0 never does)
+    const char *probe_port;
+    int busy_sessions;
+    // Checks whether the server can serve sessions (e.g., the mail
+    // store is reachable), returning 0 if so; run in the background
+    int (*ready_check)(void);
+};
+
+extern struct server_options server_options;
+
+// The handler receives the client socket cast to a pointer, to be
+// retrieved with (int) (intptr_t) arg. The socket is non-blocking.
 void run_server(const char *port, void (*handler)(void *));
+void server_drain(void);
 
 #endif
@@ -24,8 +24,10 @@ for i in $pattern ; do
     if [ -d $inmailstore ] ; then
         cp -pr $inmailstore mail.store
     fi
+    # Options for the server, e.g., to disable the message cache
+    args=$(cat $i.args 2>/dev/null)
     pkill mypopd
-    ./mypopd $port >& $logfile &
+    ./mypopd $args $port >& $logfile &
     sleep 1
     nc localhost $port -w 3 < $i > $outfile
     sleep 1
@@ -0,0 +1,134 @@
+/* timerwheel.c
+ * Hierarchical timer wheel. The first level has one slot per tick;
+ * each following level has slots covering a whole revolution of the
+ * level below it. Timers far in the future are kept in a coarse slot
+ * and moved down a level when the wheel below comes around to them,
+ * so every timer is moved at most once per level.
+ */
+
+#include "timerwheel.h"
+
+#include <stdlib.h>
+
+#define TW_LEVELS 3
+#define TW_BITS   6
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_MASK   (TW_SLOTS - 1)
+// Longest delay that can be represented; later timers are clamped
+#define TW_MAX_DELAY (((time_t) 1 << (TW_LEVELS * TW_BITS)) - 1)
+
+struct timer_wheel {
+    time_t now;
+    struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+/** Creates a timer wheel with no pending timers.
+ *
+ *  Parameters: now: current time, in ticks.
+ */
+timer_wheel_t tw_create(time_t now) {
+    timer_wheel_t wheel = calloc(1, sizeof(struct timer_wheel));
+    if (wheel) wheel->now = now;
+    return wheel;
+}
+
+/** Frees a timer wheel. Pending timers are not modified.
+ */
+void tw_destroy(timer_wheel_t wheel) {
+    free(wheel);
+}
+
+static void slot_push(struct tw_timer **slot, struct tw_timer *timer) {
+    timer->next = *slot;
+    if (*slot) (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/** Schedules a timer. If the timer is already pending, it is
+ *  rescheduled.
+ *
+ *  Parameters: wheel: timer wheel.
+ *              timer: timer to be scheduled.
+ *              expires: time, in ticks, when the timer expires. Times
+ *                       in the past expire on the next tick.
+ */
+void tw_add(timer_wheel_t wheel, struct tw_timer *timer, time_t expires) {
+    tw_remove(timer);
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    if (expires - wheel->now > TW_MAX_DELAY)
+        expires = wheel->now + TW_MAX_DELAY;
+    timer->expires = expires;
+
+    time_t delta = expires - wheel->now;
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= ((time_t) 1 << ((level + 1) * TW_BITS)))
+        level++;
+    slot_push(&wheel->slots[level][(expires >> (level * TW_BITS)) & TW_MASK], timer);
+}
+
+/** Cancels a timer. Does nothing if the timer is not pending.
+ */
+void tw_remove(struct tw_timer *timer) {
+    if (!timer->pprev) return;
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/** Returns non-zero if a timer is scheduled. Timers must be zeroed
+ *  before their first use.
+ */
+int tw_pending(struct tw_timer *timer) {
+    return timer->pprev != NULL;
+}
+
+/** Internal function that detaches all timers of a slot.
+ */
+static struct tw_timer *slot_take(struct tw_timer **slot) {
+    struct tw_timer *list = *slot;
+    *slot = NULL;
+    return list;
+}
+
+/** Advances the wheel to the given time, calling a function for every
+ *  timer that expires on the way. The function may schedule the timer
+ *  again.
+ *
+ *  Parameters: wheel: timer wheel.
+ *              now: current time, in ticks.
+ *              expired: function called for each expired timer.
+ *              arg: passed to expired.
+ */
+void tw_advance(timer_wheel_t wheel, time_t now, tw_callback_t expired, void *arg) {
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // Move timers down from higher levels whose slot has come up
+        for (int level = TW_LEVELS - 1; level > 0; level--) {
+            if (wheel->now & (((time_t) 1 << (level * TW_BITS)) - 1))
+                continue;
+            struct tw_timer *list = slot_take(&wheel->slots[level][(wheel->now >> (level * TW_BITS)) & TW_MASK]);
+            while (list) {
+                struct tw_timer *timer = list;
+                list = timer->next;
+                timer->pprev = NULL;
+                if (timer->expires <= wheel->now)
+                    slot_push(&wheel->slots[0][wheel->now & TW_MASK], timer);
+                else
+                    tw_add(wheel, timer, timer->expires);
+            }
+        }
+
+        struct tw_timer *list = slot_take(&wheel->slots[0][wheel->now & TW_MASK]);
+        while (list) {
+            struct tw_timer *timer = list;
+            list = timer->next;
+            timer->next = NULL;
+            timer->pprev = NULL;
+            expired(timer, arg);
+        }
+    }
+}
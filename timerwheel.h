@@ -0,0 +1,31 @@
+/* timerwheel.h
+ * Hierarchical timer wheel. Timers are added, removed and expired in
+ * constant time, regardless of how many timers are pending. Times are
+ * measured in ticks (e.g., seconds).
+ *
+ * A timer wheel is not thread-safe; callers that share one between
+ * threads must serialize access to it.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <time.h>
+
+struct tw_timer {
+    time_t expires;
+    struct tw_timer *next;
+    struct tw_timer **pprev;
+};
+
+typedef struct timer_wheel *timer_wheel_t;
+typedef void (*tw_callback_t)(struct tw_timer *timer, void *arg);
+
+timer_wheel_t tw_create(time_t now);
+void          tw_destroy(timer_wheel_t wheel);
+void          tw_add(timer_wheel_t wheel, struct tw_timer *timer, time_t expires);
+void          tw_remove(struct tw_timer *timer);
+int           tw_pending(struct tw_timer *timer);
+void          tw_advance(timer_wheel_t wheel, time_t now, tw_callback_t expired, void *arg);
+
+#endif
@@ -0,0 +1,273 @@
+/* tls.c
+ * TLS support for connections upgraded with STLS, based on OpenSSL.
+ *
+ * The TLS state of a connection is found through its socket
+ * descriptor, in a table indexed by descriptor number. Each entry is
+ * only used by the thread handling that connection, so lookups need
+ * no locking.
+ */
+
+#include "tls.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_OPENSSL
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_SESSION_CACHE_SIZE 20000
+#define TLS_SESSION_TIMEOUT    3600
+
+struct tls_conn {
+    SSL *ssl;
+    int ktls_send;
+    int ktls_recv;
+};
+
+static SSL_CTX *tls_ctx;
+static struct tls_conn **tls_conns;
+static size_t tls_max_fd;
+
+/** Loads the server certificate and key, and prepares the server for
+ *  TLS connections. Kernel TLS offload is requested, and resumed
+ *  sessions are supported both through session tickets and through a
+ *  server-side session cache, so clients that reconnect often skip
+ *  the full handshake.
+ *
+ *  Parameters: certfile: PEM file with the certificate chain.
+ *              keyfile: PEM file with the private key.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int tls_init(const char *certfile, const char *keyfile) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return -1;
+    tls_max_fd = limit.rlim_cur;
+    tls_conns = calloc(tls_max_fd, sizeof(struct tls_conn *));
+    if (!tls_conns)
+        return -1;
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx ||
+        SSL_CTX_use_certificate_chain_file(tls_ctx, certfile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    // OpenSSL writes to the socket without MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+    // Writes that could not proceed on a non-blocking socket are
+    // retried by tls_sendv with the same data in a new buffer
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char *) "mypopd", 6);
+    return 0;
+}
+
+/** Returns non-zero if tls_init was successful.
+ */
+int tls_available(void) {
+    return tls_ctx != NULL;
+}
+
+/** Internal function that returns -1 for an OpenSSL call that failed,
+ *  with errno set to EAGAIN if the call only has to be retried once the
+ *  socket is ready, as happens with non-blocking sockets.
+ */
+static int ssl_failed(SSL *ssl, int rv) {
+    int error = SSL_get_error(ssl, rv);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+        errno = EAGAIN;
+    return -1;
+}
+
+/** Internal function that runs the handshake, waiting for the socket
+ *  whenever OpenSSL cannot proceed. A client that stops responding is
+ *  closed by the idle reaper, which ends the wait.
+ */
+static int tls_accept(SSL *ssl, int fd) {
+    int rv;
+    while ((rv = SSL_accept(ssl)) != 1) {
+        int error = SSL_get_error(ssl, rv);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+            return -1;
+        struct pollfd pfd = { .fd = fd, .events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/** Performs the server side of the TLS handshake on a connection.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *
+ *  Returns: 0 on success, -1 in case of error.
+ */
+int tls_start(int fd) {
+    if (!tls_ctx || fd < 0 || fd >= tls_max_fd || tls_conns[fd])
+        return -1;
+
+    struct tls_conn *conn = calloc(1, sizeof(struct tls_conn));
+    if (!conn)
+        return -1;
+    conn->ssl = SSL_new(tls_ctx);
+    if (!conn->ssl || SSL_set_fd(conn->ssl, fd) != 1 || tls_accept(conn->ssl, fd) < 0) {
+        dlog("%x: TLS handshake failed\n", fd);
+        if (conn->ssl) SSL_free(conn->ssl);
+        free(conn);
+        return -1;
+    }
+    conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+    conn->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(conn->ssl));
+    dlog("%x: TLS established (%s%s, kTLS send %s, receive %s)\n", fd,
+         SSL_get_version(conn->ssl), SSL_session_reused(conn->ssl) ? ", resumed" : "",
+         conn->ktls_send ? "on" : "off", conn->ktls_recv ? "on" : "off");
+    tls_conns[fd] = conn;
+    return 0;
+}
+
+/** Returns non-zero if a connection has been upgraded to TLS.
+ */
+int tls_active(int fd) {
+    return tls_conns && fd >= 0 && fd < tls_max_fd && tls_conns[fd];
+}
+
+/** Shuts down TLS on a connection and frees its state. Must be called
+ *  before the socket is closed.
+ */
+void tls_end(int fd) {
+    if (!tls_active(fd))
+        return;
+    struct tls_conn *conn = tls_conns[fd];
+    tls_conns[fd] = NULL;
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    free(conn);
+}
+
+/** Sends data on a connection, encrypting it if the connection has
+ *  been upgraded to TLS. With kernel TLS offload, data is handed to
+ *  the socket as is. The flags are ignored if OpenSSL does the
+ *  encryption, which is why tls_init ignores SIGPIPE.
+ *
+ *  Returns: number of bytes sent, or -1 in case of error (with errno
+ *           EAGAIN if a non-blocking socket is not ready).
+ */
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags) {
+    if (!tls_active(fd) || tls_conns[fd]->ktls_send)
+        return send(fd, buf, len, flags);
+    size_t written;
+    int rv = SSL_write_ex(tls_conns[fd]->ssl, buf, len, &written);
+    return rv == 1 ? written : ssl_failed(tls_conns[fd]->ssl, rv);
+}
+
+/** Sends a list of segments to a connection, like sendmsg, encrypting
+ *  it if the connection has been upgraded to TLS. Without kernel
+ *  offload, the segments are copied into one buffer, so that they are
+ *  sent in as few TLS records as possible. Like tls_send, signals are
+ *  not raised if the connection is closed.
+ *
+ *  Returns: number of bytes sent, or -1 in case of error.
+ */
+ssize_t tls_sendv(int fd, const struct iovec *iov, int iovcnt) {
+    if (!tls_active(fd) || tls_conns[fd]->ktls_send) {
+        struct msghdr msg = { .msg_iov = (struct iovec *) iov, .msg_iovlen = iovcnt };
+        return sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    size_t len = 0, written;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    char *buf = malloc(len), *p = buf;
+    if (!buf) return -1;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    int rv = SSL_write_ex(tls_conns[fd]->ssl, buf, len, &written);
+    free(buf);
+    return rv == 1 ? written : ssl_failed(tls_conns[fd]->ssl, rv);
+}
+
+/** Receives data from a connection, decrypting it if the connection
+ *  has been upgraded to TLS. The flags are ignored for TLS connections.
+ *
+ *  Returns: number of bytes received, 0 if the connection was closed,
+ *           or -1 in case of error (with errno EAGAIN if a
+ *           non-blocking socket is not ready).
+ */
+ssize_t tls_recv(int fd, void *buf, size_t len, int flags) {
+    // Even with kernel offload, reads go through OpenSSL, which handles
+    // any non-data records (e.g., alerts) sent by the client.
+    if (!tls_active(fd))
+        return recv(fd, buf, len, flags);
+    size_t got;
+    SSL *ssl = tls_conns[fd]->ssl;
+    int rv = SSL_read_ex(ssl, buf, len, &got);
+    if (rv == 1)
+        return got;
+    return SSL_get_error(ssl, rv) == SSL_ERROR_ZERO_RETURN ? 0 : ssl_failed(ssl, rv);
+}
+
+/** Returns non-zero if data received on a TLS connection is buffered
+ *  by OpenSSL, so tls_recv can return without the socket being
+ *  readable.
+ */
+int tls_pending(int fd) {
+    return tls_active(fd) && SSL_has_pending(tls_conns[fd]->ssl);
+}
+
+#else
+
+int tls_init(const char *certfile, const char *keyfile) {
+    fprintf(stderr, "TLS support not available in this build\n");
+    return -1;
+}
+
+int tls_available(void) {
+    return 0;
+}
+
+int tls_start(int fd) {
+    return -1;
+}
+
+int tls_active(int fd) {
+    return 0;
+}
+
+void tls_end(int fd) {
+}
+
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags) {
+    return send(fd, buf, len, flags);
+}
+
+ssize_t tls_sendv(int fd, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg = { .msg_iov = (struct iovec *) iov, .msg_iovlen = iovcnt };
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t tls_recv(int fd, void *buf, size_t len, int flags) {
+    return recv(fd, buf, len, flags);
+}
+
+int tls_pending(int fd) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+/* tls.h
+ * TLS support for connections upgraded with STLS (RFC 2595). Once a
+ * connection is upgraded, all data sent or received on its socket
+ * must go through tls_send and tls_recv. When the kernel supports TLS
+ * offload (kTLS), encryption happens in the kernel and these calls go
+ * straight to the socket.
+ *
+ * TLS is chosen at build time (see TLS in the Makefile). Without it,
+ * tls_init fails and tls_send/tls_recv are plain send/recv.
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+int     tls_init(const char *certfile, const char *keyfile);
+int     tls_available(void);
+int     tls_start(int fd);
+int     tls_active(int fd);
+void    tls_end(int fd);
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags);
+ssize_t tls_sendv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t tls_recv(int fd, void *buf, size_t len, int flags);
+int     tls_pending(int fd);
+
+#endif
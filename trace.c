@@ -0,0 +1,163 @@
+/* trace.c
+ * Opt-in tracing of session phases, in the Chrome trace-event format.
+ *
+ * Events are kept in a buffer owned by the session thread, and only
+ * written out (under a lock) when the buffer is full or the session
+ * ends. The output is a JSON array of complete ("X") events, with the
+ * session number as thread id. The array is never closed, which trace
+ * viewers accept, so the file is valid even if the server is killed.
+ *
+ * The time a connection was accepted is kept in a table indexed by
+ * socket descriptor, so the delay between accept and the start of
+ * the session thread can be traced.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define TRACE_BUFFER_EVENTS 128
+
+struct trace_record {
+    const char *name;
+    const char *category;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct trace_buffer {
+    int count;
+    struct trace_record records[TRACE_BUFFER_EVENTS];
+};
+
+__thread uint64_t trace_session;
+static __thread struct trace_buffer *trace_buffer;
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+// Sessions are traced if a hash of their number is below this value
+static uint32_t trace_threshold;
+static uint64_t trace_next_session;
+static uint64_t *trace_accept_times;
+static size_t trace_max_fd;
+static pid_t trace_pid;
+
+/** Starts tracing sessions to a file.
+ *
+ *  Parameters: path: File the trace is written to (replaced if it
+ *                    exists).
+ *              sample_rate: Fraction of sessions to be traced, from 0
+ *                           (none) to 1 (all).
+ *
+ *  Returns: 0 on success, -1 if the file cannot be created.
+ */
+int trace_init(const char *path, double sample_rate) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return -1;
+    trace_max_fd = limit.rlim_cur;
+    trace_accept_times = calloc(trace_max_fd, sizeof(uint64_t));
+    trace_file = fopen(path, "w");
+    if (!trace_file || !trace_accept_times)
+        return -1;
+
+    if (sample_rate >= 1)
+        trace_threshold = UINT32_MAX;
+    else if (sample_rate > 0)
+        trace_threshold = sample_rate * UINT32_MAX;
+    trace_pid = getpid();
+    fprintf(trace_file, "[\n");
+    fflush(trace_file);
+    return 0;
+}
+
+/** Returns the current time, in nanoseconds, on the clock used for
+ *  trace events.
+ */
+uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Records the time a connection was accepted. Called by the thread
+ *  accepting connections, before the session thread is started.
+ */
+void trace_accepted(int fd) {
+    if (trace_file && fd >= 0 && fd < trace_max_fd)
+        trace_accept_times[fd] = trace_now();
+}
+
+/** Internal function that writes the buffered events of the current
+ *  thread to the trace file.
+ */
+static void trace_flush(void) {
+    struct trace_buffer *buffer = trace_buffer;
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < buffer->count; i++) {
+        struct trace_record *r = &buffer->records[i];
+        fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%llu},\n",
+                r->name, r->category,
+                (unsigned long long) (r->start / 1000), (unsigned long long) (r->start % 1000),
+                (unsigned long long) ((r->end - r->start) / 1000),
+                (unsigned long long) ((r->end - r->start) % 1000),
+                (int) trace_pid, (unsigned long long) trace_session);
+    }
+    fflush(trace_file);
+    pthread_mutex_unlock(&trace_lock);
+    buffer->count = 0;
+}
+
+/** Starts a session on the current thread, and decides whether it is
+ *  traced. If it is, the time between accept and this call is
+ *  recorded as the "accept" phase.
+ *
+ *  Parameters: fd: Socket of the session.
+ */
+void trace_session_begin(int fd) {
+    trace_session = 0;
+    if (!trace_file || !trace_threshold) return;
+
+    uint64_t session = __atomic_add_fetch(&trace_next_session, 1, __ATOMIC_RELAXED);
+    // Multiplicative hash, so sampled sessions are spread evenly
+    uint32_t hash = (uint32_t) ((session * 0x9E3779B97F4A7C15ull) >> 32);
+    if (hash > trace_threshold) return;
+
+    if (!trace_buffer && !(trace_buffer = malloc(sizeof(struct trace_buffer))))
+        return;
+    trace_buffer->count = 0;
+    trace_session = session;
+    if (fd >= 0 && fd < trace_max_fd && trace_accept_times[fd])
+        trace_record("accept", "session", trace_accept_times[fd]);
+}
+
+/** Ends the session on the current thread, writing out its events.
+ */
+void trace_session_end(void) {
+    if (!trace_session) return;
+    trace_flush();
+    free(trace_buffer);
+    trace_buffer = NULL;
+    trace_session = 0;
+}
+
+/** Records a phase of the current session. Use trace_event instead,
+ *  which skips sessions that are not traced.
+ */
+void trace_record(const char *name, const char *category, uint64_t start) {
+    if (!trace_session) return;
+    struct trace_buffer *buffer = trace_buffer;
+    struct trace_record *r = &buffer->records[buffer->count++];
+    r->name = name;
+    r->category = category;
+    r->start = start;
+    r->end = trace_now();
+    if (buffer->count == TRACE_BUFFER_EVENTS)
+        trace_flush();
+}
@@ -0,0 +1,42 @@
+/* trace.h
+ * Opt-in tracing of session phases, written in the Chrome trace-event
+ * JSON format (viewable in Perfetto or chrome://tracing). Each traced
+ * session appears as its own track, with one event per phase.
+ *
+ * Only a sampled fraction of sessions is traced. For other sessions
+ * (or when tracing is off), trace_start returns 0 and trace_event does
+ * nothing, so the calls can stay in the code at almost no cost.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// Non-zero while the current thread handles a traced session
+extern __thread uint64_t trace_session;
+
+int      trace_init(const char *path, double sample_rate);
+void     trace_accepted(int fd);
+void     trace_session_begin(int fd);
+void     trace_session_end(void);
+uint64_t trace_now(void);
+void     trace_record(const char *name, const char *category, uint64_t start);
+
+/** Returns the start time of a phase in the current session, or 0 if
+ *  the session is not traced.
+ */
+static inline uint64_t trace_start(void) {
+    return trace_session ? trace_now() : 0;
+}
+
+/** Records a phase of the current session that started at start (as
+ *  returned by trace_start) and ends now. The name and category must
+ *  be string constants.
+ */
+static inline void trace_event(const char *name, const char *category, uint64_t start) {
+    if (start)
+        trace_record(name, category, start);
+}
+
+#endif
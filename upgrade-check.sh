@@ -0,0 +1,74 @@
+#!/bin/bash
+# Checks that mypopd keeps answering health probes while another
+# process accepts connections on the same listening socket, as the
+# server being replaced does during an upgrade (mypopd -u). A stand-in
+# for that server creates the POP3 listener, hands it over through the
+# upgrade socket and keeps accepting on it. Clients then connect one at
+# a time, and a probe is sent after each: whichever process takes a
+# client, the probe must be answered. Exits with a non-zero status if
+# a probe goes unanswered.
+#
+# Usage: ./upgrade-check.sh [clients]
+
+clients=${1:-200}
+src=$(pwd)
+port=$(expr $$ % 20000 + 30000)
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+cp users.txt $dir/
+cd $dir
+python3 - $src/mypopd $port $(expr $port + 1) $clients <<'EOF'
+import array, select, socket, subprocess, sys, threading, time
+
+mypopd, port, probe_port, clients = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4])
+
+# The stand-in for the running server
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("", port))
+listener.listen(64)
+upgrade = socket.socket(socket.AF_UNIX)
+upgrade.bind("upgrade.sock")
+upgrade.listen(1)
+
+def hand_over():
+    conn, _ = upgrade.accept()
+    conn.recv(1)
+    conn.sendmsg([b"L"], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, array.array("i", [listener.fileno()]))])
+    conn.close()
+    # Unlike a real server, the stand-in never drains. It polls the
+    # listener without sleeping, so it often takes a client after
+    # mypopd was woken up for it. (The listener itself must be left
+    # as mypopd set it: both processes share its file status flags.)
+    while True:
+        if select.select([listener], [], [], 0)[0]:
+            try:
+                listener.accept()[0].close()
+            except BlockingIOError:
+                pass
+
+threading.Thread(target=hand_over, daemon=True).start()
+server = subprocess.Popen([mypopd, "-u", "upgrade.sock", "-P", str(probe_port), str(port)],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+time.sleep(1)
+
+failed = 0
+sessions = []
+for i in range(clients):
+    sessions.append(socket.create_connection(("127.0.0.1", port)))
+    try:
+        probe = socket.create_connection(("127.0.0.1", probe_port), timeout=2)
+        line = probe.recv(100)
+        probe.close()
+    except OSError:
+        line = b""
+    if not line.startswith(b"+OK"):
+        print("Probe %d not answered: %r" % (i + 1, line))
+        failed = 1
+        break
+
+server.kill()
+print("Probes answered while sharing the listener: %s" % ("no" if failed else "yes"))
+sys.exit(failed)
+EOF
@@ -1,9 +1,20 @@
 #include "util.h"
+#include "tls.h"
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#define SEND_FORMATTED_BUFSIZE 512
+#define DLOG_BUFSIZE 512
+// How often a send waiting for a slow client checks its progress
+#define SEND_GUARD_CHECK_MS 1000
 
 /** Remove any leading and trailing < > brackets around name
  *
@@ -36,15 +47,60 @@ char *trim_angle_brackets(char *name) {
  *                      parts of the line.
  **/
 int split(char *buf, char *parts[]) {
-    static char *spaces = " \t\r\n";
+    static const char spaces[] = " \t\r\n";
+    char *saveptr;
     int i = 1;
-    parts[0] = strtok(buf, spaces);
+    parts[0] = strtok_r(buf, spaces, &saveptr);
     do {
-        parts[i] = strtok(NULL, spaces);
+        parts[i] = strtok_r(NULL, spaces, &saveptr);
     } while (parts[i++] != NULL);
     return i - 1;
 }
 
+/**
+ *  Split a line into at most max - 1 parts separated by white space,
+ *  followed by a NULL pointer. Anything after the last part is
+ *  ignored.
+ *
+ *  Parameters: line:   The line of text to split
+ *                      The characters in the line will be modified by the call.
+ *              parts:  An array of at least max char * pointers
+ *              max:    Number of entries in parts
+ *
+ *  Returns: The number of parts stored (not counting the NULL pointer).
+ **/
+int split_max(char *buf, char *parts[], int max) {
+    static const char spaces[] = " \t\r\n";
+    char *saveptr;
+    int i = 0;
+    parts[0] = strtok_r(buf, spaces, &saveptr);
+    while (parts[i] != NULL && i < max - 1)
+        parts[++i] = strtok_r(NULL, spaces, &saveptr);
+    parts[i] = NULL;
+    return i;
+}
+
+/** Internal function that formats a string into a buffer, or into
+ *  memory from the heap if it does not fit.
+ *
+ *  Returns: The formatted string, which must be freed if it is not
+ *           buf, or NULL in case of error. Its length is stored in len.
+ */
+static char *format_string(char *buf, size_t size, int *len, const char *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    *len = vsnprintf(buf, size, fmt, copy);
+    va_end(copy);
+    if (*len < 0)
+        return NULL;
+    if (*len >= size) {
+        buf = malloc(*len + 1);
+        if (buf)
+            vsnprintf(buf, *len + 1, fmt, args);
+    }
+    return buf;
+}
+
 int be_verbose = 1;
 
 /**
@@ -52,48 +108,144 @@ int be_verbose = 1;
  *
  * Parameters: fmt:     A printf-line formating string
  *
+ * The message is written with a single write call instead of through
+ * stdio, so sessions logging at the same time do not wait for each
+ * other's stream lock and lines are not interleaved.
  **/
 void dlog(const char *fmt, ...) {
+    char stackbuf[DLOG_BUFSIZE];
     va_list args;
-    if (be_verbose) {
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
+    int len;
+    if (!__atomic_load_n(&be_verbose, __ATOMIC_RELAXED))
+        return;
+    va_start(args, fmt);
+    char *buf = format_string(stackbuf, sizeof(stackbuf), &len, fmt, args);
+    va_end(args);
+    if (!buf)
+        return;
+    if (write(STDERR_FILENO, buf, len) < 0) {
+        // Nowhere left to report it
     }
+    if (buf != stackbuf)
+        free(buf);
 }
 
-int send_formatted(int fd, const char *fmt, ...) {
-    int bufsize = 128;
-    char *buf = malloc(bufsize);
-    va_list args;
-    int strsize;
+__thread unsigned long *send_counter;
+__thread void (*send_progress)(void *arg);
+__thread void *send_progress_arg;
+__thread struct send_guard *send_guard;
+static struct send_guard_stats guard_stats;
 
-    // Start with string length, increase later if needed
-    if (bufsize < strlen(fmt) + 1) {
-        bufsize = roundup(strlen(fmt) + 1, 128);
-        buf = realloc(buf, bufsize);
-    }
+/** Returns the number of sends that waited for clients, and of clients
+ *  that send_guard limits disconnected, for all threads.
+ */
+void send_guard_get_stats(struct send_guard_stats *stats) {
+    stats->waits = __atomic_load_n(&guard_stats.waits, __ATOMIC_RELAXED);
+    stats->stalled = __atomic_load_n(&guard_stats.stalled, __ATOMIC_RELAXED);
+    stats->slow = __atomic_load_n(&guard_stats.slow, __ATOMIC_RELAXED);
+}
 
-    while (1) {
+/** Returns the number of bytes sent on a socket that the client has
+ *  not acknowledged yet, or 0 if unknown.
+ */
+size_t unsent_bytes(int fd) {
+    int queued;
+    return ioctl(fd, SIOCOUTQ, &queued) == 0 && queued > 0 ? queued : 0;
+}
+
+/** Internal function that checks the throughput limit of a guard. The
+ *  data the client has read is what was sent in the window, less what
+ *  is still queued in the socket.
+ */
+static int too_slow(struct send_guard *guard, int fd, time_t now, size_t queued) {
+    time_t elapsed = now - guard->window_start;
+    if (!guard->min_rate || elapsed < SEND_GUARD_GRACE)
+        return 0;
+    size_t read = guard->window_bytes + guard->window_queued > queued ?
+        guard->window_bytes + guard->window_queued - queued : 0;
+    if (read >= guard->min_rate * elapsed)
+        return 0;
+    __atomic_add_fetch(&guard_stats.slow, 1, __ATOMIC_RELAXED);
+    dlog("%x: Client reads %zu bytes/s, disconnecting\n", fd, read / elapsed);
+    return 1;
+}
 
-        va_start(args, fmt);
-        strsize = vsnprintf(buf, bufsize, fmt, args);
-        va_end(args);
+/** Internal function that waits until a send that could not proceed
+ *  (EAGAIN) can be retried, within the limits of send_guard. Progress
+ *  is measured by how much of the data queued in the socket the client
+ *  acknowledges, since the socket may only become writable once a
+ *  large part of its buffer is free.
+ *
+ *  Returns: 0 if the socket is writable, -1 if the client is too slow
+ *           (errno is ETIMEDOUT) or in case of error.
+ */
+static int wait_writable(int fd) {
+    struct send_guard *guard = send_guard;
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int rv;
+    __atomic_add_fetch(&guard_stats.waits, 1, __ATOMIC_RELAXED);
+    if (!guard) {
+        while ((rv = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+            ;
+        return rv < 0 ? -1 : 0;
+    }
 
-        if (strsize < 0)
+    time_t now = time(NULL), progress = now;
+    size_t queued = unsent_bytes(fd);
+    if (!guard->window_start) {
+        guard->window_start = now;
+        guard->window_bytes = 0;
+        guard->window_queued = queued;
+    }
+    while (!too_slow(guard, fd, now, queued)) {
+        if ((rv = poll(&pfd, 1, SEND_GUARD_CHECK_MS)) > 0)
+            return 0;
+        if (rv < 0 && errno != EINTR)
             return -1;
+        now = time(NULL);
+        size_t still_queued = unsent_bytes(fd);
+        if (still_queued < queued)
+            progress = now;
+        queued = still_queued;
+        if (guard->timeout > 0 && now - progress >= guard->timeout) {
+            __atomic_add_fetch(&guard_stats.stalled, 1, __ATOMIC_RELAXED);
+            dlog("%x: Client read nothing for %d seconds, disconnecting\n", fd, guard->timeout);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
 
-        // If buffer was enough to fit entire string, send it
-        if (strsize <= bufsize)
-            break;
+/** Internal function that accounts for data sent, for send_counter,
+ *  send_progress and the throughput window of send_guard.
+ */
+static void sent(size_t bytes) {
+    if (send_guard && send_guard->window_start)
+        send_guard->window_bytes += bytes;
+    if (send_counter)
+        __atomic_add_fetch(send_counter, bytes, __ATOMIC_RELAXED);
+    if (send_progress)
+        send_progress(send_progress_arg);
+}
 
-        // Try again with more space
-        bufsize = roundup(strsize, 128);
-        buf = realloc(buf, bufsize);
-    }
+int send_formatted(int fd, const char *fmt, ...) {
+    // Replies are short, so they are normally formatted on the stack;
+    // only longer strings need memory from the heap
+    char stackbuf[SEND_FORMATTED_BUFSIZE];
+    va_list args;
+    int strsize;
+
+    va_start(args, fmt);
+    char *buf = format_string(stackbuf, sizeof(stackbuf), &strsize, fmt, args);
+    va_end(args);
+    if (!buf)
+        return -1;
 
     int sent_size = send_all(fd, buf, strsize);
-    free(buf);
+    if (buf != stackbuf)
+        free(buf);
     return sent_size;
 }
 
@@ -101,16 +253,65 @@ int send_all(int fd, char buf[], size_t size) {
 
     size_t rem = size;
     while (rem > 0) {
-        int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+        int rv = tls_send(fd, buf, rem, MSG_NOSIGNAL);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd) == 0)
+            continue;
         // If there was an error, interrupt sending and returns an error
         if (rv <= 0)
             return rv;
+        sent(rv);
         buf += rv;
         rem -= rv;
     }
     return size;
 }
 
+ssize_t send_all_iov(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t rv = tls_sendv(fd, iov, iovcnt);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd) == 0)
+            continue;
+        if (rv <= 0)
+            return -1;
+        sent(rv);
+        total += rv;
+        // Skips the segments that were sent, and the sent part of the
+        // first one that was not
+        while (iovcnt > 0 && (size_t) rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return total;
+}
+
+size_t format_uint(char *out, unsigned long value) {
+    static const char pairs[] =
+        "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+        "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    char digits[20], *p = digits + sizeof(digits);
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, pairs + 2 * (value % 100), 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, pairs + 2 * value, 2);
+    } else {
+        *--p = '0' + value;
+    }
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(out, p, len);
+    return len;
+}
+
 int roundup(int val, int chunksize) {
     return ((val + chunksize - 1) / chunksize) * chunksize;
 }
@@ -2,6 +2,9 @@
 #define _UTIL_H
 
 #include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /** Remove any leading and trailing < > brackets around name
  *
@@ -29,6 +32,15 @@ extern char *trim_angle_brackets(char *name);
  **/
 extern int   split(char *buf, char *parts[]);
 
+/**
+ *  Split a line into at most max - 1 parts separated by white space,
+ *  followed by a NULL pointer. Anything after the last part is
+ *  ignored.
+ *
+ *  Returns: The number of parts stored (not counting the NULL pointer).
+ **/
+extern int   split_max(char *buf, char *parts[], int max);
+
 extern int   be_verbose;
 /**
  * Print a log message to the standard error stream, if be_verbose is 1
@@ -42,6 +54,43 @@ extern void  dlog(const char *fmt, ...)
 		__attribute__ ((format(printf, 1, 2)));
 
 
+// If set, the number of bytes sent by the calling thread with
+// send_all, send_all_iov and send_formatted is added to this counter
+extern __thread unsigned long *send_counter;
+
+// If set, called with send_progress_arg whenever one of the calling
+// thread's sends hands data to the socket (e.g., to extend an idle
+// timeout while a long response is sent)
+extern __thread void (*send_progress)(void *arg);
+extern __thread void *send_progress_arg;
+
+// Limits on how slowly a client may read data sent on a non-blocking
+// socket. When a send has to wait for the client, it fails once the
+// client acknowledges nothing for timeout seconds, or once it has read
+// less than min_rate bytes per second since sends started waiting
+// (checked after SEND_GUARD_GRACE seconds). The window is restarted by setting
+// window_start to 0, e.g., before each command.
+#define SEND_GUARD_GRACE 30
+struct send_guard {
+    int    timeout;        // 0 waits forever
+    size_t min_rate;       // 0 disables the throughput check
+    time_t window_start;   // when sends started waiting, or 0
+    size_t window_bytes;   // bytes sent since window_start
+    size_t window_queued;  // bytes queued in the socket at window_start
+};
+
+struct send_guard_stats {
+    unsigned long waits;   // sends that had to wait for the client
+    unsigned long stalled; // clients that read nothing before the timeout
+    unsigned long slow;    // clients that read slower than min_rate
+};
+
+// Limits for the calling thread's sends, or NULL for none
+extern __thread struct send_guard *send_guard;
+
+void send_guard_get_stats(struct send_guard_stats *stats);
+size_t unsent_bytes(int fd);
+
 /** Sends a printf-style formatted string to a socket descriptor. The
  *  string can contain format directives (e.g., %d, %s, %u), which
  *  will be translated using the same rules as printf. For example,
@@ -78,11 +127,38 @@ __attribute__ ((format(printf, 2, 3)));
  *              buf: Buffer where data to be sent is stored.
  *              size: Number of bytes to be used in the buffer.
  *
+ *  On non-blocking sockets, waits for the socket to be writable as
+ *  allowed by send_guard.
+ *
  *  Returns: If the buffer was successfully sent, returns
  *           size. Otherwise, returns -1.
  */
 int send_all(int fd, char buf[], size_t size);
 
+/** Sends a list of segments, like send_all, until all data is sent or
+ *  an error is received. The segments may be modified.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              iov: Segments to be sent.
+ *              iovcnt: Number of segments.
+ *
+ *  Returns: If all segments were successfully sent, returns the
+ *           number of bytes sent. Otherwise, returns -1.
+ */
+ssize_t send_all_iov(int fd, struct iovec *iov, int iovcnt);
+
+/** Writes the decimal representation of a number, two digits at a
+ *  time. Used to build large responses (e.g., LIST) without the cost
+ *  of a printf call per number.
+ *
+ *  Parameters: out: Buffer receiving the digits, with space for at
+ *                   least 20 characters. No NUL is added.
+ *              value: Number to be written.
+ *
+ *  Returns: Number of characters written.
+ */
+size_t format_uint(char *out, unsigned long value);
+
 /**
  * return val rounded up to be a multiple of chunksize.
  */
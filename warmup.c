@@ -0,0 +1,137 @@
+/* warmup.c
+ * Background warm-up of maildrop metadata. The users in the mail
+ * store are listed once, then a pool of threads takes them in turn
+ * and reads each maildrop with mail_user_warm. A coordinator thread
+ * reports progress once per second, and the total time at the end.
+ */
+
+#include "warmup.h"
+#include "mailuser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#define WARMUP_MAX_THREADS 64
+#define WARMUP_REPORT_INTERVAL 1
+
+struct warmup {
+    const char **users;
+    size_t nusers;
+    user_list_t list;
+    int nthreads;
+    // Updated atomically by the workers
+    size_t next;
+    size_t done;
+    size_t messages;
+    size_t bytes;
+    // Signalled when the last maildrop is done
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *warmup_worker(void *arg) {
+    struct warmup *w = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->nusers) {
+        size_t bytes;
+        int messages = mail_user_warm(w->users[i], &bytes);
+        __atomic_add_fetch(&w->messages, messages, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->bytes, bytes, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&w->done, 1, __ATOMIC_RELEASE) == w->nusers) {
+            pthread_mutex_lock(&w->lock);
+            pthread_cond_signal(&w->finished);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return NULL;
+}
+
+static void *warmup_main(void *arg) {
+    struct warmup *w = arg;
+    pthread_t threads[WARMUP_MAX_THREADS];
+    struct timespec start;
+    int started = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    w->list = mail_store_users();
+    w->nusers = user_list_len(w->list);
+    w->users = malloc(w->nusers * sizeof(char *));
+    user_list_t list = w->list;
+    for (size_t i = 0; list && w->users; i++, list = user_list_next(list))
+        w->users[i] = user_list_name(list);
+    if (!w->users)
+        w->nusers = 0;
+
+    printf("Warm-up: %zu maildrops, %d threads\n", w->nusers, w->nthreads);
+    for (int i = 0; i < w->nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, warmup_worker, w) == 0)
+            started++;
+    }
+    // Without any worker, this thread does the work itself
+    if (!started)
+        warmup_worker(w);
+
+    pthread_mutex_lock(&w->lock);
+    while (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) < w->nusers) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WARMUP_REPORT_INTERVAL;
+        if (pthread_cond_timedwait(&w->finished, &w->lock, &deadline) == 0)
+            continue;
+        printf("Warm-up: %zu/%zu maildrops, %zu messages, %.1fs\n",
+               __atomic_load_n(&w->done, __ATOMIC_RELAXED), w->nusers,
+               __atomic_load_n(&w->messages, __ATOMIC_RELAXED), elapsed(&start));
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&w->lock);
+    double seconds = elapsed(&start);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("Warm-up done: %zu maildrops, %zu messages, %zu bytes in %.3fs\n",
+           w->nusers, w->messages, w->bytes, seconds);
+    fflush(stdout);
+    free(w->users);
+    user_list_destroy(w->list);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->finished);
+    free(w);
+    return NULL;
+}
+
+/** Starts reading the maildrop of every user in the background. The
+ *  function returns immediately; progress and the time taken are
+ *  printed on the standard output.
+ *
+ *  Parameters: nthreads: Number of threads reading maildrops in
+ *                        parallel (at most WARMUP_MAX_THREADS).
+ *
+ *  Returns: 0 if the warm-up was started, -1 otherwise.
+ */
+int warmup_start(int nthreads) {
+    struct warmup *w = calloc(1, sizeof(struct warmup));
+    if (!w) return -1;
+    if (nthreads > WARMUP_MAX_THREADS)
+        nthreads = WARMUP_MAX_THREADS;
+    w->nthreads = nthreads;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->finished, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, warmup_main, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->finished);
+        free(w);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
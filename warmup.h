@@ -0,0 +1,12 @@
+/* warmup.h
+ * Reads the maildrop of every user in the background at startup, so
+ * the first logins after a restart do not wait for cold directory
+ * scans. The server accepts connections while this is in progress.
+ */
+
+#ifndef _WARMUP_H_
+#define _WARMUP_H_
+
+int warmup_start(int nthreads);
+
+#endif
@@ -0,0 +1,249 @@
+/* wireformat.c
+ * Converts stored mail messages to the format in which they are sent
+ * in a POP3 multi-line response (RFC 1939, section 3).
+ *
+ * The conversion only changes the data at line feeds: a CR is added
+ * before a bare LF, and a dot is added at the start of a line that
+ * starts with a dot. Everything between two line feeds is passed
+ * through, so the data is scanned for LF characters in bulk with a
+ * vectorized kernel (AVX2 or SSE2, chosen at run time, or a scalar
+ * loop), and the output is described as segments of the input with
+ * the added bytes in between.
+ */
+
+#include "wireformat.h"
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WIRE_X86
+#endif
+
+// Bytes added to the output; segments point to these
+static const char dot[] = ".";
+static const char cr[] = "\r";
+
+typedef size_t (*find_lf_fn)(const char *in, size_t pos, size_t len);
+
+/** Internal function that returns the position of the first LF in
+ *  in[pos..len), or len if there is none. One byte at a time.
+ */
+static size_t find_lf_scalar(const char *in, size_t pos, size_t len) {
+    while (pos < len && in[pos] != '\n')
+        pos++;
+    return pos;
+}
+
+#ifdef WIRE_X86
+/** Same as find_lf_scalar, comparing 16 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static size_t find_lf_sse2(const char *in, size_t pos, size_t len) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (in + pos));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return find_lf_scalar(in, pos, len);
+}
+
+/** Same as find_lf_scalar, comparing 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t find_lf_avx2(const char *in, size_t pos, size_t len) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (in + pos));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return find_lf_sse2(in, pos, len);
+}
+#endif
+
+static const struct {
+    const char *name;
+    find_lf_fn find_lf;
+} kernels[] = {
+#ifdef WIRE_X86
+    { "avx2", find_lf_avx2 },
+    { "sse2", find_lf_sse2 },
+#endif
+    { "scalar", find_lf_scalar },
+};
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+// Index in kernels of the kernel in use, or -1 until one is chosen
+static int kernel = -1;
+
+/** Internal function that returns non-zero if the CPU can run a kernel.
+ */
+static int kernel_supported(int k) {
+#ifdef WIRE_X86
+    __builtin_cpu_init();
+    if (!strcmp(kernels[k].name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(kernels[k].name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+/** Internal function that returns the kernel in use, choosing the
+ *  fastest one supported by the CPU the first time it is called.
+ */
+static find_lf_fn current_kernel(void) {
+    int k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (k < 0) {
+        for (k = 0; !kernel_supported(k); k++)
+            ;
+        __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+    }
+    return kernels[k].find_lf;
+}
+
+/** Selects the kernel used to scan messages, e.g., to compare kernels.
+ *  By default, the fastest kernel supported by the CPU is used.
+ *
+ *  Parameters: name: "avx2", "sse2" or "scalar".
+ *
+ *  Returns: 0 on success, -1 if the kernel is unknown or not supported
+ *           by this CPU.
+ */
+int wire_select_kernel(const char *name) {
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        if (!strcmp(kernels[k].name, name) && kernel_supported(k)) {
+            __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/** Returns the name of the kernel used to scan messages.
+ */
+const char *wire_kernel_name(void) {
+    current_kernel();
+    return kernels[__atomic_load_n(&kernel, __ATOMIC_RELAXED)].name;
+}
+
+/** Initializes the conversion state for a new message.
+ */
+void wire_init(struct wire_state *state) {
+    state->line_start = 1;
+    state->prev_cr = 0;
+}
+
+/** Internal function that adds a segment, if it is not empty.
+ */
+static inline void add_segment(struct iovec *iov, size_t *n, const char *base, size_t len) {
+    if (len) {
+        iov[*n].iov_base = (void *) base;
+        iov[*n].iov_len = len;
+        (*n)++;
+    }
+}
+
+/** Converts a chunk of a message into a list of segments, without
+ *  copying it. The segments point into the chunk (and to constant
+ *  data for the bytes that are added), so they can be sent with
+ *  writev as long as the chunk is not modified. A message may be
+ *  converted in any number of chunks; the state keeps track of line
+ *  boundaries between them.
+ *
+ *  Parameters: state: conversion state, from wire_init.
+ *              in: chunk of the message.
+ *              len: number of bytes in the chunk.
+ *              iov: array receiving the segments.
+ *              max_iov: number of entries in iov, at least
+ *                       WIRE_MIN_IOV.
+ *              consumed: receives the number of bytes of the chunk
+ *                        that were converted. This is less than len
+ *                        if iov is full; the rest of the chunk must
+ *                        be passed again.
+ *
+ *  Returns: number of segments written to iov.
+ */
+size_t wire_encode_iov(struct wire_state *state, const char *in, size_t len,
+                       struct iovec *iov, size_t max_iov, size_t *consumed) {
+    find_lf_fn find_lf = current_kernel();
+    size_t n = 0, run = 0, pos = 0;
+
+    // Each line needs at most four segments, plus one for the last run
+    while (pos < len && n + WIRE_MIN_IOV <= max_iov) {
+        if (state->line_start && in[pos] == '.') {
+            add_segment(iov, &n, in + run, pos - run);
+            add_segment(iov, &n, dot, 1);
+            run = pos;
+        }
+        size_t lf = find_lf(in, pos, len);
+        if (lf == len) {
+            state->line_start = 0;
+            state->prev_cr = in[len - 1] == '\r';
+            pos = len;
+            break;
+        }
+        if (!(lf > pos ? in[lf - 1] == '\r' : state->prev_cr)) {
+            add_segment(iov, &n, in + run, lf - run);
+            add_segment(iov, &n, cr, 1);
+            run = lf;
+        }
+        state->line_start = 1;
+        state->prev_cr = 0;
+        pos = lf + 1;
+    }
+    add_segment(iov, &n, in + run, pos - run);
+    *consumed = pos;
+    return n;
+}
+
+/** Converts a chunk of a message, like wire_encode_iov, into a
+ *  contiguous buffer.
+ *
+ *  Parameters: state: conversion state, from wire_init.
+ *              in: chunk of the message.
+ *              len: number of bytes in the chunk.
+ *              out: buffer receiving the converted data. Must have
+ *                   space for at least 2 * len bytes.
+ *
+ *  Returns: number of bytes written to out.
+ */
+size_t wire_encode(struct wire_state *state, const char *in, size_t len, char *out) {
+    struct iovec iov[64];
+    char *start = out;
+    size_t pos = 0, used;
+    while (pos < len) {
+        size_t n = wire_encode_iov(state, in + pos, len - pos, iov, 64, &used);
+        for (size_t i = 0; i < n; i++) {
+            memcpy(out, iov[i].iov_base, iov[i].iov_len);
+            out += iov[i].iov_len;
+        }
+        pos += used;
+    }
+    return out - start;
+}
+
+/** Terminates a converted message: adds a final CRLF if the message
+ *  does not end in a line break, followed by the ".\r\n" terminator.
+ *
+ *  Parameters: state: conversion state, from wire_init.
+ *              out: buffer receiving the data. Must have space for at
+ *                   least 5 bytes.
+ *
+ *  Returns: number of bytes written to out.
+ */
+size_t wire_finish(struct wire_state *state, char *out) {
+    char *start = out;
+    if (!state->line_start) {
+        *out++ = '\r';
+        *out++ = '\n';
+    }
+    *out++ = '.';
+    *out++ = '\r';
+    *out++ = '\n';
+    wire_init(state);
+    return out - start;
+}
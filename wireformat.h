@@ -0,0 +1,34 @@
+/* wireformat.h
+ * Converts stored mail messages to the format in which they are sent
+ * in a POP3 multi-line response: lines end in CRLF, lines starting
+ * with a dot get an extra dot, and the response ends with ".\r\n".
+ */
+
+#ifndef _WIRE_FORMAT_H_
+#define _WIRE_FORMAT_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Upper bound on the output produced by wire_encode for len input
+// bytes, plus the termination added by wire_finish.
+#define WIRE_ENCODED_MAX(len) (2 * (len) + 5)
+
+// Smallest iovec array accepted by wire_encode_iov
+#define WIRE_MIN_IOV 5
+
+struct wire_state {
+    int line_start;
+    int prev_cr;
+};
+
+void   wire_init(struct wire_state *state);
+size_t wire_encode(struct wire_state *state, const char *in, size_t len, char *out);
+size_t wire_encode_iov(struct wire_state *state, const char *in, size_t len,
+                       struct iovec *iov, size_t max_iov, size_t *consumed);
+size_t wire_finish(struct wire_state *state, char *out);
+
+int         wire_select_kernel(const char *name);
+const char *wire_kernel_name(void);
+
+#endif
@@ -0,0 +1,221 @@
+/* wirefuzz.c
+ * Checks the wire-format conversion (wireformat.c) against a simple
+ * reference implementation, with random messages split into random
+ * chunks, for every scanning kernel the CPU supports. Both the
+ * contiguous and the segment (iovec) interfaces are checked.
+ *
+ * Usage: wirefuzz [-n iterations] [-s seed] [-b]
+ *
+ * With -b, measures the conversion throughput of each kernel instead.
+ */
+
+#include "wireformat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_MESSAGE 8192
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_CHUNK (64 * 1024)
+
+static const char *kernel_names[] = { "avx2", "sse2", "scalar" };
+#define NUM_KERNEL_NAMES (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+/** Reference conversion of a whole message, one byte at a time,
+ *  including the terminator.
+ */
+static size_t reference_encode(const char *in, size_t len, char *out) {
+    char *start = out;
+    for (size_t i = 0; i < len; i++) {
+        int line_start = i == 0 || in[i - 1] == '\n';
+        if (line_start && in[i] == '.')
+            *out++ = '.';
+        if (in[i] == '\n' && (i == 0 || in[i - 1] != '\r'))
+            *out++ = '\r';
+        *out++ = in[i];
+    }
+    if (len && in[len - 1] != '\n') {
+        *out++ = '\r';
+        *out++ = '\n';
+    }
+    memcpy(out, ".\r\n", 3);
+    return out + 3 - start;
+}
+
+/** Fills a message with random bytes, mostly line breaks, dots and
+ *  letters, so that the interesting cases are frequent.
+ */
+static void random_message(char *buf, size_t len) {
+    static const char common[] = "\n\n\r\r..ab";
+    for (size_t i = 0; i < len; i++)
+        buf[i] = rand() % 4 ? common[rand() % (sizeof(common) - 1)] : rand() % 256;
+}
+
+static size_t random_chunk(size_t rem) {
+    size_t chunk = rand() % 2 ? rem : (size_t) rand() % (rem + 1);
+    return chunk ? chunk : rem;
+}
+
+/** Converts a message with wire_encode, in random chunks.
+ */
+static size_t chunked_encode(const char *in, size_t len, char *out) {
+    struct wire_state state;
+    size_t pos = 0, n = 0;
+    wire_init(&state);
+    while (pos < len) {
+        size_t chunk = random_chunk(len - pos);
+        n += wire_encode(&state, in + pos, chunk, out + n);
+        pos += chunk;
+    }
+    return n + wire_finish(&state, out + n);
+}
+
+/** Converts a message with wire_encode_iov, in random chunks and with
+ *  iovec arrays of random sizes, and copies the segments to out.
+ */
+static size_t chunked_encode_iov(const char *in, size_t len, char *out) {
+    struct iovec iov[64];
+    struct wire_state state;
+    size_t pos = 0, n = 0;
+    wire_init(&state);
+    while (pos < len) {
+        size_t chunk = random_chunk(len - pos), used;
+        size_t max_iov = WIRE_MIN_IOV + rand() % (64 - WIRE_MIN_IOV + 1);
+        size_t niov = wire_encode_iov(&state, in + pos, chunk, iov, max_iov, &used);
+        if (niov > max_iov || used > chunk || (!used && chunk)) {
+            fprintf(stderr, "wire_encode_iov: %zu segments, %zu of %zu bytes used\n",
+                    niov, used, chunk);
+            return 0;
+        }
+        for (size_t i = 0; i < niov; i++) {
+            memcpy(out + n, iov[i].iov_base, iov[i].iov_len);
+            n += iov[i].iov_len;
+        }
+        pos += used;
+    }
+    return n + wire_finish(&state, out + n);
+}
+
+static int check(const char *what, const char *in, size_t len, const char *exp, size_t explen,
+                 const char *out, size_t outlen) {
+    if (outlen == explen && !memcmp(exp, out, explen))
+        return 0;
+    fprintf(stderr, "%s (%s kernel): mismatch for a %zu-byte message\n",
+            what, wire_kernel_name(), len);
+    return 1;
+}
+
+static int fuzz(long iterations) {
+    static char in[MAX_MESSAGE], exp[WIRE_ENCODED_MAX(MAX_MESSAGE)], out[WIRE_ENCODED_MAX(MAX_MESSAGE)];
+    int errors = 0;
+
+    for (int k = 0; k < NUM_KERNEL_NAMES; k++) {
+        if (wire_select_kernel(kernel_names[k]) < 0) {
+            printf("%s: not supported, skipped\n", kernel_names[k]);
+            continue;
+        }
+        for (long i = 0; i < iterations && errors < 10; i++) {
+            size_t len = rand() % 8 ? rand() % 256 : rand() % MAX_MESSAGE;
+            random_message(in, len);
+            size_t explen = reference_encode(in, len, exp);
+            errors += check("wire_encode", in, len, exp, explen, out, chunked_encode(in, len, out));
+            errors += check("wire_encode_iov", in, len, exp, explen, out,
+                            chunked_encode_iov(in, len, out));
+        }
+        printf("%s: %ld messages checked\n", kernel_names[k], iterations);
+    }
+    return errors;
+}
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/** Measures the throughput of each kernel on text with lines of
+ *  random length, some starting with dots and some ending in bare LF.
+ */
+static void bench(void) {
+    static struct iovec iov[1024];
+    char *in = malloc(BENCH_SIZE), *out = malloc(WIRE_ENCODED_MAX(BENCH_CHUNK));
+    if (!in || !out) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t pos = 0; pos < BENCH_SIZE; ) {
+        size_t line = 20 + rand() % 60;
+        for (size_t i = 0; i < line && pos < BENCH_SIZE; i++)
+            in[pos++] = i == 0 && rand() % 40 == 0 ? '.' : 'a' + rand() % 26;
+        if (pos < BENCH_SIZE - 1 && rand() % 2)
+            in[pos++] = '\r';
+        if (pos < BENCH_SIZE)
+            in[pos++] = '\n';
+    }
+
+    double start = seconds();
+    size_t total = 0;
+    for (size_t pos = 0; pos < BENCH_SIZE; pos += BENCH_CHUNK)
+        total += reference_encode(in + pos, BENCH_CHUNK, out);
+    printf("%-8s %-16s %8.0f MB/s\n", "byte", "reference", BENCH_SIZE / 1e6 / (seconds() - start));
+
+    for (int k = 0; k < NUM_KERNEL_NAMES; k++) {
+        if (wire_select_kernel(kernel_names[k]) < 0)
+            continue;
+        struct wire_state state;
+        wire_init(&state);
+        start = seconds();
+        for (size_t pos = 0; pos < BENCH_SIZE; pos += BENCH_CHUNK)
+            total += wire_encode(&state, in + pos, BENCH_CHUNK, out);
+        printf("%-8s %-16s %8.0f MB/s\n", kernel_names[k], "wire_encode",
+               BENCH_SIZE / 1e6 / (seconds() - start));
+
+        wire_init(&state);
+        start = seconds();
+        for (size_t pos = 0, used; pos < BENCH_SIZE; pos += used)
+            total += wire_encode_iov(&state, in + pos, BENCH_SIZE - pos, iov, 1024, &used);
+        printf("%-8s %-16s %8.0f MB/s\n", kernel_names[k], "wire_encode_iov",
+               BENCH_SIZE / 1e6 / (seconds() - start));
+    }
+    // Keeps the conversions from being optimized away
+    if (!total) printf("\n");
+    free(in);
+    free(out);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 20000;
+    unsigned seed = time(NULL);
+    int benchmark = 0, opt;
+
+    while ((opt = getopt(argc, argv, "n:s:b")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            benchmark = 1;
+            break;
+        default:
+            fprintf(stderr, "Invalid arguments. Expected: %s [-n iterations] [-s seed] [-b]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+    if (benchmark) {
+        bench();
+        return 0;
+    }
+    printf("Seed %u\n", seed);
+    int errors = fuzz(iterations);
+    if (errors)
+        printf("%d mismatches (rerun with -s %u)\n", errors, seed);
+    return errors ? 1 : 0;
+}